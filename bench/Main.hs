@@ -0,0 +1,22 @@
+module Main (main) where
+
+import Foreign.C.String (CString, withCString)
+import Foreign.C.Types (CInt(..))
+import Foreign.Marshal.Array (withArray0)
+import Foreign.Marshal.Utils (withMany)
+import Foreign.Ptr (Ptr, nullPtr)
+import System.Environment (getArgs, getProgName)
+import System.Exit (ExitCode(..), exitWith)
+
+foreign import ccall safe leveldb_rados_bench_main :: CInt -> Ptr CString -> IO CInt
+
+-- | The benchmarks live in bench/RadosBench.cpp, this only hands them the command line
+main :: IO ()
+main = do
+  progName <- getProgName
+  args <- getArgs
+  let argv = progName : args
+  status <- withMany withCString argv $ \ argvStrs ->
+    withArray0 nullPtr argvStrs $ \ argvPtr ->
+      leveldb_rados_bench_main (fromIntegral (length argv)) argvPtr
+  exitWith $ if status == 0 then ExitSuccess else ExitFailure (fromIntegral status)
@@ -0,0 +1,589 @@
+#include <leveldb/db.h>
+#include <leveldb/env.h>
+#include <leveldb/options.h>
+#include <leveldb/write_batch.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "RadosEnv.h"
+
+using namespace std;
+
+// sadly this is internal to LevelDB
+struct leveldb_env_t
+{
+  leveldb::Env* rep;
+  bool is_default;
+};
+
+struct BenchFlags
+{
+  BenchFlags()
+    : config("/etc/ceph/ceph.conf")
+    , pool("leveldb")
+    , dir("bench")
+    , benchmarks("fillseq,fillrandom,overwrite,readrandom,readseq,compact,seqread,randread,appendsync")
+    , num(100000)
+    , reads(-1)
+    , value_size(100)
+    , file_size(64 * 1024 * 1024)
+    , sim_latency_us(-1)
+    , sim_jitter_us(0)
+    , sim_bandwidth(0)
+  {
+  }
+
+  std::string config;
+  std::string pool;
+  std::string dir;
+  std::string benchmarks;
+  long num;
+  long reads;
+  long value_size;
+  long file_size;
+
+  // a simulated pool is used instead of the cluster when the latency is set
+  long sim_latency_us;
+  long sim_jitter_us;
+  long sim_bandwidth;
+};
+
+static uint64_t NowMicros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// xorshift, the workloads only need keys that are spread out and repeatable
+class BenchRandom
+{
+public:
+  explicit BenchRandom(uint64_t seed)
+    : state_(seed | 1)
+  {
+  }
+
+  uint64_t Next()
+  {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+
+  uint64_t Uniform(uint64_t n)
+  {
+    return Next() % n;
+  }
+
+private:
+  uint64_t state_;
+};
+
+static std::string Key(uint64_t i)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%016llu", static_cast<unsigned long long>(i));
+  return buf;
+}
+
+// the result of one benchmark, every op is timed on its own
+class BenchResult
+{
+public:
+  explicit BenchResult(const std::string& name)
+    : name_(name)
+    , start_(NowMicros())
+    , finish_(0)
+    , bytes_(0)
+    , errors_(0)
+  {
+  }
+
+  void Record(uint64_t start, uint64_t bytes, const leveldb::Status& s)
+  {
+    latencies_.push_back(NowMicros() - start);
+    bytes_ += bytes;
+    if (!s.ok() && !s.IsNotFound())
+    {
+      if (errors_ == 0)
+      {
+        cerr << name_ << ": " << s.ToString() << endl;
+      }
+
+      ++errors_;
+    }
+  }
+
+  void Finish()
+  {
+    finish_ = NowMicros();
+  }
+
+  std::string ToJson()
+  {
+    std::sort(latencies_.begin(), latencies_.end());
+    const double seconds = std::max(finish_ - start_, static_cast<uint64_t>(1)) / 1e6;
+
+    std::ostringstream out;
+    out << "{\"name\": \"" << name_ << "\""
+        << ", \"ops\": " << latencies_.size()
+        << ", \"errors\": " << errors_
+        << ", \"bytes\": " << bytes_
+        << ", \"seconds\": " << seconds
+        << ", \"ops_per_sec\": " << latencies_.size() / seconds
+        << ", \"mb_per_sec\": " << bytes_ / seconds / (1024 * 1024)
+        << ", \"latency_us\": {\"p50\": " << Percentile(0.5)
+        << ", \"p90\": " << Percentile(0.9)
+        << ", \"p99\": " << Percentile(0.99)
+        << ", \"p999\": " << Percentile(0.999)
+        << ", \"max\": " << (latencies_.empty() ? 0 : latencies_.back())
+        << "}}";
+
+    return out.str();
+  }
+
+private:
+  uint64_t Percentile(double p) const
+  {
+    if (latencies_.empty())
+    {
+      return 0;
+    }
+
+    return latencies_[std::min(latencies_.size() - 1, static_cast<size_t>(p * latencies_.size()))];
+  }
+
+  const std::string name_;
+  const uint64_t start_;
+  uint64_t finish_;
+  uint64_t bytes_;
+  uint64_t errors_;
+  std::vector<uint64_t> latencies_;
+};
+
+class Benchmark
+{
+public:
+  Benchmark(leveldb::Env* env, const BenchFlags& flags)
+    : env_(env)
+    , flags_(flags)
+    , db_(NULL)
+    , value_(flags.value_size, 'x')
+  {
+  }
+
+  ~Benchmark()
+  {
+    delete db_;
+  }
+
+  // returns false for benchmarks that don't exist
+  bool Run(const std::string& name, std::string* json)
+  {
+    BenchResult result(name);
+
+    if (name == "fillseq")
+    {
+      Fill(&result, true, true);
+    }
+    else if (name == "fillrandom")
+    {
+      Fill(&result, false, true);
+    }
+    else if (name == "overwrite")
+    {
+      Fill(&result, false, false);
+    }
+    else if (name == "readrandom")
+    {
+      ReadRandom(&result);
+    }
+    else if (name == "readseq")
+    {
+      ReadSequential(&result);
+    }
+    else if (name == "compact")
+    {
+      Compact(&result);
+    }
+    else if (name == "seqread")
+    {
+      // the sizes the log reader, the repairer and a plain copy read with
+      FileSequentialRead(&result, 4 * 1024);
+      result.Finish();
+      *json = result.ToJson();
+
+      for (size_t size = 32 * 1024; size <= 1024 * 1024; size *= 32)
+      {
+        std::ostringstream sized;
+        sized << name << "_" << size / 1024 << "k";
+        BenchResult more(sized.str());
+        FileSequentialRead(&more, size);
+        more.Finish();
+        *json += ",\n  " + more.ToJson();
+      }
+
+      return true;
+    }
+    else if (name == "randread")
+    {
+      FileRandomRead(&result);
+    }
+    else if (name == "appendsync")
+    {
+      FileAppendSync(&result);
+    }
+    else
+    {
+      return false;
+    }
+
+    result.Finish();
+    *json = result.ToJson();
+
+    return true;
+  }
+
+private:
+  leveldb::DB* OpenDB(bool fresh)
+  {
+    if (fresh)
+    {
+      delete db_;
+      db_ = NULL;
+
+      leveldb::Options options;
+      options.env = env_;
+      leveldb::DestroyDB(flags_.dir, options);
+    }
+
+    if (db_ == NULL)
+    {
+      leveldb::Options options;
+      options.env = env_;
+      options.create_if_missing = true;
+      leveldb::Status s = leveldb::DB::Open(options, flags_.dir, &db_);
+      if (!s.ok())
+      {
+        cerr << "open " << flags_.dir << ": " << s.ToString() << endl;
+        exit(1);
+      }
+    }
+
+    return db_;
+  }
+
+  void Fill(BenchResult* result, bool sequential, bool fresh)
+  {
+    leveldb::DB* db = OpenDB(fresh);
+    BenchRandom rnd(301);
+    leveldb::WriteOptions options;
+    for (long i = 0; i < flags_.num; ++i)
+    {
+      const std::string key = Key(sequential ? i : rnd.Uniform(flags_.num));
+      const uint64_t start = NowMicros();
+      leveldb::Status s = db->Put(options, key, value_);
+      result->Record(start, key.size() + value_.size(), s);
+    }
+  }
+
+  void ReadRandom(BenchResult* result)
+  {
+    leveldb::DB* db = OpenDB(false);
+    BenchRandom rnd(302);
+    leveldb::ReadOptions options;
+    std::string value;
+    const long reads = flags_.reads < 0 ? flags_.num : flags_.reads;
+    for (long i = 0; i < reads; ++i)
+    {
+      const std::string key = Key(rnd.Uniform(flags_.num));
+      const uint64_t start = NowMicros();
+      leveldb::Status s = db->Get(options, key, &value);
+      result->Record(start, s.ok() ? key.size() + value.size() : 0, s);
+    }
+  }
+
+  void ReadSequential(BenchResult* result)
+  {
+    leveldb::DB* db = OpenDB(false);
+    leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
+    uint64_t start = NowMicros();
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+      result->Record(start, it->key().size() + it->value().size(), leveldb::Status::OK());
+      start = NowMicros();
+    }
+
+    result->Record(start, 0, it->status());
+    delete it;
+  }
+
+  // random overwrites followed by a full compaction, the compaction is the
+  // single timed op
+  void Compact(BenchResult* result)
+  {
+    leveldb::DB* db = OpenDB(false);
+    BenchRandom rnd(303);
+    leveldb::WriteOptions options;
+    for (long i = 0; i < flags_.num; ++i)
+    {
+      db->Put(options, Key(rnd.Uniform(flags_.num)), value_);
+    }
+
+    const uint64_t start = NowMicros();
+    db->CompactRange(NULL, NULL);
+    result->Record(start, 0, leveldb::Status::OK());
+  }
+
+  // write a file of flags_.file_size bytes for the file benchmarks, once
+  std::string BenchFile()
+  {
+    const std::string fname = flags_.dir + "/bench.data";
+    uint64_t size = 0;
+    if (env_->GetFileSize(fname, &size).ok() && size == static_cast<uint64_t>(flags_.file_size))
+    {
+      return fname;
+    }
+
+    env_->CreateDir(flags_.dir);
+
+    leveldb::WritableFile* file = NULL;
+    leveldb::Status s = env_->NewWritableFile(fname, &file);
+    const std::string chunk(1024 * 1024, 'x');
+    for (long written = 0; s.ok() && written < flags_.file_size; written += chunk.size())
+    {
+      s = file->Append(leveldb::Slice(chunk.data(), std::min(static_cast<long>(chunk.size()), flags_.file_size - written)));
+    }
+
+    if (s.ok())
+    {
+      s = file->Close();
+    }
+
+    delete file;
+    if (!s.ok())
+    {
+      cerr << "write " << fname << ": " << s.ToString() << endl;
+      exit(1);
+    }
+
+    return fname;
+  }
+
+  void FileSequentialRead(BenchResult* result, size_t size)
+  {
+    leveldb::SequentialFile* file = NULL;
+    leveldb::Status s = env_->NewSequentialFile(BenchFile(), &file);
+    if (!s.ok())
+    {
+      result->Record(NowMicros(), 0, s);
+      return;
+    }
+
+    std::vector<char> scratch(size);
+    for (;;)
+    {
+      leveldb::Slice data;
+      const uint64_t start = NowMicros();
+      s = file->Read(size, &data, &scratch[0]);
+      result->Record(start, data.size(), s);
+      if (!s.ok() || data.size() < size)
+      {
+        break;
+      }
+    }
+
+    delete file;
+  }
+
+  void FileRandomRead(BenchResult* result)
+  {
+    // the size of a table block
+    const size_t size = 4 * 1024;
+
+    leveldb::RandomAccessFile* file = NULL;
+    leveldb::Status s = env_->NewRandomAccessFile(BenchFile(), &file);
+    if (!s.ok())
+    {
+      result->Record(NowMicros(), 0, s);
+      return;
+    }
+
+    BenchRandom rnd(304);
+    std::vector<char> scratch(size);
+    const long reads = flags_.reads < 0 ? flags_.num : flags_.reads;
+    for (long i = 0; i < reads; ++i)
+    {
+      leveldb::Slice data;
+      const uint64_t start = NowMicros();
+      s = file->Read(rnd.Uniform(flags_.file_size - size), size, &data, &scratch[0]);
+      result->Record(start, data.size(), s);
+    }
+
+    delete file;
+  }
+
+  // what a sync=true write costs the WAL
+  void FileAppendSync(BenchResult* result)
+  {
+    const std::string fname = flags_.dir + "/bench.log";
+    env_->CreateDir(flags_.dir);
+
+    leveldb::WritableFile* file = NULL;
+    leveldb::Status s = env_->NewWritableFile(fname, &file);
+    if (!s.ok())
+    {
+      result->Record(NowMicros(), 0, s);
+      return;
+    }
+
+    const long ops = std::min(flags_.num, 10000L);
+    for (long i = 0; i < ops && s.ok(); ++i)
+    {
+      const uint64_t start = NowMicros();
+      s = file->Append(value_);
+      if (s.ok())
+      {
+        s = file->Sync();
+      }
+
+      result->Record(start, value_.size(), s);
+    }
+
+    file->Close();
+    delete file;
+    env_->DeleteFile(fname);
+  }
+
+  leveldb::Env* const env_;
+  const BenchFlags flags_;
+  leveldb::DB* db_;
+  const std::string value_;
+};
+
+static bool ParseFlag(const char* arg, const char* name, std::string* value)
+{
+  const size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+  {
+    return false;
+  }
+
+  *value = arg + len + 1;
+  return true;
+}
+
+static bool ParseFlag(const char* arg, const char* name, long* value)
+{
+  std::string str;
+  if (!ParseFlag(arg, name, &str))
+  {
+    return false;
+  }
+
+  *value = strtol(str.c_str(), NULL, 10);
+  return true;
+}
+
+// Runs the benchmarks named by --benchmarks against a RadosEnv and prints a
+// JSON document with a result per benchmark, followed by the env's own stats
+extern "C" int leveldb_rados_bench_main(int argc, char** argv)
+{
+  BenchFlags flags;
+  for (int i = 1; i < argc; ++i)
+  {
+    const char* arg = argv[i];
+    if (!(ParseFlag(arg, "--config", &flags.config)
+       || ParseFlag(arg, "--pool", &flags.pool)
+       || ParseFlag(arg, "--dir", &flags.dir)
+       || ParseFlag(arg, "--benchmarks", &flags.benchmarks)
+       || ParseFlag(arg, "--num", &flags.num)
+       || ParseFlag(arg, "--reads", &flags.reads)
+       || ParseFlag(arg, "--value_size", &flags.value_size)
+       || ParseFlag(arg, "--file_size", &flags.file_size)
+       || ParseFlag(arg, "--sim_latency_us", &flags.sim_latency_us)
+       || ParseFlag(arg, "--sim_jitter_us", &flags.sim_jitter_us)
+       || ParseFlag(arg, "--sim_bandwidth", &flags.sim_bandwidth)))
+    {
+      cerr << "unknown flag " << arg << endl;
+      return 1;
+    }
+  }
+
+  leveldb_env_t* env = NULL;
+  if (flags.sim_latency_us >= 0)
+  {
+    leveldb_rados_options_t* options = leveldb_rados_options_create();
+    env = leveldb_create_rados_sim_env(flags.sim_latency_us, flags.sim_jitter_us, flags.sim_bandwidth, options);
+    leveldb_rados_options_destroy(options);
+  }
+  else
+  {
+    env = leveldb_create_rados_env(flags.config.c_str(), flags.pool.c_str());
+  }
+
+  if (env == NULL)
+  {
+    return 1;
+  }
+
+  int status = 0;
+  {
+    Benchmark bench(env->rep, flags);
+    cout << "{\"results\": [";
+
+    std::istringstream names(flags.benchmarks);
+    std::string name;
+    bool first = true;
+    while (std::getline(names, name, ','))
+    {
+      std::string json;
+      if (!bench.Run(name, &json))
+      {
+        cerr << "unknown benchmark " << name << endl;
+        status = 1;
+        continue;
+      }
+
+      cout << (first ? "\n  " : ",\n  ") << json << flush;
+      first = false;
+    }
+
+    cout << "\n]";
+  }
+
+  char* stats = leveldb_rados_env_get_stats(env);
+  if (stats != NULL)
+  {
+    cout << ", \"env_stats\": \"";
+    for (const char* c = stats; *c != '\0'; ++c)
+    {
+      if (*c == '\n')
+      {
+        cout << "\\n";
+      }
+      else
+      {
+        cout << *c;
+      }
+    }
+
+    cout << "\"";
+    free(stats);
+  }
+
+  cout << "}" << endl;
+
+  leveldb_env_destroy(env);
+
+  return status;
+}
@@ -0,0 +1,277 @@
+#include "RadosBackend.h"
+#include <memory>
+#include <boost/thread/mutex.hpp>
+
+// RadosBackend on top of a real cluster
+
+class LibradosCompletion : public RadosCompletion
+{
+public:
+  LibradosCompletion()
+    : c_(librados::Rados::aio_create_completion())
+  {
+  }
+
+  virtual ~LibradosCompletion()
+  {
+    c_->release();
+  }
+
+  virtual void WaitForComplete()
+  {
+    c_->wait_for_complete();
+  }
+
+  virtual void WaitForSafe()
+  {
+    c_->wait_for_safe();
+  }
+
+  virtual bool IsComplete()
+  {
+    return c_->is_complete();
+  }
+
+  virtual int ReturnValue()
+  {
+    return c_->get_return_value();
+  }
+
+  librados::AioCompletion* get() const
+  {
+    return c_;
+  }
+
+private:
+  librados::AioCompletion* const c_;
+};
+
+class LibradosWatchCtx : public librados::WatchCtx
+{
+public:
+  explicit LibradosWatchCtx(RadosWatcher* watcher)
+    : watcher_(watcher)
+  {
+  }
+
+  virtual void notify(uint8_t opcode, uint64_t ver, librados::bufferlist& bl)
+  {
+    watcher_->Notified();
+  }
+
+private:
+  RadosWatcher* const watcher_;
+};
+
+class LibradosBackend : public RadosBackend
+{
+public:
+  LibradosBackend(const boost::shared_ptr<librados::Rados>& rados, librados::IoCtx& ioctx)
+    : rados_(rados)
+  {
+    ioctx_.dup(ioctx);
+
+    std::string fsid;
+    rados_->cluster_fsid(&fsid);
+    name_ = fsid + "/" + ioctx_.get_pool_name();
+  }
+
+  virtual boost::shared_ptr<RadosBackend> ForNamespace(const std::string& ns) const
+  {
+    boost::shared_ptr<LibradosBackend> backend(new LibradosBackend(rados_, ioctx_));
+    backend->ioctx_.set_namespace(ns);
+    return backend;
+  }
+
+  virtual std::string Name() const
+  {
+    return name_;
+  }
+
+  virtual RadosCompletion* NewCompletion()
+  {
+    return new LibradosCompletion;
+  }
+
+  virtual int AioOperate(const std::string& oid, RadosCompletion* c, const RadosWriteOp& op)
+  {
+    // each write is sent with the snapshot context as it is right now
+    boost::mutex::scoped_lock lock(snap_mutex_);
+    librados::AioCompletion* completion = static_cast<LibradosCompletion*>(c)->get();
+    if (op.steps.size() == 1 && op.steps[0].type == RadosWriteOp::Step::kAppend)
+    {
+      const librados::bufferlist& bl = op.steps[0].bl;
+      return ioctx_.aio_append(oid, completion, bl, bl.length());
+    }
+    else if (op.steps.size() == 1 && op.steps[0].type == RadosWriteOp::Step::kRemove)
+    {
+      return ioctx_.aio_remove(oid, completion);
+    }
+
+    librados::ObjectWriteOperation write;
+    for (std::vector<RadosWriteOp::Step>::const_iterator it = op.steps.begin(); it != op.steps.end(); ++it)
+    {
+      switch (it->type)
+      {
+        case RadosWriteOp::Step::kCreate:
+          write.create(it->exclusive);
+          break;
+        case RadosWriteOp::Step::kSetXattr:
+          write.setxattr(it->name.c_str(), it->bl);
+          break;
+        case RadosWriteOp::Step::kAppend:
+          write.append(it->bl);
+          break;
+        case RadosWriteOp::Step::kWriteFull:
+          write.write_full(it->bl);
+          break;
+        case RadosWriteOp::Step::kRemove:
+          write.remove();
+          break;
+        case RadosWriteOp::Step::kOmapSet:
+          write.omap_set(it->vals);
+          break;
+        case RadosWriteOp::Step::kOmapRmKeys:
+          write.omap_rm_keys(it->keys);
+          break;
+        case RadosWriteOp::Step::kCopyFrom:
+          write.copy_from(it->name, static_cast<const LibradosBackend*>(it->src)->ioctx_, it->version);
+          break;
+      }
+    }
+
+    return ioctx_.aio_operate(oid, completion, &write);
+  }
+
+  virtual int AioOperate(const std::string& oid, RadosCompletion* c, const RadosReadOp& op)
+  {
+    librados::AioCompletion* completion = static_cast<LibradosCompletion*>(c)->get();
+    if (op.steps.size() == 1 && op.steps[0].type == RadosReadOp::Step::kRead)
+    {
+      // aio_read is the one that can read into a static buffer and that
+      // completes with the length read
+      const RadosReadOp::Step& step = op.steps[0];
+      return ioctx_.aio_read(oid, completion, step.bl, step.len, step.off);
+    }
+
+    librados::ObjectReadOperation read;
+    for (std::vector<RadosReadOp::Step>::const_iterator it = op.steps.begin(); it != op.steps.end(); ++it)
+    {
+      switch (it->type)
+      {
+        case RadosReadOp::Step::kStat:
+          read.stat(it->size, NULL, it->rval);
+          break;
+        case RadosReadOp::Step::kRead:
+          read.read(it->off, it->len, it->bl, it->rval);
+          break;
+        case RadosReadOp::Step::kGetXattrs:
+          read.getxattrs(it->vals, it->rval);
+          break;
+        case RadosReadOp::Step::kOmapGetVals:
+          read.omap_get_vals(it->start_after, it->len, it->vals, it->rval);
+          break;
+      }
+    }
+
+    return ioctx_.aio_operate(oid, completion, &read, NULL);
+  }
+
+  virtual int ListObjects(std::vector<std::string>* oids)
+  {
+    for (librados::ObjectIterator it = ioctx_.objects_begin(); it != ioctx_.objects_end(); ++it)
+    {
+      const std::pair<std::string, std::string>& cur = *it;
+      oids->push_back(cur.first);
+    }
+
+    return 0;
+  }
+
+  virtual int Lock(const std::string& oid, const std::string& name, const std::string& cookie, bool exclusive, uint32_t duration, bool renew)
+  {
+    struct timeval tv = { static_cast<time_t>(duration), 0 };
+    struct timeval* expires = duration > 0 ? &tv : NULL;
+    const uint8_t flags = renew ? LIBRADOS_LOCK_FLAG_RENEW : 0;
+    if (exclusive)
+    {
+      return ioctx_.lock_exclusive(oid, name, cookie, "", expires, flags);
+    }
+
+    return ioctx_.lock_shared(oid, name, cookie, "", "", expires, flags);
+  }
+
+  virtual int Unlock(const std::string& oid, const std::string& name, const std::string& cookie)
+  {
+    return ioctx_.unlock(oid, name, cookie);
+  }
+
+  virtual int Watch(const std::string& oid, RadosWatcher* watcher, uint64_t* handle)
+  {
+    std::auto_ptr<LibradosWatchCtx> ctx(new LibradosWatchCtx(watcher));
+    int err = ioctx_.watch(oid, 0, handle, ctx.get());
+    if (err < 0)
+    {
+      return err;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    watches_[*handle] = boost::shared_ptr<LibradosWatchCtx>(ctx.release());
+    return 0;
+  }
+
+  virtual int Unwatch(const std::string& oid, uint64_t handle)
+  {
+    int err = ioctx_.unwatch(oid, handle);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    watches_.erase(handle);
+    return err;
+  }
+
+  virtual int Notify(const std::string& oid)
+  {
+    librados::bufferlist bl;
+    return ioctx_.notify(oid, 0, bl);
+  }
+
+  virtual int SnapCreate(uint64_t* snap)
+  {
+    return ioctx_.selfmanaged_snap_create(snap);
+  }
+
+  virtual int SnapRemove(uint64_t snap)
+  {
+    return ioctx_.selfmanaged_snap_remove(snap);
+  }
+
+  virtual int SetWriteSnaps(const std::vector<uint64_t>& snaps)
+  {
+    std::vector<librados::snap_t> context(snaps.begin(), snaps.end());
+
+    boost::mutex::scoped_lock lock(snap_mutex_);
+    return ioctx_.selfmanaged_snap_set_write_ctx(context.empty() ? 0 : context.front(), context);
+  }
+
+  virtual void SetReadSnap(uint64_t snap)
+  {
+    ioctx_.snap_set_read(snap != 0 ? snap : LIBRADOS_SNAP_HEAD);
+  }
+
+private:
+  const boost::shared_ptr<librados::Rados> rados_;
+  mutable librados::IoCtx ioctx_;
+  std::string name_;
+
+  // the write context can't change while a write is being sent
+  boost::mutex snap_mutex_;
+
+  // the context of every watch, freed once it is unwatched
+  boost::mutex mutex_;
+  std::map<uint64_t, boost::shared_ptr<LibradosWatchCtx> > watches_;
+};
+
+boost::shared_ptr<RadosBackend> NewLibradosBackend(const boost::shared_ptr<librados::Rados>& rados, librados::IoCtx& ioctx)
+{
+  return boost::shared_ptr<RadosBackend>(new LibradosBackend(rados, ioctx));
+}
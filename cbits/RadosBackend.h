@@ -0,0 +1,399 @@
+#ifndef LEVELDB_RADOS_BACKEND_H
+#define LEVELDB_RADOS_BACKEND_H
+
+#include <rados/librados.hpp>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+class RadosBackend;
+
+// Told about notifies sent to an object it watches, on a thread of the
+// backend's. It must not call back into the backend from there
+class RadosWatcher
+{
+public:
+  virtual ~RadosWatcher()
+  {
+  }
+
+  virtual void Notified() = 0;
+};
+
+// The progress of an op sent to a RadosBackend, same as an AioCompletion
+// but freed with delete
+class RadosCompletion
+{
+public:
+  virtual ~RadosCompletion()
+  {
+  }
+
+  virtual void WaitForComplete() = 0;
+
+  // complete and durable
+  virtual void WaitForSafe() = 0;
+
+  virtual bool IsComplete() = 0;
+
+  virtual int ReturnValue() = 0;
+};
+
+// A compound read, the steps are done in order against a single object and
+// stop at the first one that fails. Every output has to stay valid until
+// the op completes, rval may be NULL. Like aio_read, an op that is a single
+// Read completes with the number of bytes read, others complete with 0
+class RadosReadOp
+{
+public:
+  struct Step
+  {
+    enum Type
+    {
+      kStat,
+      kRead,
+      kGetXattrs,
+      kOmapGetVals
+    };
+
+    Step(Type type, int* rval)
+      : type(type)
+      , off(0)
+      , len(0)
+      , size(NULL)
+      , bl(NULL)
+      , vals(NULL)
+      , rval(rval)
+    {
+    }
+
+    Type type;
+    uint64_t off;
+    uint64_t len;
+    std::string start_after;
+    uint64_t* size;
+    librados::bufferlist* bl;
+    // xattrs or omap values
+    std::map<std::string, librados::bufferlist>* vals;
+    int* rval;
+  };
+
+  void Stat(uint64_t* size, int* rval)
+  {
+    Step step(Step::kStat, rval);
+    step.size = size;
+    steps.push_back(step);
+  }
+
+  // a bl that wraps a static buffer of len bytes may be read into directly
+  void Read(uint64_t off, uint64_t len, librados::bufferlist* bl, int* rval)
+  {
+    Step step(Step::kRead, rval);
+    step.off = off;
+    step.len = len;
+    step.bl = bl;
+    steps.push_back(step);
+  }
+
+  void GetXattrs(std::map<std::string, librados::bufferlist>* xattrs, int* rval)
+  {
+    Step step(Step::kGetXattrs, rval);
+    step.vals = xattrs;
+    steps.push_back(step);
+  }
+
+  void OmapGetVals(const std::string& start_after, uint64_t max_return, std::map<std::string, librados::bufferlist>* vals, int* rval)
+  {
+    Step step(Step::kOmapGetVals, rval);
+    step.start_after = start_after;
+    step.len = max_return;
+    step.vals = vals;
+    steps.push_back(step);
+  }
+
+  std::vector<Step> steps;
+};
+
+// A compound write, applied atomically to a single object
+class RadosWriteOp
+{
+public:
+  struct Step
+  {
+    enum Type
+    {
+      kCreate,
+      kSetXattr,
+      kAppend,
+      kWriteFull,
+      kRemove,
+      kOmapSet,
+      kOmapRmKeys,
+      kCopyFrom
+    };
+
+    explicit Step(Type type)
+      : type(type)
+      , exclusive(false)
+      , src(NULL)
+      , version(0)
+    {
+    }
+
+    Type type;
+    bool exclusive;
+    // xattr name or copy source
+    std::string name;
+    librados::bufferlist bl;
+    std::map<std::string, librados::bufferlist> vals;
+    std::set<std::string> keys;
+    const RadosBackend* src;
+    uint64_t version;
+  };
+
+  void Create(bool exclusive)
+  {
+    Step step(Step::kCreate);
+    step.exclusive = exclusive;
+    steps.push_back(step);
+  }
+
+  void SetXattr(const std::string& name, const librados::bufferlist& bl)
+  {
+    Step step(Step::kSetXattr);
+    step.name = name;
+    step.bl = bl;
+    steps.push_back(step);
+  }
+
+  void Append(const librados::bufferlist& bl)
+  {
+    Step step(Step::kAppend);
+    step.bl = bl;
+    steps.push_back(step);
+  }
+
+  void WriteFull(const librados::bufferlist& bl)
+  {
+    Step step(Step::kWriteFull);
+    step.bl = bl;
+    steps.push_back(step);
+  }
+
+  void Remove()
+  {
+    steps.push_back(Step(Step::kRemove));
+  }
+
+  void OmapSet(const std::map<std::string, librados::bufferlist>& vals)
+  {
+    Step step(Step::kOmapSet);
+    step.vals = vals;
+    steps.push_back(step);
+  }
+
+  void OmapRmKeys(const std::set<std::string>& keys)
+  {
+    Step step(Step::kOmapRmKeys);
+    step.keys = keys;
+    steps.push_back(step);
+  }
+
+  // copy data, xattrs and omap of oid in src, version 0 is whatever is current
+  void CopyFrom(const std::string& oid, const RadosBackend& src, uint64_t version)
+  {
+    Step step(Step::kCopyFrom);
+    step.name = oid;
+    step.src = &src;
+    step.version = version;
+    steps.push_back(step);
+  }
+
+  std::vector<Step> steps;
+};
+
+// The object store a RadosEnv runs on: a pool and a namespace in it, just
+// like an IoCtx. Implementations only provide the asynchronous ops, the
+// synchronous ones send an op and wait for it
+class RadosBackend
+{
+public:
+  virtual ~RadosBackend()
+  {
+  }
+
+  // the same pool with objects in the namespace ns
+  virtual boost::shared_ptr<RadosBackend> ForNamespace(const std::string& ns) const = 0;
+
+  // the cluster and pool, the same for every namespace. it tells apart
+  // files with the same name kept on local disk for different pools
+  virtual std::string Name() const = 0;
+
+  virtual RadosCompletion* NewCompletion() = 0;
+
+  // both return an error code if the op could not be sent, the result of
+  // the op itself is in c
+  virtual int AioOperate(const std::string& oid, RadosCompletion* c, const RadosWriteOp& op) = 0;
+  virtual int AioOperate(const std::string& oid, RadosCompletion* c, const RadosReadOp& op) = 0;
+
+  // names of every object in the namespace
+  virtual int ListObjects(std::vector<std::string>* oids) = 0;
+
+  // take the advisory lock name on oid as cookie, like cls_lock. the object
+  // is created if needed. a lock held by someone else fails with -EBUSY,
+  // holding it already fails with -EEXIST unless renew is set. the lock
+  // expires after duration seconds unless renewed again, 0 never expires
+  virtual int Lock(const std::string& oid, const std::string& name, const std::string& cookie, bool exclusive, uint32_t duration, bool renew) = 0;
+  virtual int Unlock(const std::string& oid, const std::string& name, const std::string& cookie) = 0;
+
+  // watch an object that exists until Unwatch, watcher has to stay valid
+  // until then. Notify reaches every watcher of oid, in any process
+  virtual int Watch(const std::string& oid, RadosWatcher* watcher, uint64_t* handle) = 0;
+  virtual int Unwatch(const std::string& oid, uint64_t handle) = 0;
+  virtual int Notify(const std::string& oid) = 0;
+
+  // self-managed snapshots of the pool, ids are never 0
+  virtual int SnapCreate(uint64_t* snap) = 0;
+  virtual int SnapRemove(uint64_t snap) = 0;
+
+  // writes sent from now on preserve the objects as of every one of snaps,
+  // newest first. reads see the objects as of snap, 0 is the current
+  // state. namespaces created afterwards start out with the same settings
+  virtual int SetWriteSnaps(const std::vector<uint64_t>& snaps) = 0;
+  virtual void SetReadSnap(uint64_t snap) = 0;
+
+  int Operate(const std::string& oid, const RadosWriteOp& op)
+  {
+    return Wait(oid, op);
+  }
+
+  int Operate(const std::string& oid, const RadosReadOp& op)
+  {
+    return Wait(oid, op);
+  }
+
+  int AioRead(const std::string& oid, RadosCompletion* c, librados::bufferlist* bl, size_t n, uint64_t off)
+  {
+    RadosReadOp op;
+    op.Read(off, n, bl, NULL);
+    return AioOperate(oid, c, op);
+  }
+
+  int AioStat(const std::string& oid, RadosCompletion* c, uint64_t* size)
+  {
+    RadosReadOp op;
+    op.Stat(size, NULL);
+    return AioOperate(oid, c, op);
+  }
+
+  int AioAppend(const std::string& oid, RadosCompletion* c, const librados::bufferlist& bl)
+  {
+    RadosWriteOp op;
+    op.Append(bl);
+    return AioOperate(oid, c, op);
+  }
+
+  int AioRemove(const std::string& oid, RadosCompletion* c)
+  {
+    RadosWriteOp op;
+    op.Remove();
+    return AioOperate(oid, c, op);
+  }
+
+  // returns the number of bytes read or a negative error code
+  int Read(const std::string& oid, librados::bufferlist* bl, size_t n, uint64_t off)
+  {
+    RadosReadOp op;
+    op.Read(off, n, bl, NULL);
+    return Wait(oid, op);
+  }
+
+  int Stat(const std::string& oid, uint64_t* size)
+  {
+    RadosReadOp op;
+    op.Stat(size, NULL);
+    return Wait(oid, op);
+  }
+
+  int Create(const std::string& oid, bool exclusive)
+  {
+    RadosWriteOp op;
+    op.Create(exclusive);
+    return Wait(oid, op);
+  }
+
+  int WriteFull(const std::string& oid, const librados::bufferlist& bl)
+  {
+    RadosWriteOp op;
+    op.WriteFull(bl);
+    return Wait(oid, op);
+  }
+
+  int Remove(const std::string& oid)
+  {
+    RadosWriteOp op;
+    op.Remove();
+    return Wait(oid, op);
+  }
+
+  int OmapGetVals(const std::string& oid, const std::string& start_after, uint64_t max_return, std::map<std::string, librados::bufferlist>* vals)
+  {
+    RadosReadOp op;
+    op.OmapGetVals(start_after, max_return, vals, NULL);
+    return Wait(oid, op);
+  }
+
+  int OmapRmKeys(const std::string& oid, const std::set<std::string>& keys)
+  {
+    RadosWriteOp op;
+    op.OmapRmKeys(keys);
+    return Wait(oid, op);
+  }
+
+private:
+  template <typename Op>
+  int Wait(const std::string& oid, const Op& op)
+  {
+    RadosCompletion* c = NewCompletion();
+    int err = AioOperate(oid, c, op);
+    if (err == 0)
+    {
+      c->WaitForComplete();
+      err = c->ReturnValue();
+    }
+
+    delete c;
+    return err;
+  }
+};
+
+// a pool of a connected cluster, rados is kept alive for as long as the
+// backend or any of its namespaces
+boost::shared_ptr<RadosBackend> NewLibradosBackend(const boost::shared_ptr<librados::Rados>& rados, librados::IoCtx& ioctx);
+
+// How a simulated backend behaves. Every op takes latency microseconds,
+// give or take up to jitter, plus the time its payload takes to move at
+// bandwidth bytes per second. 0 bandwidth is unlimited
+struct RadosSimOptions
+{
+  RadosSimOptions()
+    : latency(0)
+    , jitter(0)
+    , bandwidth(0)
+    , seed(0)
+  {
+  }
+
+  uint64_t latency;
+  uint64_t jitter;
+  uint64_t bandwidth;
+  // the jitter is drawn from a generator seeded with this
+  uint64_t seed;
+};
+
+// an empty in-memory pool, for measuring the env without a cluster
+boost::shared_ptr<RadosBackend> NewSimulatedBackend(const RadosSimOptions& options);
+
+#endif
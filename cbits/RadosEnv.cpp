@@ -1,12 +1,34 @@
 #include <rados/librados.hpp>
+#include <leveldb/cache.h>
+#include <leveldb/comparator.h>
 #include <leveldb/db.h>
 #include <leveldb/env.h>
 #include <leveldb/options.h>
+#include <leveldb/table.h>
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <deque>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
+#include <set>
+#include <sstream>
+#include <cstdarg>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include <boost/filesystem/path.hpp>
-#include <boost/make_shared.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/weak_ptr.hpp>
 
+#include "RadosBackend.h"
 #include "RadosEnv.h"
 
 using namespace std;
@@ -16,349 +38,6912 @@ static leveldb::Status IOError(const std::string& context, int err_number) {
   return leveldb::Status::IOError(context, strerror(err_number));
 }
 
-class RadosSequentialFile : public leveldb::SequentialFile
+// finish a read into a bufferlist that was set up to wrap dest, returns
+// the number of bytes read
+static size_t CompleteReadInto(const librados::bufferlist& bl, size_t r, char* dest)
 {
-public:
-  RadosSequentialFile(const boost::shared_ptr<librados::IoCtx>& ctx, const std::string& fname)
-    : ctx_(ctx)
-    , fname_(fname)
-    , off_(0)
+  const size_t len = std::min(r, static_cast<size_t>(bl.length()));
+  if (len > 0 && (bl.buffers().size() != 1 || bl.buffers().front().c_str() != dest))
   {
+    // the payload ended up in buffers of librados' own
+    bl.copy(0, len, dest);
   }
 
-private:
-  virtual leveldb::Status Read(size_t n, leveldb::Slice* result, char* scratch)
+  return len;
+}
+
+// read straight into dest by handing the backend a bufferlist that wraps
+// it, returns the number of bytes read or a negative error code
+static int ReadInto(RadosBackend& ctx, const std::string& oid, char* dest, size_t n, uint64_t off)
+{
+  librados::bufferlist bl;
+  bl.push_back(ceph::buffer::create_static(n, dest));
+  const int r = ctx.Read(oid, &bl, n, off);
+  if (r < 0)
   {
-    librados::bufferlist bl;
-    const int r = ctx_->read(fname_, bl, n, off_);
-    if (r < 0)
+    return r;
+  }
+
+  return CompleteReadInto(bl, r, dest);
+}
+
+// every directory is stored in a RADOS namespace of its own, and the files
+// in it are objects named after the last component of their path
+static std::string ObjectName(const std::string& fname)
+{
+  return path(fname).filename().string();
+}
+
+// files kept on local disk are named after their whole path, flattened
+static std::string LocalFileName(const std::string& fname)
+{
+  std::string name;
+  for (std::string::const_iterator it = fname.begin(); it != fname.end(); ++it)
+  {
+    if (*it == '/')
     {
-       return IOError("RadosSequentialFile::Read: " + fname_, -r);
+      name += "%2F";
+    }
+    else if (*it == '%')
+    {
+      name += "%25";
     }
+    else
+    {
+      name += *it;
+    }
+  }
 
-    bl.copy(0, r, scratch);
-    off_ += r;
+  return name;
+}
 
-    *result = leveldb::Slice(scratch, r);
+static std::string ParentDir(const std::string& fname)
+{
+  return path(fname).parent_path().string();
+}
 
-    return leveldb::Status::OK();
+static std::string Namespace(const std::string& dir)
+{
+  std::string ns = dir;
+  while (ns.size() > 1 && ns[ns.size() - 1] == '/')
+  {
+    ns.erase(ns.size() - 1);
   }
 
-  virtual leveldb::Status Skip(uint64_t n)
-  {
-    off_ += n;
+  return ns;
+}
 
-    return leveldb::Status::OK();
-  }
+// the omap of this object in every namespace maps the names of the files in
+// it to their sizes, so listing a directory doesn't mean listing the pool.
+// LevelDB never creates a file starting with a dot
+static const char kIndexObject[] = ".index";
 
-private:
-  const boost::shared_ptr<librados::IoCtx> ctx_;
-  const std::string fname_;
-  uint64_t off_;
+// the checkpoints of the DB in a namespace, one omap key per snapshot id
+static const char kCheckpointObject[] = ".checkpoints";
+
+static std::map<std::string, librados::bufferlist> IndexEntry(const std::string& fname, uint64_t size)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(size));
+
+  std::map<std::string, librados::bufferlist> entry;
+  entry[ObjectName(fname)].append(buf, strlen(buf));
+  return entry;
+}
+
+enum RadosFileType
+{
+  kLogFile,
+  kTableFile,
+  kDescriptorFile,
+  kOtherFile
 };
 
-class RadosRandomAccessFile : public leveldb::RandomAccessFile
+static RadosFileType GetFileType(const std::string& fname)
 {
-public:
-  RadosRandomAccessFile(const boost::shared_ptr<librados::IoCtx>& ctx, const std::string& fname)
-    : ctx_(ctx)
-    , fname_(fname)
+  const path p(fname);
+  const std::string ext = p.extension().string();
+  if (ext == ".log")
   {
+    return kLogFile;
   }
-
-private:
-  virtual leveldb::Status Read(uint64_t offset, size_t n, leveldb::Slice* result, char* scratch) const
+  else if (ext == ".ldb" || ext == ".sst")
   {
-    librados::bufferlist bl;
-    const int r = ctx_->read(fname_, bl, n, offset);
-    if (r < 0)
-    {
-       return IOError("RadosRandomAccessFile::Read: " + fname_, -r);
-    }
-
-    bl.copy(0, r, scratch);
-
-    *result = leveldb::Slice(scratch, r);
-
-    return leveldb::Status::OK();
+    return kTableFile;
+  }
+  else if (p.filename().string().compare(0, 9, "MANIFEST-") == 0)
+  {
+    return kDescriptorFile;
+  }
+  else
+  {
+    return kOtherFile;
   }
+}
 
-private:
-  const boost::shared_ptr<librados::IoCtx> ctx_;
-  const std::string fname_;
+// a piece of a file that is contiguous in one of its objects
+struct RadosExtent
+{
+  uint32_t stripe;
+  uint64_t offset;
+  uint64_t length;
 };
 
-class RadosWritableFile : public leveldb::WritableFile
+// How the bytes of a file are spread over RADOS objects. Like libradosstriper
+// the file is cut into stripe units that go round robin over stripe_count
+// objects, but objects grow without bound instead of being grouped in object
+// sets. The first object is named after the file and carries the layout and
+// the logical size as xattrs, the others get a ".<stripe>" suffix
+struct RadosLayout
 {
-public:
-  RadosWritableFile(const boost::shared_ptr<librados::IoCtx>& ctx, const std::string& fname)
-    : ctx_(ctx)
-    , fname_(fname)
+  RadosLayout()
+    : stripe_unit(0)
+    , stripe_count(1)
   {
   }
 
-private:
-  virtual leveldb::Status Append(const leveldb::Slice& data)
+  RadosLayout(uint64_t unit, uint32_t count)
+    : stripe_unit(unit)
+    , stripe_count(unit > 0 ? std::max(count, static_cast<uint32_t>(1)) : 1)
   {
-    // copy the data into a Rados bufferlist then queue an append
-    librados::bufferlist bl;
-    bl.append(data.data(), data.size());
-    std::auto_ptr<librados::AioCompletion> c(librados::Rados::aio_create_completion());
-    int err = ctx_->aio_append(fname_, c.get(), bl, data.size());
-    if (err < 0)
-    {
-      return IOError("RadosWriteableFile/Append: " + fname_, -err);
-    }
+  }
 
-    c.release();
-    return leveldb::Status::OK();
+  bool striped() const
+  {
+    return stripe_count > 1;
   }
 
-  virtual leveldb::Status Close()
+  // how many objects a file of the given size occupies
+  uint32_t ObjectCount(uint64_t size) const
   {
-    // nop
-    return leveldb::Status::OK();
+    if (!striped())
+    {
+      return 1;
+    }
+
+    const uint64_t units = (size + stripe_unit - 1) / stripe_unit;
+    return static_cast<uint32_t>(std::max(static_cast<uint64_t>(1), std::min(units, static_cast<uint64_t>(stripe_count))));
   }
 
-  static void FreeAioCompletion(librados::completion_t cb, void* arg)
+  static std::string ObjectName(const std::string& oid, uint32_t stripe)
   {
-    static_cast<librados::AioCompletion*>(arg)->release();
+    if (stripe == 0)
+    {
+      return oid;
+    }
+
+    char buf[16];
+    snprintf(buf, sizeof(buf), ".%u", stripe);
+    return oid + buf;
   }
 
-  virtual leveldb::Status Flush()
+  // split [off, off + len) into extents, in file order
+  void Map(uint64_t off, uint64_t len, std::vector<RadosExtent>* extents) const
   {
-    std::auto_ptr<librados::AioCompletion> c(librados::Rados::aio_create_completion());
-    c->set_complete_callback(c.get(), FreeAioCompletion);
-    int err = ctx_->aio_flush_async(c.get());
-    if (err < 0)
+    extents->clear();
+    if (!striped())
     {
-      return IOError("RadosWriteableFile/Flush: " + fname_, -err);
+      const RadosExtent extent = { 0, off, len };
+      extents->push_back(extent);
+      return;
     }
 
-    c.release();
+    while (len > 0)
+    {
+      const uint64_t unit = off / stripe_unit;
+      const uint64_t within = off % stripe_unit;
+      const RadosExtent extent =
+        { static_cast<uint32_t>(unit % stripe_count)
+        , (unit / stripe_count) * stripe_unit + within
+        , std::min(len, stripe_unit - within)
+        };
 
-    return leveldb::Status::OK();
+      extents->push_back(extent);
+      off += extent.length;
+      len -= extent.length;
+    }
   }
 
-  virtual leveldb::Status Sync()
+  librados::bufferlist Encode() const
   {
-    int err = ctx_->aio_flush();
-    if (err < 0)
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%llu %u", static_cast<unsigned long long>(stripe_unit), stripe_count);
+
+    librados::bufferlist bl;
+    bl.append(buf, strlen(buf));
+    return bl;
+  }
+
+  static RadosLayout Decode(const librados::bufferlist& bl)
+  {
+    unsigned long long unit = 0;
+    unsigned count = 1;
+    if (sscanf(bl.to_str().c_str(), "%llu %u", &unit, &count) != 2)
     {
-      return IOError("RadosWriteableFile/Sync: " + fname_, -err);
+      return RadosLayout();
     }
 
-    return leveldb::Status::OK();
+    return RadosLayout(unit, count);
   }
 
-private:
-  const boost::shared_ptr<librados::IoCtx> ctx_;
-  const std::string fname_;
+  uint64_t stripe_unit;
+  uint32_t stripe_count;
 };
 
-class RadosEnv : public leveldb::EnvWrapper
+static const char kLayoutXattr[] = "leveldb.layout";
+static const char kSizeXattr[] = "leveldb.size";
+
+static librados::bufferlist EncodeSize(uint64_t size)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(size));
+
+  librados::bufferlist bl;
+  bl.append(buf, strlen(buf));
+  return bl;
+}
+
+static uint64_t DecodeSize(const librados::bufferlist& bl)
+{
+  return strtoull(bl.to_str().c_str(), NULL, 10);
+}
+
+// A read of [off, off + n) of a file with the given layout straight into
+// dest. Start sends it and Finish waits for it, so any number of them can
+// be in flight together, and the extents of a striped file are always read
+// in parallel
+class RadosLayoutRead
 {
 public:
-  RadosEnv(const boost::shared_ptr<void>& parent, const boost::shared_ptr<librados::IoCtx>& ctx)
-    : leveldb::EnvWrapper(Env::Default())
-    , parent_(parent)
-    , ctx_(ctx)
+  RadosLayoutRead()
+    : dest_(NULL)
+    , striped_(false)
+    , err_(0)
   {
   }
 
-private:
-  virtual leveldb::Status NewSequentialFile(const std::string& fname, leveldb::SequentialFile** result)
+  ~RadosLayoutRead()
   {
-    *result = new RadosSequentialFile(ctx_, fname);
-    return leveldb::Status::OK();
+    Finish();
   }
 
-  virtual leveldb::Status NewRandomAccessFile(const std::string& fname, leveldb::RandomAccessFile** result)
+  void Start(RadosBackend& ctx, const std::string& oid, const RadosLayout& layout, char* dest, size_t n, uint64_t off)
   {
-    *result = new RadosRandomAccessFile(ctx_, fname);
-    return leveldb::Status::OK();
-  }
+    dest_ = dest;
+    striped_ = layout.striped();
+    layout.Map(off, n, &extents_);
 
-  virtual leveldb::Status NewWritableFile(const std::string& fname, leveldb::WritableFile** result)
-  {
-    int err = ctx_->create(fname, true);
-    if (err < 0)
+    bls_.resize(extents_.size());
+    completions_.assign(extents_.size(), static_cast<RadosCompletion*>(NULL));
+    size_t pos = 0;
+    for (size_t i = 0; i < extents_.size(); ++i)
     {
-      return IOError("NewWritableFile: " + fname, -err);
-    }
+      bls_[i].push_back(ceph::buffer::create_static(extents_[i].length, dest + pos));
+      completions_[i] = ctx.NewCompletion();
+      err_ = ctx.AioRead(RadosLayout::ObjectName(oid, extents_[i].stripe), completions_[i], &bls_[i], extents_[i].length, extents_[i].offset);
+      if (err_ < 0)
+      {
+        delete completions_[i];
+        completions_[i] = NULL;
+        break;
+      }
 
-    *result = new RadosWritableFile(ctx_, fname);
-    return leveldb::Status::OK();
+      pos += extents_[i].length;
+    }
   }
 
-  virtual bool FileExists(const std::string& fname)
+  // returns the number of bytes read or a negative error code
+  int Finish()
   {
-    size_t size = 0;
-    time_t mtime = 0;
-    if (ctx_->stat(fname, &size, &mtime) < 0)
-    {
-      return false;
-    }
-    else
+    size_t total = 0;
+    bool eof = false;
+    size_t pos = 0;
+    for (size_t i = 0; i < extents_.size() && completions_[i] != NULL; ++i)
     {
-      return true;
+      completions_[i]->WaitForComplete();
+      const int r = completions_[i]->ReturnValue();
+      delete completions_[i];
+      completions_[i] = NULL;
+
+      if (err_ < 0 || eof)
+      {
+        continue;
+      }
+      else if (r == -ENOENT && striped_)
+      {
+        // stripes past the end of the file are never created
+        eof = true;
+      }
+      else if (r < 0)
+      {
+        err_ = r;
+      }
+      else
+      {
+        const size_t len = CompleteReadInto(bls_[i], r, dest_ + pos);
+        total += len;
+        eof = len < extents_[i].length;
+      }
+
+      pos += extents_[i].length;
     }
+
+    extents_.clear();
+    bls_.clear();
+    completions_.clear();
+
+    return err_ < 0 ? err_ : static_cast<int>(total);
   }
 
-  virtual leveldb::Status GetChildren(const std::string& dir, std::vector<std::string>* result)
+private:
+  RadosLayoutRead(const RadosLayoutRead&);
+  void operator=(const RadosLayoutRead&);
+
+  char* dest_;
+  bool striped_;
+  int err_;
+  std::vector<RadosExtent> extents_;
+  std::vector<librados::bufferlist> bls_;
+  std::vector<RadosCompletion*> completions_;
+};
+
+// read [off, off + n) of a file with the given layout straight into dest,
+// returns the number of bytes read or a negative error code
+static int ReadLayout(RadosBackend& ctx, const std::string& oid, const RadosLayout& layout, char* dest, size_t n, uint64_t off)
+{
+  if (!layout.striped())
   {
-    result->clear();
-    for (librados::ObjectIterator it = ctx_->objects_begin(); it != ctx_->objects_end(); ++it)
-    {
-      const std::pair<std::string, std::string>& cur = *it;
-      const path p(cur.first);
-      result->push_back(p.filename().string());
-    }
+    return ReadInto(ctx, oid, dest, n, off);
+  }
 
-    return leveldb::Status::OK();
+  RadosLayoutRead read;
+  read.Start(ctx, oid, layout, dest, n, off);
+  return read.Finish();
+}
+
+// How long Sync on a writable file waits for its appends
+enum RadosDurability
+{
+  // don't wait at all, a failure may go unnoticed until the next call
+  kDurabilityNone,
+  // until the OSDs have applied them, possibly only in memory
+  kDurabilityComplete,
+  // until they are on disk on every replica
+  kDurabilitySafe
+};
+
+// How LockFile locks the DB
+enum RadosLockMode
+{
+  // the one writer, fails while another instance holds it
+  kLockExclusive,
+  // a read-only instance, any number of them can run next to the writer.
+  // it implies follower
+  kLockShared,
+  // no lock at all
+  kLockNone
+};
+
+// Tunables shared by a RadosEnv and the files it hands out
+struct RadosEnvOptions
+{
+  RadosEnvOptions()
+    : readahead_size(4 << 20)
+    , block_cache_size(32 << 20)
+    , block_cache_page_size(16 << 10)
+    , block_cache_pinned_pages(4)
+    , table_write_buffer_size(1 << 20)
+    , log_write_buffer_size(64 << 10)
+    , max_inflight_ops(16)
+    , max_inflight_bytes(16 << 20)
+    , stripe_unit(4 << 20)
+    , stripe_count(1)
+    , table_tail_size(64 << 10)
+    , scan_readahead_size(8 << 20)
+    , scan_readahead_memory(64 << 20)
+    , local_cache_size(0)
+    , log_durability(kDurabilitySafe)
+    , table_durability(kDurabilitySafe)
+    , descriptor_durability(kDurabilitySafe)
+    , background_threads(4)
+    , lock_mode(kLockExclusive)
+    , lock_lease(30)
+    , follower(false)
+    , follower_memory(256 << 20)
+    , snapshot(0)
+    , info_log_size(4 << 20)
+  {
   }
 
-  virtual leveldb::Status DeleteFile(const std::string& fname)
+  // size of each chunk RadosSequentialFile reads ahead, two chunks are
+  // buffered at a time. zero disables read-ahead
+  size_t readahead_size;
+
+  // byte budget of the block cache shared by all table files, zero disables it
+  size_t block_cache_size;
+
+  // table files are cached in aligned pages of this size, at least 4KB
+  size_t block_cache_page_size;
+
+  // how many cached pages each table file may pin to serve reads without
+  // copying them into LevelDB's scratch buffer
+  size_t block_cache_pinned_pages;
+
+  // appends to table files are coalesced until this many bytes are buffered
+  size_t table_write_buffer_size;
+
+  // same for every other file, these are also sent on each Flush
+  size_t log_write_buffer_size;
+
+  // appends a writable file may have outstanding before new ones block
+  size_t max_inflight_ops;
+  size_t max_inflight_bytes;
+
+  // table files are striped over stripe_count objects in units of
+  // stripe_unit bytes. a count of one keeps every new table in a single
+  // object, existing tables are read with the layout they were written with
+  size_t stripe_unit;
+  size_t stripe_count;
+
+  // the first read of a table file fetches this many bytes ending where
+  // the read ends, which covers the footer, index and filter blocks of
+  // most tables. zero disables it
+  size_t table_tail_size;
+
+  // a random access file that is read sequentially, as compactions read
+  // tables, reads ahead in chunks that double from 256KB up to this
+  // size. zero disables it
+  size_t scan_readahead_size;
+
+  // bytes the read-ahead of every scan of the env holds at most, a scan
+  // past that reads ahead less or not at all
+  size_t scan_readahead_memory;
+
+  // table files are copied to local_cache_dir once they are opened and read
+  // from there, keeping at most local_cache_size bytes. copies are kept
+  // across restarts, and the directory can be shared by envs on other
+  // pools. an empty directory or a zero size disables it
+  std::string local_cache_dir;
+  size_t local_cache_size;
+
+  // logs are written to local_log_dir and synced there, and shipped to
+  // RADOS in the background. a commit is durable once it is on local disk,
+  // the RADOS copy lags behind by at most the log write buffer plus the
+  // inflight window. recovery reads the local copy when the RADOS one is a
+  // prefix of it. copies are named after the pool, so envs on several pools
+  // can share the directory. empty keeps logs in RADOS only
+  std::string local_log_dir;
+
+  // the cephx user the env connects as, without the "client." prefix.
+  // empty is the librados default. envs with the same config file and
+  // client id share one connection
+  std::string client_id;
+
+  // what Sync waits for on logs, tables and everything else (MANIFEST,
+  // CURRENT, ...). Close waits until the appends complete and Flush never
+  // waits, whatever the level
+  RadosDurability log_durability;
+  RadosDurability table_durability;
+  RadosDurability descriptor_durability;
+
+  // threads running LevelDB's compactions and the env's background work
+  size_t background_threads;
+
+  // locks are leases of lock_lease seconds, renewed by the env a few
+  // times per lease for as long as the DB is open. a lock held by an
+  // instance that died is free again once its lease runs out. a writer
+  // that couldn't renew its lock for a whole lease fails every write,
+  // delete and rename in the DB until it is reopened. 0 never expires,
+  // such a lock has to be broken by hand
+  RadosLockMode lock_mode;
+  uint32_t lock_lease;
+
+  // open the DB read-only next to its writer. the follower takes the
+  // shared lock and keeps whatever LevelDB writes in memory, so the shared
+  // files are never touched. it sees the DB as of when it was opened and
+  // counts the writer's MANIFEST switches, reopening the DB catches up.
+  // the writer may delete tables a follower still reads, which then fail
+  // until it reopens
+  bool follower;
+
+  // bytes of files a follower keeps in memory. writes past that fail, and
+  // with them an open that would recover or compact more than this
+  size_t follower_memory;
+
+  // read the DB as of this checkpoint, 0 is its current state. the env is
+  // a follower that neither locks nor watches the DB
+  uint64_t snapshot;
+
+  // the info LOG is written to the DB's directory in the pool, in batches
+  // off the threads that log, and rotated to LOG.old once it grows past
+  // this size. 0 keeps it on local disk like the default env does
+  size_t info_log_size;
+
+  RadosDurability durability(RadosFileType type) const
   {
-    int err = ctx_->remove(fname);
-    if (err < 0)
+    switch (type)
     {
-      return IOError("DeleteFile: " + fname, -err);
+      case kLogFile:
+        return log_durability;
+      case kTableFile:
+        return table_durability;
+      default:
+        return descriptor_durability;
     }
+  }
 
-    return leveldb::Status::OK();
+  RadosLayout table_layout() const
+  {
+    return RadosLayout(stripe_unit, static_cast<uint32_t>(stripe_count));
   }
+};
 
-  virtual leveldb::Status CreateDir(const std::string& dirname)
+// Caches aligned pages of immutable table files, keyed by a per-file id and
+// the page number. The LRU and its sharding come from LevelDB's own cache.
+// Pages pinned by files can't be evicted, at most half the budget may be
+// pinned so the cache stays within it
+class RadosBlockCache
+{
+public:
+  RadosBlockCache(size_t capacity, size_t page_size)
+    : cache_(leveldb::NewLRUCache(capacity))
+    , page_size_(PageSize(page_size))
+    , max_pinned_bytes_(capacity / 2)
+    , pinned_bytes_(0)
   {
-    return leveldb::Status::OK();
   }
 
-  virtual leveldb::Status DeleteDir(const std::string& dirname)
+  size_t page_size() const
   {
-    return leveldb::Status::OK();
+    return page_size_;
   }
 
-  virtual leveldb::Status GetFileSize(const std::string& fname, uint64_t* file_size)
+  // returns the id that file's pages are cached under
+  uint64_t Open(const std::string& fname)
   {
-    size_t size = 0;
-    time_t mtime = 0;
-    int err = ctx_->stat(fname, &size, &mtime);
-    if (err < 0)
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<std::string, FileEntry>::iterator it = files_.find(fname);
+    if (it == files_.end())
     {
-      return IOError("GetFileSize/stat: " + fname, -err);
+      FileEntry entry;
+      entry.id = cache_->NewId();
+      entry.pages = 0;
+      it = files_.insert(std::make_pair(fname, entry)).first;
     }
 
-    *file_size = static_cast<uint64_t>(size);
-
-    return leveldb::Status::OK();
+    return it->second.id;
   }
 
-  virtual leveldb::Status RenameFile(const std::string& src, const std::string& target)
+  // drop every cached page of a file that is being deleted or replaced
+  void Invalidate(const std::string& fname)
   {
-    size_t size = 0;
-    time_t mtime = 0;
-    int err = ctx_->stat(src, &size, &mtime);
-    if (err < 0)
+    FileEntry entry;
     {
-      return IOError("RenameFile/stat: " + src, -err);
-    }
+      boost::mutex::scoped_lock lock(mutex_);
+      std::map<std::string, FileEntry>::iterator it = files_.find(fname);
+      if (it == files_.end())
+      {
+        return;
+      }
 
-    librados::bufferlist bl;
-    err = ctx_->read(src, bl, size, 0);
-    if (err < 0)
-    {
-      return IOError("RenameFile/read: " + src, -err);
+      entry = it->second;
+      files_.erase(it);
     }
 
-    err = ctx_->write_full(target, bl);
-    if (err < 0)
+    for (uint64_t page = 0; page < entry.pages; ++page)
     {
-      return IOError("RenameFile/write_full: " + target, -err);
+      char buf[16];
+      cache_->Erase(EncodeKey(entry.id, page, buf));
     }
+  }
 
-    err = ctx_->remove(src);
-    if (err < 0)
+  leveldb::Cache::Handle* Lookup(uint64_t id, uint64_t page)
+  {
+    char buf[16];
+    return cache_->Lookup(EncodeKey(id, page, buf));
+  }
+
+  // takes ownership of the page contents in bl
+  leveldb::Cache::Handle* Insert(const std::string& fname, uint64_t id, uint64_t page, librados::bufferlist& bl)
+  {
+    librados::bufferlist* contents = new librados::bufferlist;
+    contents->claim_append(bl);
+    // pages are copied out of with a single memcpy
+    contents->c_str();
+
+    char buf[16];
+    leveldb::Cache::Handle* handle = cache_->Insert(EncodeKey(id, page, buf), contents, contents->length(), DeletePage);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<std::string, FileEntry>::iterator it = files_.find(fname);
+    if (it != files_.end() && it->second.id == id)
     {
-      return IOError("RenameFile/remove: " + src, -err);
+      it->second.pages = std::max(it->second.pages, page + 1);
     }
 
-    return leveldb::Status::OK();
+    return handle;
   }
 
-  virtual leveldb::Status LockFile(const std::string& fname, leveldb::FileLock** lock)
+  const librados::bufferlist& Value(leveldb::Cache::Handle* handle)
   {
-    // @TODO: use lock_exclusive/unlock when we upgrade to dumpling
-    *lock = new leveldb::FileLock();
+    return *static_cast<librados::bufferlist*>(cache_->Value(handle));
+  }
 
-    return leveldb::Status::OK();
+  void Release(leveldb::Cache::Handle* handle)
+  {
+    cache_->Release(handle);
   }
 
-  virtual leveldb::Status UnlockFile(leveldb::FileLock* lock)
+  // account for a page a file keeps a handle on, false if the pinned
+  // budget is used up
+  bool Pin(leveldb::Cache::Handle* handle)
   {
-    // TODO: delete lock?
+    const size_t bytes = Value(handle).length();
 
-    return leveldb::Status::OK();
+    boost::mutex::scoped_lock lock(mutex_);
+    if (pinned_bytes_ + bytes > max_pinned_bytes_)
+    {
+      return false;
+    }
+
+    pinned_bytes_ += bytes;
+    return true;
   }
 
-  virtual leveldb::Status GetTestDirectory(std::string* path)
+  void Unpin(leveldb::Cache::Handle* handle)
   {
-    *path = "tmp/";
+    const size_t bytes = Value(handle).length();
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pinned_bytes_ -= bytes;
+    }
 
-    return leveldb::Status::OK();
+    cache_->Release(handle);
   }
 
 private:
-  const boost::shared_ptr<librados::IoCtx> ctx_;
-  const boost::shared_ptr<void> parent_;
-};
+  static const size_t kMinPageSize = 4 << 10;
 
-// sadly this is internal to LevelDB
-struct leveldb_env_t
-{
-  leveldb::Env* rep;
-  bool is_default;
-};
+  static size_t PageSize(size_t page_size)
+  {
+    return page_size > kMinPageSize ? page_size : kMinPageSize;
+  }
 
-leveldb_env_t* leveldb_create_rados_env(const char* config_file, const char* pool_name)
-{
-  int err;
-  boost::shared_ptr<librados::Rados> rados(new librados::Rados());
-  err = rados->init(NULL);
-  if (err < 0)
+  struct FileEntry
   {
-    cerr << "Rados::init() failed: " << strerror(-err);
-    return NULL;
+    uint64_t id;
+    // one past the highest page number ever inserted
+    uint64_t pages;
+  };
+
+  static leveldb::Slice EncodeKey(uint64_t id, uint64_t page, char* buf)
+  {
+    memcpy(buf, &id, sizeof(id));
+    memcpy(buf + sizeof(id), &page, sizeof(page));
+    return leveldb::Slice(buf, sizeof(id) + sizeof(page));
   }
 
-  err = rados->conf_read_file(config_file);
-  if (err < 0)
+  static void DeletePage(const leveldb::Slice& key, void* value)
   {
-    cerr << "Rados::conf_read_file() failed: " << strerror(-err);
-    return NULL;
+    delete static_cast<librados::bufferlist*>(value);
+  }
+
+private:
+  const boost::scoped_ptr<leveldb::Cache> cache_;
+  const size_t page_size_;
+  const size_t max_pinned_bytes_;
+
+  boost::mutex mutex_;
+  std::map<std::string, FileEntry> files_;
+  size_t pinned_bytes_;
+};
+
+// Worker threads the env runs its background work on: LevelDB's own
+// compactions through Schedule, and the env's copies and cleanups. Those
+// mostly wait on the network, so several run at once to keep the OSDs
+// busy while LevelDB decodes and compresses blocks on the others. Queued
+// jobs run highest priority first and in order within a priority
+class RadosThreadPool
+{
+public:
+  enum Priority
+  {
+    // LevelDB's background work, which flushes the memtable before compacting
+    kPriorityHigh,
+    // prefetching and garbage collection, which nothing waits for
+    kPriorityLow,
+    kPriorityCount
+  };
+
+  explicit RadosThreadPool(size_t threads)
+    : stopping_(false)
+  {
+    for (size_t i = 0; i < std::max(threads, static_cast<size_t>(1)); ++i)
+    {
+      workers_.add_thread(new boost::thread(&RadosThreadPool::Run, this));
+    }
+  }
+
+  // jobs already running are waited for, queued ones are dropped
+  ~RadosThreadPool()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+      cond_.notify_all();
+    }
+
+    workers_.join_all();
+  }
+
+  void Schedule(Priority priority, void (*function)(void*), void* arg)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    queues_[priority].push_back(Job(function, arg));
+    cond_.notify_one();
+  }
+
+private:
+  struct Job
+  {
+    Job(void (*function)(void*), void* arg)
+      : function(function)
+      , arg(arg)
+    {
+    }
+
+    void (*function)(void*);
+    void* arg;
+  };
+
+  void Run()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    for (;;)
+    {
+      std::deque<Job>* queue = NULL;
+      while (!stopping_ && (queue = NextQueue()) == NULL)
+      {
+        cond_.wait(lock);
+      }
+
+      if (stopping_)
+      {
+        return;
+      }
+
+      const Job job = queue->front();
+      queue->pop_front();
+
+      lock.unlock();
+      job.function(job.arg);
+      lock.lock();
+    }
+  }
+
+  std::deque<Job>* NextQueue()
+  {
+    for (size_t i = 0; i < kPriorityCount; ++i)
+    {
+      if (!queues_[i].empty())
+      {
+        return &queues_[i];
+      }
+    }
+
+    return NULL;
+  }
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  std::deque<Job> queues_[kPriorityCount];
+  bool stopping_;
+  boost::thread_group workers_;
+};
+
+// Whole table files copied to a directory on local disk, so reads of hot
+// tables don't cross the network and a warm restart doesn't have to fetch
+// them again. A table is copied in the background the first time it is
+// opened without a copy, and copies are evicted least recently opened first
+// once the directory grows past its budget. A copy only gets its final name
+// once it is complete, so anything found at startup can be trusted. Recency
+// isn't persisted, after a restart the copies found are evicted in no
+// particular order
+class RadosLocalCache
+{
+public:
+  // copies are made on threads, which has to stop running jobs before
+  // the cache goes away. copies that haven't started by then are
+  // abandoned, they can start over next time. copies are named after
+  // pool as well, several pools can share dir
+  RadosLocalCache(const std::string& dir, const std::string& pool, uint64_t capacity, RadosThreadPool* threads)
+    : env_(leveldb::Env::Default())
+    , dir_(dir)
+    , pool_(pool)
+    , capacity_(capacity)
+    , threads_(threads)
+    , usage_(0)
+    , generation_(0)
+  {
+    Load();
+  }
+
+  // the local copy of fname, or NULL if there isn't one. a copy that
+  // isn't size bytes long is of a file that has since been replaced, or
+  // was cut short, and is dropped
+  boost::shared_ptr<leveldb::RandomAccessFile> Open(const std::string& fname, uint64_t size)
+  {
+    const std::string name = Name(fname);
+    {
+      std::vector<std::string> doomed;
+      boost::mutex::scoped_lock lock(mutex_);
+      std::map<std::string, std::list<Entry>::iterator>::iterator it = entries_.find(name);
+      if (it == entries_.end())
+      {
+        return boost::shared_ptr<leveldb::RandomAccessFile>();
+      }
+      else if (it->second->size != size)
+      {
+        Remove(it, &doomed);
+        lock.unlock();
+        DeleteFiles(doomed);
+        return boost::shared_ptr<leveldb::RandomAccessFile>();
+      }
+
+      lru_.splice(lru_.begin(), lru_, it->second);
+    }
+
+    // a copy evicted in the meantime just fails to open
+    leveldb::RandomAccessFile* file = NULL;
+    if (!env_->NewRandomAccessFile(Path(name), &file).ok())
+    {
+      return boost::shared_ptr<leveldb::RandomAccessFile>();
+    }
+
+    return boost::shared_ptr<leveldb::RandomAccessFile>(file);
+  }
+
+  // copy fname in the background, unless that is already under way
+  void Fill(const boost::shared_ptr<RadosBackend>& ctx, const std::string& fname, const RadosLayout& layout)
+  {
+    const std::string name = Name(fname);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (entries_.count(name) > 0 || pending_.count(name) > 0)
+    {
+      return;
+    }
+
+    FillRequest& request = pending_[name];
+    request.ctx = ctx;
+    request.oid = ObjectName(fname);
+    request.layout = layout;
+    request.generation = ++generation_;
+    queue_.push_back(std::make_pair(name, request.generation));
+    threads_->Schedule(RadosThreadPool::kPriorityLow, &RadosLocalCache::FillOne, this);
+  }
+
+  // drop the copy of fname along with any copy being made
+  void Erase(const std::string& fname)
+  {
+    const std::string name = Name(fname);
+    std::vector<std::string> doomed;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.erase(name);
+
+      std::map<std::string, std::list<Entry>::iterator>::iterator it = entries_.find(name);
+      if (it != entries_.end())
+      {
+        Remove(it, &doomed);
+      }
+    }
+
+    DeleteFiles(doomed);
+  }
+
+private:
+  // tables are copied in reads of this size
+  static const size_t kFillChunk = 4 << 20;
+
+  // copies found at startup are generation 0
+  struct Entry
+  {
+    std::string name;
+    uint64_t size;
+    uint64_t generation;
+  };
+
+  // the generation tells a copy apart from one of the same name that was
+  // erased and requested again while it ran
+  struct FillRequest
+  {
+    boost::shared_ptr<RadosBackend> ctx;
+    std::string oid;
+    RadosLayout layout;
+    uint64_t generation;
+  };
+
+  std::string Name(const std::string& fname) const
+  {
+    return LocalFileName(pool_ + "/" + fname);
+  }
+
+  std::string Path(const std::string& name) const
+  {
+    return dir_ + "/" + name;
+  }
+
+  static bool IsTemporary(const std::string& name)
+  {
+    return name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0;
+  }
+
+  // where a copy is made, every request has its own
+  std::string TemporaryPath(const std::string& name, uint64_t generation) const
+  {
+    std::ostringstream path;
+    path << Path(name) << "." << generation << ".tmp";
+    return path.str();
+  }
+
+  // unlinks of whole copies are left until mutex_ is released
+  void DeleteFiles(const std::vector<std::string>& paths)
+  {
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+      env_->DeleteFile(paths[i]);
+    }
+  }
+
+  void Load()
+  {
+    env_->CreateDir(dir_);
+
+    std::vector<std::string> children;
+    env_->GetChildren(dir_, &children);
+    for (size_t i = 0; i < children.size(); ++i)
+    {
+      const std::string& name = children[i];
+      uint64_t size = 0;
+      if (name == "." || name == "..")
+      {
+        continue;
+      }
+      else if (IsTemporary(name))
+      {
+        // a copy that was cut short
+        env_->DeleteFile(Path(name));
+      }
+      else if (env_->GetFileSize(Path(name), &size).ok())
+      {
+        Insert(name, size, 0);
+      }
+    }
+
+    std::vector<std::string> doomed;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      Evict(0, &doomed);
+    }
+
+    DeleteFiles(doomed);
+  }
+
+  // one job is scheduled per queued name, each copies the oldest
+  static void FillOne(void* arg)
+  {
+    RadosLocalCache* cache = static_cast<RadosLocalCache*>(arg);
+    boost::mutex::scoped_lock lock(cache->mutex_);
+
+    const std::string name = cache->queue_.front().first;
+    const uint64_t generation = cache->queue_.front().second;
+    cache->queue_.pop_front();
+
+    if (!cache->IsPending(name, generation))
+    {
+      // erased before it got its turn
+      return;
+    }
+
+    const FillRequest request = cache->pending_[name];
+    lock.unlock();
+    const std::string tmp = cache->TemporaryPath(name, generation);
+    uint64_t size = 0;
+    const bool copied = cache->Copy(request, tmp, &size);
+    lock.lock();
+
+    // only keep the copy if the file wasn't deleted or renamed meanwhile
+    std::vector<std::string> doomed;
+    const bool keep = copied && cache->IsPending(name, generation) && size <= cache->capacity_;
+    if (keep)
+    {
+      cache->Evict(size, &doomed);
+      cache->Insert(name, size, generation);
+    }
+
+    if (cache->IsPending(name, generation))
+    {
+      cache->pending_.erase(name);
+    }
+
+    lock.unlock();
+    cache->DeleteFiles(doomed);
+
+    // until it is renamed the copy just fails to open
+    if (keep)
+    {
+      const bool renamed = cache->env_->RenameFile(tmp, cache->Path(name)).ok();
+      lock.lock();
+      std::map<std::string, std::list<Entry>::iterator>::iterator it = cache->entries_.find(name);
+      const bool erased = it == cache->entries_.end();
+      if (!renamed && !erased && it->second->generation == generation)
+      {
+        doomed.clear();
+        cache->Remove(it, &doomed);
+      }
+
+      lock.unlock();
+      if (renamed && erased)
+      {
+        // erased while it was being renamed
+        cache->env_->DeleteFile(cache->Path(name));
+      }
+    }
+
+    cache->env_->DeleteFile(tmp);
+  }
+
+  bool IsPending(const std::string& name, uint64_t generation) const
+  {
+    std::map<std::string, FillRequest>::const_iterator it = pending_.find(name);
+    return it != pending_.end() && it->second.generation == generation;
+  }
+
+  // copy the object to tmp without holding mutex_
+  bool Copy(const FillRequest& request, const std::string& tmp, uint64_t* size)
+  {
+    leveldb::WritableFile* file = NULL;
+    leveldb::Status s = env_->NewWritableFile(tmp, &file);
+    if (!s.ok())
+    {
+      return false;
+    }
+
+    std::vector<char> buf(kFillChunk);
+    *size = 0;
+    for (;;)
+    {
+      const int r = ReadLayout(*request.ctx, request.oid, request.layout, &buf[0], buf.size(), *size);
+      if (r < 0)
+      {
+        s = IOError("RadosLocalCache: " + request.oid, -r);
+        break;
+      }
+
+      s = file->Append(leveldb::Slice(&buf[0], r));
+      *size += r;
+      if (!s.ok() || static_cast<size_t>(r) < buf.size() || *size > capacity_)
+      {
+        break;
+      }
+    }
+
+    if (s.ok())
+    {
+      s = file->Sync();
+    }
+
+    if (s.ok())
+    {
+      s = file->Close();
+    }
+
+    delete file;
+    return s.ok();
+  }
+
+  void Insert(const std::string& name, uint64_t size, uint64_t generation)
+  {
+    Entry entry = { name, size, generation };
+    lru_.push_front(entry);
+    entries_[name] = lru_.begin();
+    usage_ += size;
+  }
+
+  // make room for size more bytes, called with mutex_ held. the copies
+  // to delete are added to doomed
+  void Evict(uint64_t size, std::vector<std::string>* doomed)
+  {
+    while (!lru_.empty() && usage_ + size > capacity_)
+    {
+      Remove(entries_.find(lru_.back().name), doomed);
+    }
+  }
+
+  void Remove(std::map<std::string, std::list<Entry>::iterator>::iterator it, std::vector<std::string>* doomed)
+  {
+    // readers that have it open keep reading the unlinked file
+    doomed->push_back(Path(it->first));
+    usage_ -= it->second->size;
+    lru_.erase(it->second);
+    entries_.erase(it);
+  }
+
+  leveldb::Env* const env_;
+  const std::string dir_;
+  const std::string pool_;
+  const uint64_t capacity_;
+  RadosThreadPool* const threads_;
+
+  boost::mutex mutex_;
+  // most recently opened first
+  std::list<Entry> lru_;
+  std::map<std::string, std::list<Entry>::iterator> entries_;
+  uint64_t usage_;
+  std::map<std::string, FillRequest> pending_;
+  // the name and generation of each request, in the order they were made
+  std::deque<std::pair<std::string, uint64_t> > queue_;
+  uint64_t generation_;
+};
+
+// Sizes of the files this env knows about, so FileExists and GetFileSize
+// don't need a stat for every call. Files written through the env are
+// tracked as they grow, for anything else the first stat is remembered.
+// Deleted files are forgotten, and just get stat'ed again if asked about
+class RadosFileTable
+{
+public:
+  struct Entry
+  {
+    Entry()
+      : size(0)
+      , has_layout(false)
+    {
+    }
+
+    uint64_t size;
+    // whether layout is known, it is only looked up while striping is enabled
+    bool has_layout;
+    RadosLayout layout;
+  };
+
+  bool Lookup(const std::string& fname, Entry* entry)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<std::string, Entry>::const_iterator it = files_.find(fname);
+    if (it == files_.end())
+    {
+      return false;
+    }
+
+    *entry = it->second;
+    return true;
+  }
+
+  void Insert(const std::string& fname, const Entry& entry)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    files_[fname] = entry;
+  }
+
+  // record a size without forgetting a layout that is already known
+  void InsertSize(const std::string& fname, uint64_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    files_[fname].size = size;
+  }
+
+  void Erase(const std::string& fname)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    files_.erase(fname);
+  }
+
+  void Rename(const std::string& src, const std::string& target, const Entry& entry)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    files_.erase(src);
+    files_[target] = entry;
+  }
+
+private:
+  boost::mutex mutex_;
+  std::map<std::string, Entry> files_;
+};
+
+// Page aligned buffers that writable files coalesce their appends into,
+// recycled once the appends sent from them complete so a steady stream of
+// appends doesn't go back to the allocator for every buffer. A buffer is
+// only taken back if nothing else holds a reference to it, anything
+// librados or the backend keeps is simply released instead
+class RadosBufferPool
+{
+public:
+  explicit RadosBufferPool(size_t capacity)
+    : capacity_(capacity)
+    , usage_(0)
+  {
+  }
+
+  // an empty buffer with room for size bytes
+  librados::bufferptr Get(size_t size)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      std::vector<librados::bufferptr>& free = free_[size];
+      if (!free.empty())
+      {
+        librados::bufferptr ptr = free.back();
+        free.pop_back();
+        usage_ -= size;
+        ptr.set_length(0);
+        return ptr;
+      }
+    }
+
+    librados::bufferptr ptr(ceph::buffer::create_page_aligned(size));
+    ptr.set_length(0);
+    return ptr;
+  }
+
+  // give up ptr, it is kept for reuse if it was the last reference
+  void Put(librados::bufferptr& ptr)
+  {
+    if (ptr.have_raw() && ptr.raw_nref() == 1)
+    {
+      const size_t size = ptr.raw_length();
+
+      boost::mutex::scoped_lock lock(mutex_);
+      if (usage_ + size <= capacity_)
+      {
+        free_[size].push_back(ptr);
+        usage_ += size;
+      }
+    }
+
+    ptr = librados::bufferptr();
+  }
+
+private:
+  const size_t capacity_;
+
+  boost::mutex mutex_;
+  // by size, files of different types use different sizes
+  std::map<size_t, std::vector<librados::bufferptr> > free_;
+  size_t usage_;
+};
+
+// Counters and latency histograms for everything the env and its files do.
+// Each thread records into a shard of its own, so the only lock taken on the
+// hot path is never contended except by a concurrent Snapshot
+class RadosStats
+{
+public:
+  enum Op
+  {
+    kSequentialRead,
+    kRandomRead,
+    kAppend,
+    kFlush,
+    kSync,
+    kClose,
+    kCreate,
+    kOpen,
+    kStat,
+    kGetChildren,
+    kRename,
+    kDelete,
+    kOpCount
+  };
+
+  // bucket i counts ops that took [2^i, 2^(i+1)) microseconds, the first
+  // and the last buckets are open ended
+  static const size_t kLatencyBuckets = 24;
+
+  RadosStats()
+    : id_(NextId())
+  {
+  }
+
+  ~RadosStats()
+  {
+    for (size_t i = 0; i < shards_.size(); ++i)
+    {
+      delete shards_[i];
+    }
+  }
+
+  static uint64_t NowMicros()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  void Record(Op op, uint64_t start_micros, bool ok, uint64_t bytes)
+  {
+    const uint64_t micros = NowMicros() - start_micros;
+    size_t bucket = 0;
+    while (bucket + 1 < kLatencyBuckets && (micros >> (bucket + 1)) > 0)
+    {
+      ++bucket;
+    }
+
+    Shard* shard = LocalShard();
+    boost::mutex::scoped_lock lock(shard->mutex);
+    Counters& counters = shard->ops[op];
+    counters.ops += 1;
+    counters.errors += ok ? 0 : 1;
+    counters.bytes += bytes;
+    counters.micros += micros;
+    counters.latency[bucket] += 1;
+  }
+
+  // ops and bytes sent to RADOS but not yet complete. an op may be reaped on
+  // another thread than the one that sent it, so only the sum over every
+  // shard is meaningful
+  void AddInflight(int64_t ops, int64_t bytes)
+  {
+    Shard* shard = LocalShard();
+    boost::mutex::scoped_lock lock(shard->mutex);
+    shard->inflight_ops += ops;
+    shard->inflight_bytes += bytes;
+  }
+
+  // one line per op: name, ops, errors, bytes, total microseconds and the
+  // comma separated latency buckets, then the ops and bytes in flight
+  std::string Snapshot() const
+  {
+    Counters totals[kOpCount];
+    int64_t inflight_ops = 0;
+    int64_t inflight_bytes = 0;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      for (size_t i = 0; i < shards_.size(); ++i)
+      {
+        boost::mutex::scoped_lock shard_lock(shards_[i]->mutex);
+        for (size_t op = 0; op < kOpCount; ++op)
+        {
+          totals[op].Add(shards_[i]->ops[op]);
+        }
+
+        inflight_ops += shards_[i]->inflight_ops;
+        inflight_bytes += shards_[i]->inflight_bytes;
+      }
+    }
+
+    std::ostringstream out;
+    for (size_t op = 0; op < kOpCount; ++op)
+    {
+      const Counters& counters = totals[op];
+      out << OpName(static_cast<Op>(op)) << ' ' << counters.ops << ' ' << counters.errors << ' ' << counters.bytes << ' ' << counters.micros << ' ';
+      for (size_t bucket = 0; bucket < kLatencyBuckets; ++bucket)
+      {
+        out << (bucket > 0 ? "," : "") << counters.latency[bucket];
+      }
+
+      out << '\n';
+    }
+
+    out << "inflight " << inflight_ops << ' ' << inflight_bytes << '\n';
+
+    return out.str();
+  }
+
+  static const char* OpName(Op op)
+  {
+    switch (op)
+    {
+      case kSequentialRead: return "sequential_read";
+      case kRandomRead: return "random_read";
+      case kAppend: return "append";
+      case kFlush: return "flush";
+      case kSync: return "sync";
+      case kClose: return "close";
+      case kCreate: return "create";
+      case kOpen: return "open";
+      case kStat: return "stat";
+      case kGetChildren: return "get_children";
+      case kRename: return "rename";
+      case kDelete: return "delete";
+      default: return "unknown";
+    }
+  }
+
+private:
+  struct Counters
+  {
+    Counters()
+      : ops(0)
+      , errors(0)
+      , bytes(0)
+      , micros(0)
+    {
+      std::fill(latency, latency + kLatencyBuckets, 0);
+    }
+
+    void Add(const Counters& other)
+    {
+      ops += other.ops;
+      errors += other.errors;
+      bytes += other.bytes;
+      micros += other.micros;
+      for (size_t bucket = 0; bucket < kLatencyBuckets; ++bucket)
+      {
+        latency[bucket] += other.latency[bucket];
+      }
+    }
+
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t micros;
+    uint64_t latency[kLatencyBuckets];
+  };
+
+  struct Shard
+  {
+    Shard()
+      : inflight_ops(0)
+      , inflight_bytes(0)
+    {
+    }
+
+    boost::mutex mutex;
+    Counters ops[kOpCount];
+    int64_t inflight_ops;
+    int64_t inflight_bytes;
+  };
+
+  // the shards of a thread are found by the id of the RadosStats they
+  // belong to, ids are never reused so the entries left behind by a
+  // destroyed RadosStats are never looked at again. shards are owned by
+  // shards_ and outlive the threads that fill them
+  typedef std::map<uint64_t, Shard*> LocalShards;
+
+  static uint64_t NextId()
+  {
+    static boost::mutex mutex;
+    static uint64_t next_id = 0;
+    boost::mutex::scoped_lock lock(mutex);
+    return next_id++;
+  }
+
+  Shard* LocalShard()
+  {
+    LocalShards* local = local_shards_.get();
+    if (local == NULL)
+    {
+      local = new LocalShards;
+      local_shards_.reset(local);
+    }
+
+    Shard*& shard = (*local)[id_];
+    if (shard == NULL)
+    {
+      shard = new Shard;
+
+      boost::mutex::scoped_lock lock(mutex_);
+      shards_.push_back(shard);
+    }
+
+    return shard;
+  }
+
+  static boost::thread_specific_ptr<LocalShards> local_shards_;
+
+  const uint64_t id_;
+  mutable boost::mutex mutex_;
+  std::vector<Shard*> shards_;
+};
+
+boost::thread_specific_ptr<RadosStats::LocalShards> RadosStats::local_shards_;
+
+class RadosSequentialFile : public leveldb::SequentialFile
+{
+public:
+  RadosSequentialFile(const boost::shared_ptr<RadosBackend>& ctx, const std::string& fname, const boost::shared_ptr<RadosStats>& stats, const RadosEnvOptions& options)
+    : ctx_(ctx)
+    , fname_(fname)
+    , stats_(stats)
+    , oid_(ObjectName(fname))
+    , readahead_size_(options.readahead_size)
+    , off_(0)
+    , current_off_(0)
+    , next_(NULL)
+    , next_off_(0)
+  {
+  }
+
+  virtual ~RadosSequentialFile()
+  {
+    DiscardNext();
+  }
+
+private:
+  virtual leveldb::Status Read(size_t n, leveldb::Slice* result, char* scratch)
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoRead(n, result, scratch);
+    stats_->Record(RadosStats::kSequentialRead, start, s.ok(), s.ok() ? result->size() : 0);
+
+    return s;
+  }
+
+  leveldb::Status DoRead(size_t n, leveldb::Slice* result, char* scratch)
+  {
+    if (readahead_size_ == 0)
+    {
+      return ReadDirect(n, result, scratch);
+    }
+
+    if (Buffered(off_) && off_ + n <= current_off_ + current_.length() && current_.is_contiguous())
+    {
+      // the whole read is in the current chunk, hand out a pointer into it.
+      // it stays valid until the next Read replaces the chunk
+      *result = leveldb::Slice(current_.c_str() + (off_ - current_off_), n);
+      off_ += n;
+
+      return leveldb::Status::OK();
+    }
+
+    size_t copied = 0;
+    while (copied < n)
+    {
+      if (!Buffered(off_))
+      {
+        leveldb::Status s = Refill();
+        if (!s.ok())
+        {
+          return s;
+        }
+
+        if (!Buffered(off_))
+        {
+          // end of file
+          break;
+        }
+      }
+
+      const size_t pos = off_ - current_off_;
+      const size_t len = std::min(n - copied, current_.length() - pos);
+      current_.copy(pos, len, scratch + copied);
+      copied += len;
+      off_ += len;
+    }
+
+    *result = leveldb::Slice(scratch, copied);
+
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status Skip(uint64_t n)
+  {
+    // buffered chunks are dropped lazily by the next Read if it lands outside of them
+    off_ += n;
+
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status ReadDirect(size_t n, leveldb::Slice* result, char* scratch)
+  {
+    const int r = ReadInto(*ctx_, oid_, scratch, n, off_);
+    if (r < 0)
+    {
+       return IOError("RadosSequentialFile::Read: " + fname_, -r);
+    }
+
+    off_ += r;
+
+    *result = leveldb::Slice(scratch, r);
+
+    return leveldb::Status::OK();
+  }
+
+  bool Buffered(uint64_t off) const
+  {
+    return off >= current_off_ && off < current_off_ + current_.length();
+  }
+
+  // make current_ hold the chunk containing off_, consuming the chunk in
+  // flight if it covers off_ and keeping the following one in flight
+  leveldb::Status Refill()
+  {
+    if (next_ == NULL || off_ < next_off_ || off_ >= next_off_ + readahead_size_)
+    {
+      // first read, or a seek outside the read-ahead window
+      DiscardNext();
+      leveldb::Status s = IssueNext(off_);
+      if (!s.ok())
+      {
+        return s;
+      }
+    }
+
+    next_->WaitForComplete();
+    const int r = next_->ReturnValue();
+    delete next_;
+    next_ = NULL;
+    if (r < 0)
+    {
+      next_bl_.clear();
+      return IOError("RadosSequentialFile::Read: " + fname_, -r);
+    }
+
+    current_.clear();
+    current_.claim_append(next_bl_);
+    current_off_ = next_off_;
+
+    if (current_.length() == readahead_size_)
+    {
+      // a short chunk means we hit the end of the object, no need to look further
+      return IssueNext(current_off_ + current_.length());
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status IssueNext(uint64_t off)
+  {
+    next_ = ctx_->NewCompletion();
+    next_off_ = off;
+    const int err = ctx_->AioRead(oid_, next_, &next_bl_, readahead_size_, off);
+    if (err < 0)
+    {
+      delete next_;
+      next_ = NULL;
+      return IOError("RadosSequentialFile::Read: " + fname_, -err);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  void DiscardNext()
+  {
+    if (next_ != NULL)
+    {
+      // the bufferlist is owned by the read until it completes
+      next_->WaitForComplete();
+      delete next_;
+      next_ = NULL;
+    }
+
+    next_bl_.clear();
+  }
+
+private:
+  const boost::shared_ptr<RadosBackend> ctx_;
+  const std::string fname_;
+  const boost::shared_ptr<RadosStats> stats_;
+  const std::string oid_;
+  const size_t readahead_size_;
+  uint64_t off_;
+
+  // the chunk being consumed, starting at current_off_
+  librados::bufferlist current_;
+  uint64_t current_off_;
+
+  // the chunk in flight, starting at next_off_
+  RadosCompletion* next_;
+  librados::bufferlist next_bl_;
+  uint64_t next_off_;
+};
+
+// The memory the scan read-ahead of every file of an env holds, at most
+// capacity bytes. A scan that needs more than is left takes it from the
+// scans that grew least recently, unless they are being read right now
+class RadosScanBudget
+{
+public:
+  // a chunk a reclaimed holder still had in flight. the read finishes
+  // before the buffer it reads into goes away
+  struct Orphan
+  {
+    librados::bufferptr buf;
+    boost::shared_ptr<RadosLayoutRead> read;
+  };
+
+  // a read-ahead holding memory of the budget
+  class Holder
+  {
+  public:
+    // free everything, returns false if the holder is busy and keeps it.
+    // a read it has in flight is handed to orphans instead of waited for
+    virtual bool Reclaim(std::vector<Orphan>* orphans) = 0;
+
+  protected:
+    ~Holder()
+    {
+    }
+  };
+
+  explicit RadosScanBudget(size_t capacity)
+    : capacity_(capacity)
+    , usage_(0)
+  {
+  }
+
+  // n more bytes for holder, false if they can't be had
+  bool Reserve(Holder* holder, size_t n)
+  {
+    if (n > capacity_)
+    {
+      return false;
+    }
+
+    // the reads of reclaimed holders are waited for once the lock is
+    // released, so nothing else waits behind them
+    std::vector<Orphan> orphans;
+    boost::mutex::scoped_lock lock(mutex_);
+    std::list<Entry>::iterator self = Find(holder);
+    if (self == holders_.end())
+    {
+      holders_.push_front(Entry(holder, 0));
+    }
+    else
+    {
+      holders_.splice(holders_.begin(), holders_, self);
+    }
+
+    // the holder that reserves is never reclaimed
+    std::list<Entry>::iterator it = holders_.end();
+    while (usage_ + n > capacity_ && --it != holders_.begin())
+    {
+      if (it->first->Reclaim(&orphans))
+      {
+        usage_ -= it->second;
+        it = holders_.erase(it);
+      }
+    }
+
+    if (usage_ + n > capacity_)
+    {
+      Forget(holders_.begin());
+      return false;
+    }
+
+    usage_ += n;
+    holders_.front().second += n;
+    return true;
+  }
+
+  // holder gave back n bytes
+  void Release(Holder* holder, size_t n)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::list<Entry>::iterator it = Find(holder);
+    if (it != holders_.end())
+    {
+      const size_t freed = std::min(n, it->second);
+      usage_ -= freed;
+      it->second -= freed;
+      Forget(it);
+    }
+  }
+
+private:
+  // a holder and the bytes it has reserved, most recent first
+  typedef std::pair<Holder*, size_t> Entry;
+
+  std::list<Entry>::iterator Find(Holder* holder)
+  {
+    std::list<Entry>::iterator it = holders_.begin();
+    while (it != holders_.end() && it->first != holder)
+    {
+      ++it;
+    }
+
+    return it;
+  }
+
+  // holders are only kept while they hold something
+  void Forget(std::list<Entry>::iterator it)
+  {
+    if (it->second == 0)
+    {
+      holders_.erase(it);
+    }
+  }
+
+  boost::mutex mutex_;
+  const size_t capacity_;
+  size_t usage_;
+  std::list<Entry> holders_;
+};
+
+// Read-ahead for a scan through a random access file, which is how
+// compactions read tables: one block sized read after the other. Each
+// chunk read is twice as big as the one before it, starting at
+// kMinChunk, up to max_size bytes. The next chunk is already in flight
+// while the current one is being served, so a scan stops paying a round
+// trip per block. Chunks are taken from budget, a chunk it can't spare
+// isn't read ahead, and a read it can't spare goes straight to scratch.
+// Everything is freed once the scan reaches the end of the file or ends
+class RadosScanReadahead : public RadosScanBudget::Holder
+{
+public:
+  RadosScanReadahead(size_t max_size, const boost::shared_ptr<RadosScanBudget>& budget)
+    : budget_(budget)
+    , max_size_(max_size)
+    , chunk_(InitialChunk(max_size))
+    , reserved_(0)
+    , off_(0)
+    , eof_(false)
+    , next_off_(0)
+    , next_pending_(false)
+  {
+  }
+
+  ~RadosScanReadahead()
+  {
+    End();
+  }
+
+  // copy [offset, offset + n) to scratch, returns the number of bytes
+  // read or a negative error code. [*begin, *end) is what is buffered or
+  // on its way afterwards
+  int Read(RadosBackend& ctx, const std::string& oid, const RadosLayout& layout, uint64_t offset, size_t n, char* scratch, uint64_t* begin, uint64_t* end)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    const int r = DoRead(ctx, oid, layout, offset, n, scratch);
+
+    *begin = off_;
+    *end = next_pending_ ? next_off_ + next_.length() : off_ + buf_.length();
+    return r;
+  }
+
+  // the scan is over, free what it read ahead
+  void End()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    Drop();
+    chunk_ = InitialChunk(max_size_);
+    Give(reserved_);
+  }
+
+private:
+  virtual bool Reclaim(std::vector<RadosScanBudget::Orphan>* orphans)
+  {
+    boost::mutex::scoped_try_lock lock(mutex_);
+    if (!lock.owns_lock())
+    {
+      return false;
+    }
+
+    if (next_pending_)
+    {
+      orphans->push_back(RadosScanBudget::Orphan());
+      orphans->back().buf = next_;
+      orphans->back().read.swap(next_read_);
+      next_pending_ = false;
+    }
+
+    // the budget already counts it as given back
+    Drop();
+    chunk_ = InitialChunk(max_size_);
+    reserved_ = 0;
+    return true;
+  }
+
+  int DoRead(RadosBackend& ctx, const std::string& oid, const RadosLayout& layout, uint64_t offset, size_t n, char* scratch)
+  {
+    if (!Covers(offset, n) && next_pending_)
+    {
+      // the chunk sent ahead starts where the buffer ends
+      next_pending_ = false;
+      const int r = next_read_->Finish();
+      next_read_.reset();
+      if (r < 0)
+      {
+        Drop();
+        Give(reserved_);
+        return r;
+      }
+
+      buf_.append(next_, 0, r);
+      held_.push_back(std::make_pair(next_off_ + next_.length(), next_.length()));
+      next_ = librados::bufferptr();
+      eof_ = static_cast<size_t>(r) < held_.back().second;
+    }
+
+    const uint64_t end = off_ + buf_.length();
+    if (offset > off_ && offset <= end)
+    {
+      // nothing goes back over what was already read
+      librados::bufferlist rest;
+      rest.substr_of(buf_, offset - off_, end - offset);
+      buf_.swap(rest);
+      off_ = offset;
+      Free(offset);
+    }
+
+    if (!Covers(offset, n))
+    {
+      if (offset < off_ || offset > end)
+      {
+        // a different scan, it starts out small again
+        chunk_ = InitialChunk(max_size_);
+      }
+
+      Drop();
+      Give(reserved_);
+      const size_t len = std::max(chunk_, n);
+      if (!Reserve(len))
+      {
+        return ReadLayout(ctx, oid, layout, scratch, n, offset);
+      }
+
+      librados::bufferptr buf(ceph::buffer::create(len));
+      const int r = ReadLayout(ctx, oid, layout, buf.c_str(), len, offset);
+      held_.push_back(std::make_pair(offset + len, len));
+      if (r < 0)
+      {
+        Drop();
+        Give(reserved_);
+        return r;
+      }
+
+      buf_.append(buf, 0, r);
+      off_ = offset;
+      eof_ = static_cast<size_t>(r) < len;
+      Grow();
+    }
+
+    if (!next_pending_ && !eof_ && Reserve(chunk_))
+    {
+      next_off_ = off_ + buf_.length();
+      next_ = librados::bufferptr(ceph::buffer::create(chunk_));
+      next_read_.reset(new RadosLayoutRead);
+      next_read_->Start(ctx, oid, layout, next_.c_str(), chunk_, next_off_);
+      next_pending_ = true;
+      Grow();
+    }
+
+    const size_t len = std::min(static_cast<uint64_t>(n), off_ + buf_.length() - offset);
+    buf_.copy(offset - off_, len, scratch);
+
+    if (eof_ && offset + len == off_ + buf_.length())
+    {
+      // the rest of the file was read, there is nothing left to scan
+      Drop();
+      chunk_ = InitialChunk(max_size_);
+      Give(reserved_);
+    }
+
+    return static_cast<int>(len);
+  }
+
+  static const size_t kMinChunk = 256 << 10;
+
+  static size_t InitialChunk(size_t max_size)
+  {
+    return max_size < kMinChunk ? max_size : kMinChunk;
+  }
+
+  bool Covers(uint64_t offset, size_t n) const
+  {
+    const uint64_t end = off_ + buf_.length();
+    return offset >= off_ && (offset + n <= end || (eof_ && offset <= end));
+  }
+
+  void Grow()
+  {
+    chunk_ = std::min(chunk_ * 2, max_size_);
+  }
+
+  bool Reserve(size_t n)
+  {
+    if (!budget_->Reserve(this, n))
+    {
+      return false;
+    }
+
+    reserved_ += n;
+    return true;
+  }
+
+  void Give(size_t n)
+  {
+    if (n > 0)
+    {
+      budget_->Release(this, n);
+      reserved_ -= n;
+    }
+  }
+
+  // give back the chunks that end at or before offset, buf_ no longer
+  // holds any of them
+  void Free(uint64_t offset)
+  {
+    size_t n = 0;
+    while (!held_.empty() && held_.front().first <= offset)
+    {
+      n += held_.front().second;
+      held_.pop_front();
+    }
+
+    Give(n);
+  }
+
+  // forget everything buffered or on its way, what it reserved is left to
+  // the caller to give back
+  void Drop()
+  {
+    if (next_pending_)
+    {
+      next_pending_ = false;
+      next_read_->Finish();
+      next_read_.reset();
+    }
+
+    next_ = librados::bufferptr();
+    held_.clear();
+    buf_.clear();
+    off_ = 0;
+    eof_ = false;
+  }
+
+  const boost::shared_ptr<RadosScanBudget> budget_;
+  boost::mutex mutex_;
+  const size_t max_size_;
+  size_t chunk_;
+
+  // bytes taken from the budget, and the file end offset and size of each
+  // chunk buf_ still holds part of
+  size_t reserved_;
+  std::deque<std::pair<uint64_t, size_t> > held_;
+
+  // [off_, off_ + buf_.length()) of the file, eof_ if that is where it ends
+  librados::bufferlist buf_;
+  uint64_t off_;
+  bool eof_;
+
+  // the chunk that follows buf_
+  librados::bufferptr next_;
+  uint64_t next_off_;
+  boost::shared_ptr<RadosLayoutRead> next_read_;
+  bool next_pending_;
+};
+
+// a read of a RadosRandomAccessFile and its outcome
+struct RadosReadRequest
+{
+  RadosReadRequest(uint64_t offset, size_t n, char* scratch)
+    : offset(offset)
+    , n(n)
+    , scratch(scratch)
+  {
+  }
+
+  uint64_t offset;
+  size_t n;
+  char* scratch;
+  leveldb::Slice result;
+  leveldb::Status status;
+};
+
+class RadosRandomAccessFile : public leveldb::RandomAccessFile
+{
+public:
+  RadosRandomAccessFile(const boost::shared_ptr<RadosBackend>& ctx, const std::string& fname, const RadosLayout& layout, uint64_t size, const boost::shared_ptr<RadosBlockCache>& cache, const boost::shared_ptr<leveldb::RandomAccessFile>& local, const boost::shared_ptr<RadosStats>& stats, const boost::shared_ptr<RadosScanBudget>& scan_budget, const RadosEnvOptions& options)
+    : ctx_(ctx)
+    , fname_(fname)
+    , stats_(stats)
+    , oid_(ObjectName(fname))
+    , layout_(layout)
+    , size_(size)
+    , cache_(cache)
+    , cache_id_(cache ? cache->Open(fname) : 0)
+    , local_(local)
+    , max_pinned_(options.block_cache_pinned_pages)
+    , tail_size_(GetFileType(fname) == kTableFile ? options.table_tail_size : 0)
+    , tail_loaded_(false)
+    , tail_off_(0)
+    , tail_eof_(false)
+    , scan_readahead_(options.scan_readahead_size)
+    , scan_(options.scan_readahead_size, scan_budget)
+    , last_end_(0)
+    , sequential_reads_(0)
+    , stray_reads_(0)
+    , scanning_(false)
+    , scan_begin_(0)
+    , scan_end_(0)
+  {
+  }
+
+  virtual ~RadosRandomAccessFile()
+  {
+    for (std::map<uint64_t, leveldb::Cache::Handle*>::iterator it = pinned_.begin(); it != pinned_.end(); ++it)
+    {
+      cache_->Unpin(it->second);
+    }
+  }
+
+private:
+  // everything a read keeps track of lives on the stack, a read served
+  // from memory doesn't allocate
+  virtual leveldb::Status Read(uint64_t offset, size_t n, leveldb::Slice* result, char* scratch) const
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    RadosReadRequest request(offset, n, scratch);
+    PendingRead pending;
+    StartRead(&request, &pending);
+    FinishRead(&request, &pending);
+
+    const bool ok = request.status.ok();
+    stats_->Record(RadosStats::kRandomRead, start, ok, ok ? request.result.size() : 0);
+
+    *result = request.result;
+    return request.status;
+  }
+
+  // what a read is waiting for once it was started
+  struct PendingRead
+  {
+    enum State
+    {
+      kDone,
+      // straight into scratch
+      kDirect,
+      // every page is cached
+      kCached,
+      // filling pages first_miss to last_miss through buf
+      kFill
+    };
+
+    PendingRead()
+      : state(kDone)
+      , first(0)
+      , last(0)
+      , first_miss(0)
+      , last_miss(0)
+      , pages(inline_pages)
+      , page_count(0)
+    {
+    }
+
+    // one handle per page from first to last, only reads that span more
+    // than a few pages allocate them
+    void SetPages(size_t count)
+    {
+      if (count > kInlinePages)
+      {
+        more_pages.assign(count, static_cast<leveldb::Cache::Handle*>(NULL));
+        pages = &more_pages[0];
+      }
+      else
+      {
+        std::fill(inline_pages, inline_pages + count, static_cast<leveldb::Cache::Handle*>(NULL));
+        pages = inline_pages;
+      }
+
+      page_count = count;
+    }
+
+    enum
+    {
+      kInlinePages = 4
+    };
+
+    State state;
+    uint64_t first;
+    uint64_t last;
+    uint64_t first_miss;
+    uint64_t last_miss;
+    leveldb::Cache::Handle* inline_pages[kInlinePages];
+    std::vector<leveldb::Cache::Handle*> more_pages;
+    leveldb::Cache::Handle** pages;
+    size_t page_count;
+    librados::bufferptr buf;
+    RadosLayoutRead io;
+
+  private:
+    PendingRead(const PendingRead&);
+    void operator=(const PendingRead&);
+  };
+
+  // serve the request from memory if possible, otherwise send its read
+  void StartRead(RadosReadRequest* request, PendingRead* pending) const
+  {
+    const uint64_t offset = request->offset;
+    const size_t n = request->n;
+
+    if (local_)
+    {
+      request->status = local_->Read(offset, n, &request->result, request->scratch);
+      return;
+    }
+
+    if (tail_size_ > 0)
+    {
+      bool served = false;
+      request->status = ReadTail(offset, n, &request->result, &served);
+      if (!request->status.ok() || served)
+      {
+        return;
+      }
+    }
+
+    if (scan_readahead_ > 0 && n > 0)
+    {
+      bool ended = false;
+      if (IsScan(offset, n, &ended))
+      {
+        ReadScan(request);
+        return;
+      }
+
+      if (ended)
+      {
+        scan_.End();
+      }
+    }
+
+    if (!cache_ || n == 0)
+    {
+      pending->state = PendingRead::kDirect;
+      pending->io.Start(*ctx_, oid_, layout_, request->scratch, n, offset);
+      return;
+    }
+
+    const uint64_t page_size = cache_->page_size();
+    pending->first = offset / page_size;
+    pending->last = (offset + n - 1) / page_size;
+
+    if (pending->first == pending->last && ReadPinned(pending->first, offset, n, &request->result))
+    {
+      return;
+    }
+
+    pending->SetPages(pending->last - pending->first + 1);
+    pending->first_miss = pending->last + 1;
+    pending->last_miss = pending->first;
+    for (uint64_t page = pending->first; page <= pending->last; ++page)
+    {
+      pending->pages[page - pending->first] = cache_->Lookup(cache_id_, page);
+      if (pending->pages[page - pending->first] == NULL)
+      {
+        pending->first_miss = std::min(pending->first_miss, page);
+        pending->last_miss = page;
+      }
+    }
+
+    if (pending->first_miss > pending->last_miss)
+    {
+      pending->state = PendingRead::kCached;
+      return;
+    }
+
+    // fill every missing page with one read, pages that were
+    // already cached in between are simply read again
+    const size_t len = (pending->last_miss - pending->first_miss + 1) * page_size;
+    pending->state = PendingRead::kFill;
+    pending->buf = librados::bufferptr(ceph::buffer::create(len));
+    pending->io.Start(*ctx_, oid_, layout_, pending->buf.c_str(), len, pending->first_miss * page_size);
+  }
+
+  void FinishRead(RadosReadRequest* request, PendingRead* pending) const
+  {
+    if (pending->state == PendingRead::kDone)
+    {
+      return;
+    }
+    else if (pending->state == PendingRead::kDirect)
+    {
+      const int r = pending->io.Finish();
+      if (r < 0)
+      {
+        request->status = IOError("RadosRandomAccessFile::Read: " + fname_, -r);
+      }
+      else
+      {
+        request->result = leveldb::Slice(request->scratch, r);
+      }
+
+      return;
+    }
+
+    leveldb::Cache::Handle** const pages = pending->pages;
+    leveldb::Status s;
+    if (pending->state == PendingRead::kFill)
+    {
+      const int r = pending->io.Finish();
+      if (r < 0)
+      {
+        s = IOError("RadosRandomAccessFile::Read: " + fname_, -r);
+      }
+      else
+      {
+        FillPages(pending, r);
+      }
+    }
+
+    const uint64_t offset = request->offset;
+    const size_t n = request->n;
+    if (s.ok() && pending->first == pending->last && Pin(pending->first, pages[0]))
+    {
+      // handed out by pointer, nothing to copy
+      ReadPinned(pending->first, offset, n, &request->result);
+      return;
+    }
+
+    const uint64_t page_size = cache_->page_size();
+    size_t copied = 0;
+    for (uint64_t page = pending->first; s.ok() && page <= pending->last; ++page)
+    {
+      const librados::bufferlist& bl = cache_->Value(pages[page - pending->first]);
+      const uint64_t page_off = page * page_size;
+      const size_t pos = std::max(offset, page_off) - page_off;
+      if (pos >= bl.length())
+      {
+        // end of file
+        break;
+      }
+
+      const size_t len = std::min(n - copied, bl.length() - pos);
+      bl.copy(pos, len, request->scratch + copied);
+      copied += len;
+    }
+
+    for (size_t i = 0; i < pending->page_count; ++i)
+    {
+      if (pages[i] != NULL)
+      {
+        cache_->Release(pages[i]);
+      }
+    }
+
+    if (!s.ok())
+    {
+      request->status = s;
+      return;
+    }
+
+    request->result = leveldb::Slice(request->scratch, copied);
+  }
+
+  // Table::Open reads the footer, then the index, meta index and filter
+  // blocks that sit right in front of it. the first read of a table pulls in
+  // the whole tail ending where that read ends along with the object size,
+  // in a single op, and keeps it for the lifetime of the file so those
+  // reads don't each pay for a round trip
+  leveldb::Status ReadTail(uint64_t offset, size_t n, leveldb::Slice* result, bool* served) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (!tail_loaded_)
+    {
+      tail_loaded_ = true;
+      const int err = LoadTail(offset + n);
+      if (err < 0)
+      {
+        tail_.clear();
+        return IOError("RadosRandomAccessFile::Read: " + fname_, -err);
+      }
+    }
+
+    const uint64_t tail_end = tail_off_ + tail_.length();
+    if (offset < tail_off_ || (offset + n > tail_end && !tail_eof_))
+    {
+      *served = false;
+    }
+    else if (offset >= tail_end)
+    {
+      *result = leveldb::Slice();
+      *served = true;
+    }
+    else
+    {
+      *result = leveldb::Slice(tail_.c_str() + (offset - tail_off_), std::min(static_cast<uint64_t>(n), tail_end - offset));
+      *served = true;
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  int LoadTail(uint64_t end) const
+  {
+    tail_off_ = end > tail_size_ ? end - tail_size_ : 0;
+    const size_t len = end - tail_off_;
+
+    uint64_t size = 0;
+    if (layout_.striped())
+    {
+      // the env has already looked up the size along with the layout
+      size = size_;
+      librados::bufferptr buf(ceph::buffer::create(len));
+      const int r = ReadLayout(*ctx_, oid_, layout_, buf.c_str(), len, tail_off_);
+      if (r < 0)
+      {
+        return r;
+      }
+
+      tail_.append(buf, 0, r);
+    }
+    else
+    {
+      int stat_err = 0;
+      int read_err = 0;
+
+      RadosReadOp op;
+      op.Stat(&size, &stat_err);
+      op.Read(tail_off_, len, &tail_, &read_err);
+      const int err = ctx_->Operate(oid_, op);
+      if (err < 0)
+      {
+        return err;
+      }
+    }
+
+    // reads past the tail only come back short if it really is the end of the file
+    tail_eof_ = tail_off_ + tail_.length() >= size;
+    tail_.c_str();
+
+    return 0;
+  }
+
+  // a read that starts where the last few ended, or that falls into what
+  // the scan has already read ahead, is part of a scan. anything else goes
+  // through the block cache. a point lookup in between doesn't end a scan,
+  // kScanReads reads in a row elsewhere do and set *ended
+  bool IsScan(uint64_t offset, size_t n, bool* ended) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    const bool sequential = offset == last_end_;
+    last_end_ = offset + n;
+    if (scanning_ && offset >= scan_begin_ && offset <= scan_end_)
+    {
+      stray_reads_ = 0;
+      return true;
+    }
+
+    sequential_reads_ = sequential ? sequential_reads_ + 1 : 0;
+    if (sequential_reads_ >= kScanReads)
+    {
+      scanning_ = true;
+      stray_reads_ = 0;
+      return true;
+    }
+
+    if (scanning_ && ++stray_reads_ >= kScanReads)
+    {
+      scanning_ = false;
+      *ended = true;
+    }
+
+    return false;
+  }
+
+  // scans bypass the block cache, a compaction would only evict what point
+  // lookups need with blocks that are read once
+  void ReadScan(RadosReadRequest* request) const
+  {
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    const int r = scan_.Read(*ctx_, oid_, layout_, request->offset, request->n, request->scratch, &begin, &end);
+    if (r < 0)
+    {
+      request->status = IOError("RadosRandomAccessFile::Read: " + fname_, -r);
+    }
+    else
+    {
+      request->result = leveldb::Slice(request->scratch, r);
+    }
+
+    // nothing buffered once the scan reached the end of the file or its
+    // read didn't fit in the budget, a scan has to start over
+    boost::mutex::scoped_lock lock(mutex_);
+    scan_begin_ = begin;
+    scan_end_ = end;
+    if (begin == end)
+    {
+      scanning_ = false;
+      sequential_reads_ = 0;
+    }
+  }
+
+  // serve a read that falls in a single page pinned by this file. LevelDB
+  // keeps using data returned outside of scratch for as long as the file is
+  // open, so pinned pages are only released by the destructor
+  bool ReadPinned(uint64_t page, uint64_t offset, size_t n, leveldb::Slice* result) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<uint64_t, leveldb::Cache::Handle*>::const_iterator it = pinned_.find(page);
+    if (it == pinned_.end())
+    {
+      return false;
+    }
+
+    const librados::bufferlist& bl = cache_->Value(it->second);
+    const size_t pos = offset - page * cache_->page_size();
+    if (pos >= bl.length())
+    {
+      *result = leveldb::Slice();
+    }
+    else
+    {
+      *result = leveldb::Slice(bl.buffers().front().c_str() + pos, std::min(n, bl.length() - pos));
+    }
+
+    return true;
+  }
+
+  // hand a page handle over to pinned_, returns false if this file already
+  // pins as many pages as it is allowed to
+  bool Pin(uint64_t page, leveldb::Cache::Handle* handle) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (pinned_.count(page) == 0)
+    {
+      if (pinned_.size() >= max_pinned_ || !cache_->Value(handle).is_contiguous() || !cache_->Pin(handle))
+      {
+        return false;
+      }
+
+      pinned_[page] = handle;
+    }
+    else
+    {
+      // another reader beat us to it
+      cache_->Release(handle);
+    }
+
+    return true;
+  }
+
+  // cache the r bytes that came back for the missing pages of a request
+  void FillPages(PendingRead* pending, size_t r) const
+  {
+    const uint64_t page_size = cache_->page_size();
+    librados::bufferlist bl;
+    if (r > 0)
+    {
+      bl.append(pending->buf, 0, r);
+    }
+
+    for (uint64_t page = pending->first_miss; page <= pending->last_miss; ++page)
+    {
+      const uint64_t pos = (page - pending->first_miss) * page_size;
+      librados::bufferlist contents;
+      if (pos < bl.length())
+      {
+        contents.substr_of(bl, pos, std::min(page_size, bl.length() - pos));
+      }
+
+      leveldb::Cache::Handle*& handle = pending->pages[page - pending->first];
+      if (handle != NULL)
+      {
+        cache_->Release(handle);
+      }
+
+      handle = cache_->Insert(fname_, cache_id_, page, contents);
+    }
+  }
+
+private:
+  const boost::shared_ptr<RadosBackend> ctx_;
+  const std::string fname_;
+  const boost::shared_ptr<RadosStats> stats_;
+  const std::string oid_;
+  const RadosLayout layout_;
+  // only known up front for striped files
+  const uint64_t size_;
+  const boost::shared_ptr<RadosBlockCache> cache_;
+  const uint64_t cache_id_;
+
+  // a complete copy on local disk, if there is one it serves every read
+  const boost::shared_ptr<leveldb::RandomAccessFile> local_;
+
+  // pages handed out to LevelDB by pointer
+  const size_t max_pinned_;
+  mutable boost::mutex mutex_;
+  mutable std::map<uint64_t, leveldb::Cache::Handle*> pinned_;
+
+  // the end of a table file, fetched by its first read
+  const uint64_t tail_size_;
+  mutable bool tail_loaded_;
+  mutable librados::bufferlist tail_;
+  mutable uint64_t tail_off_;
+  mutable bool tail_eof_;
+
+  // sequential reads in a row before a file counts as being scanned
+  static const int kScanReads = 2;
+
+  // read-ahead for scans, the window it covers is kept under mutex_ so
+  // other reads can tell whether they are part of the scan
+  const size_t scan_readahead_;
+  mutable RadosScanReadahead scan_;
+  mutable uint64_t last_end_;
+  mutable int sequential_reads_;
+  mutable int stray_reads_;
+  mutable bool scanning_;
+  mutable uint64_t scan_begin_;
+  mutable uint64_t scan_end_;
+};
+
+// Whether an env still holds the writer lock on a DB. The lock is only
+// known to be held until a lease after the last renewal that succeeded was
+// sent, past that another instance may have taken over. Once lost it stays
+// lost, and the env fails every write to the DB from then on
+class RadosLease
+{
+public:
+  RadosLease()
+    : deadline_(0)
+    , lost_(false)
+  {
+  }
+
+  // the lock was taken or renewed by a call sent at start_micros, lasting
+  // lease seconds. 0 never expires. a renewal sent once the lease had run
+  // out may have taken the lock back after someone else held it
+  void Renewed(uint64_t start_micros, uint32_t lease)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (deadline_ != 0 && start_micros >= deadline_)
+    {
+      lost_ = true;
+    }
+
+    deadline_ = lease > 0 ? start_micros + static_cast<uint64_t>(lease) * 1000000 : 0;
+  }
+
+  void Lose()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    lost_ = true;
+  }
+
+  bool Held()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (deadline_ != 0 && RadosStats::NowMicros() >= deadline_)
+    {
+      lost_ = true;
+    }
+
+    return !lost_;
+  }
+
+private:
+  boost::mutex mutex_;
+  uint64_t deadline_;
+  bool lost_;
+};
+
+class RadosWritableFile : public leveldb::WritableFile
+{
+public:
+  // lease may be NULL when the DB isn't locked for writing
+  RadosWritableFile(const boost::shared_ptr<RadosBackend>& ctx, const std::string& fname, const RadosLayout& layout, const boost::shared_ptr<RadosFileTable>& files, const boost::shared_ptr<RadosBufferPool>& buffers, const boost::shared_ptr<RadosStats>& stats, const boost::shared_ptr<RadosLease>& lease, const RadosEnvOptions& options)
+    : ctx_(ctx)
+    , fname_(fname)
+    , files_(files)
+    , buffers_(buffers)
+    , stats_(stats)
+    , lease_(lease)
+    , oid_(ObjectName(fname))
+    , layout_(layout)
+    , type_(GetFileType(fname))
+    , buffer_size_(BufferSize(type_, options))
+    , durability_(options.durability(type_))
+    , size_(0)
+    , recorded_size_(0)
+    , max_inflight_ops_(std::max(options.max_inflight_ops, static_cast<size_t>(1)))
+    , max_inflight_bytes_(options.max_inflight_bytes)
+    , inflight_bytes_(0)
+    , created_(false)
+    , create_(NULL)
+  {
+    // list the new file in its directory. this is ordered before any later
+    // index update or listing, so there is no need to wait for it here
+    UpdateIndex();
+  }
+
+  virtual ~RadosWritableFile()
+  {
+    WaitForInflight(0, 0);
+    buffers_->Put(buffer_);
+  }
+
+private:
+  virtual leveldb::Status Append(const leveldb::Slice& data)
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoAppend(data);
+    stats_->Record(RadosStats::kAppend, start, s.ok(), data.size());
+
+    return s;
+  }
+
+  virtual leveldb::Status Close()
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoClose();
+    stats_->Record(RadosStats::kClose, start, s.ok(), 0);
+
+    return s;
+  }
+
+  virtual leveldb::Status Flush()
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoFlush();
+    stats_->Record(RadosStats::kFlush, start, s.ok(), 0);
+
+    return s;
+  }
+
+  virtual leveldb::Status Sync()
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoSync();
+    stats_->Record(RadosStats::kSync, start, s.ok(), 0);
+
+    return s;
+  }
+
+  leveldb::Status DoAppend(const leveldb::Slice& data)
+  {
+    if (!status_.ok())
+    {
+      return status_;
+    }
+
+    // copy the data into the coalescing buffer, it is sent as a single
+    // append once it fills up or the file is flushed
+    const char* p = data.data();
+    size_t left = data.size();
+    while (left > 0)
+    {
+      if (!buffer_.have_raw())
+      {
+        buffer_ = buffers_->Get(buffer_size_);
+      }
+
+      const size_t n = std::min(left, static_cast<size_t>(buffer_.unused_tail_length()));
+      buffer_.append(p, n);
+      size_ += n;
+      p += n;
+      left -= n;
+
+      if (buffer_.unused_tail_length() == 0)
+      {
+        leveldb::Status s = SendBuffer();
+        if (!s.ok())
+        {
+          return s;
+        }
+      }
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status DoClose()
+  {
+    if (SendBuffer().ok())
+    {
+      // record the final size, in parallel with the last append
+      RecordSize();
+      UpdateIndex();
+    }
+
+    // whatever the level, as before the levels were added
+    WaitDurable(kDurabilityComplete);
+
+    return status_;
+  }
+
+  leveldb::Status DoFlush()
+  {
+    if (type_ == kTableFile)
+    {
+      // TableBuilder flushes after every block, but a table is useless until
+      // it has been synced and closed. leave its buffer alone until then
+      return leveldb::Status::OK();
+    }
+
+    leveldb::Status s = SendBuffer();
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    ReapInflight();
+
+    return status_;
+  }
+
+  leveldb::Status DoSync()
+  {
+    leveldb::Status s = SendBuffer();
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    RecordSize();
+    WaitDurable(durability_);
+
+    return status_;
+  }
+
+  // only wait on this file's appends, IoCtx::aio_flush would also wait on
+  // every other file writing through the same context
+  void WaitDurable(RadosDurability durability)
+  {
+    switch (durability)
+    {
+      case kDurabilityNone:
+        ReapInflight();
+        break;
+      case kDurabilityComplete:
+        WaitForInflight(0, 0);
+        break;
+      case kDurabilitySafe:
+      default:
+        while (!inflight_.empty())
+        {
+          inflight_.front().completion->WaitForSafe();
+          PopInflight();
+        }
+
+        break;
+    }
+  }
+
+  leveldb::Status SendBuffer()
+  {
+    if (!status_.ok())
+    {
+      return status_;
+    }
+    else if (lease_ && !lease_->Held())
+    {
+      // whatever is still buffered would land on another writer's DB
+      status_ = IOError("RadosWriteableFile/lock lost: " + fname_, ENOLCK);
+      return status_;
+    }
+
+    if (buffer_.length() == 0)
+    {
+      if (!created_)
+      {
+        // closed or synced without a single append, it still has to exist.
+        // rare enough to just wait for it
+        RadosWriteOp op;
+        AddCreate(&op);
+        SendOp(oid_, op);
+        WaitForInflight(0, 0);
+      }
+
+      return status_;
+    }
+
+    // a striped file gets one append per extent, consecutive extents lie in
+    // different objects so they are written in parallel
+    std::vector<RadosExtent> extents;
+    layout_.Map(size_ - buffer_.length(), buffer_.length(), &extents);
+
+    uint64_t pos = 0;
+    for (size_t i = 0; i < extents.size(); ++i)
+    {
+      librados::bufferlist bl;
+      bl.append(buffer_, pos, extents[i].length);
+      pos += extents[i].length;
+
+      leveldb::Status s = SendAppend(RadosLayout::ObjectName(oid_, extents[i].stripe), bl);
+      if (!s.ok())
+      {
+        return s;
+      }
+    }
+
+    // back to the pool once the last of its appends completes
+    buffer_ = librados::bufferptr();
+
+    // the env answers GetFileSize with what has been sent, same as a stat would
+    files_->InsertSize(fname_, size_);
+
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status SendAppend(const std::string& oid, librados::bufferlist& bl)
+  {
+    // block until the new append fits in the window
+    WaitForInflight(max_inflight_ops_ - 1, max_inflight_bytes_ > bl.length() ? max_inflight_bytes_ - bl.length() : 0);
+    leveldb::Status s = WaitForCreate();
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    // the first write to the first object also creates the file, so an
+    // existing file fails it just like an exclusive create would
+    RadosWriteOp op;
+    const bool create = oid == oid_ && !created_;
+    if (create)
+    {
+      AddCreate(&op);
+    }
+
+    op.Append(bl);
+
+    std::auto_ptr<RadosCompletion> c(ctx_->NewCompletion());
+    int err = ctx_->AioOperate(oid, c.get(), op);
+    if (err < 0)
+    {
+      status_ = IOError("RadosWriteableFile/Append: " + fname_, -err);
+      return status_;
+    }
+
+    inflight_.push_back(InflightOp(c.release(), bl.length()));
+    inflight_.back().buffer = buffer_;
+    inflight_bytes_ += bl.length();
+    stats_->AddInflight(1, bl.length());
+    if (create)
+    {
+      create_ = inflight_.back().completion;
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  // nothing else may reach the file's objects until the exclusive create
+  // has succeeded, or later appends would land on a file that already
+  // existed. only the first append after the create waits on it
+  leveldb::Status WaitForCreate()
+  {
+    if (create_ != NULL)
+    {
+      create_->WaitForComplete();
+      const int r = create_->ReturnValue();
+      if (r < 0 && status_.ok())
+      {
+        status_ = IOError("RadosWriteableFile/Create: " + fname_, -r);
+      }
+
+      create_ = NULL;
+    }
+
+    return status_;
+  }
+
+  static size_t BufferSize(RadosFileType type, const RadosEnvOptions& options)
+  {
+    const size_t size = type == kTableFile ? options.table_write_buffer_size : options.log_write_buffer_size;
+    return size > kMinBufferSize ? size : kMinBufferSize;
+  }
+
+  // prepend the exclusive create and the layout, unless already sent
+  void AddCreate(RadosWriteOp* op)
+  {
+    if (created_)
+    {
+      return;
+    }
+
+    op->Create(true);
+    if (layout_.striped())
+    {
+      op->SetXattr(kLayoutXattr, layout_.Encode());
+    }
+
+    created_ = true;
+  }
+
+  // the size of a striped file can't be told from its objects alone, keep
+  // it next to the layout on the first one
+  void RecordSize()
+  {
+    if (!layout_.striped() || size_ == recorded_size_ || !WaitForCreate().ok())
+    {
+      return;
+    }
+
+    RadosWriteOp op;
+    op.SetXattr(kSizeXattr, EncodeSize(size_));
+    SendOp(oid_, op);
+    recorded_size_ = size_;
+  }
+
+  void UpdateIndex()
+  {
+    RadosWriteOp op;
+    op.OmapSet(IndexEntry(fname_, size_));
+    SendOp(kIndexObject, op);
+  }
+
+  void SendOp(const std::string& oid, RadosWriteOp& op)
+  {
+    std::auto_ptr<RadosCompletion> c(ctx_->NewCompletion());
+    int err = ctx_->AioOperate(oid, c.get(), op);
+    if (err < 0)
+    {
+      if (status_.ok())
+      {
+        status_ = IOError("RadosWriteableFile/" + oid + ": " + fname_, -err);
+      }
+
+      return;
+    }
+
+    inflight_.push_back(InflightOp(c.release(), 0));
+    stats_->AddInflight(1, 0);
+  }
+
+  // free every op that already finished, without blocking
+  void ReapInflight()
+  {
+    // ops to one object complete in order, an index update that is
+    // still outstanding only delays reaping the appends after it
+    while (!inflight_.empty() && inflight_.front().completion->IsComplete())
+    {
+      PopInflight();
+    }
+  }
+
+  // block until no more than max_ops appends and max_bytes bytes are in flight
+  void WaitForInflight(size_t max_ops, size_t max_bytes)
+  {
+    ReapInflight();
+    while (!inflight_.empty() && (inflight_.size() > max_ops || inflight_bytes_ > max_bytes))
+    {
+      inflight_.front().completion->WaitForComplete();
+      PopInflight();
+    }
+  }
+
+  void PopInflight()
+  {
+    InflightOp& op = inflight_.front();
+    if (op.completion == create_)
+    {
+      create_ = NULL;
+    }
+
+    const int r = op.completion->ReturnValue();
+    if (r < 0 && status_.ok())
+    {
+      // the first failure sticks, later calls keep returning it
+      status_ = IOError("RadosWriteableFile: " + fname_, -r);
+    }
+
+    delete op.completion;
+    buffers_->Put(op.buffer);
+    inflight_bytes_ -= op.bytes;
+    stats_->AddInflight(-1, -static_cast<int64_t>(op.bytes));
+    inflight_.pop_front();
+  }
+
+private:
+  const boost::shared_ptr<RadosBackend> ctx_;
+  const std::string fname_;
+  // coalescing buffers are never smaller than this
+  static const size_t kMinBufferSize = 4 << 10;
+
+  const boost::shared_ptr<RadosFileTable> files_;
+  const boost::shared_ptr<RadosBufferPool> buffers_;
+  const boost::shared_ptr<RadosStats> stats_;
+  const boost::shared_ptr<RadosLease> lease_;
+  const std::string oid_;
+  const RadosLayout layout_;
+  const RadosFileType type_;
+  const size_t buffer_size_;
+  const RadosDurability durability_;
+
+  // appends that have not been sent yet, taken from buffers_ when needed
+  librados::bufferptr buffer_;
+  uint64_t size_;
+  uint64_t recorded_size_;
+
+  struct InflightOp
+  {
+    InflightOp(RadosCompletion* c, size_t n)
+      : completion(c)
+      , bytes(n)
+    {
+    }
+
+    RadosCompletion* completion;
+    size_t bytes;
+    // what an append was sent from, kept until it completes
+    librados::bufferptr buffer;
+  };
+
+  // appends and index updates sent but not reaped yet, oldest first
+  const size_t max_inflight_ops_;
+  const size_t max_inflight_bytes_;
+  std::deque<InflightOp> inflight_;
+  size_t inflight_bytes_;
+
+  // whether the op that creates the object has been sent, and its
+  // completion until something waits for it or it is reaped
+  bool created_;
+  RadosCompletion* create_;
+
+  // first error reported by an append
+  leveldb::Status status_;
+};
+
+// Files the env has been asked to delete, removed in the background so
+// that DeleteObsoleteFiles, which runs with the DB mutex held, doesn't wait
+// a round trip per file. Everything queued is removed in batches with up
+// to kMaxInflight removes in flight, followed by one index update per
+// directory. A file stays listed here until it is gone and the env acts
+// as if it already were. A remove that fails leaves the file listed in
+// its directory, so LevelDB deletes it again on its next pass
+class RadosDeleteQueue
+{
+public:
+  // remove_striped removes a file that is or may be striped
+  RadosDeleteQueue(RadosThreadPool* threads, int (*remove_striped)(RadosBackend& ctx, const std::string& oid))
+    : threads_(threads)
+    , remove_striped_(remove_striped)
+    , running_(false)
+  {
+  }
+
+  void Enqueue(const boost::shared_ptr<RadosBackend>& ctx, const std::string& fname, bool striped)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    Item& item = items_[fname];
+    item.ctx = ctx;
+    item.striped = striped;
+    item.taken = false;
+    queue_.push_back(fname);
+
+    if (!running_ && queue_.size() == 1)
+    {
+      threads_->Schedule(RadosThreadPool::kPriorityLow, &RadosDeleteQueue::Run, this);
+    }
+  }
+
+  bool IsPending(const std::string& fname)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return items_.count(fname) > 0;
+  }
+
+  // block until everything queued so far is gone
+  void Drain()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!items_.empty())
+    {
+      if (running_)
+      {
+        cond_.wait(lock);
+      }
+      else
+      {
+        RemoveQueued(lock);
+      }
+    }
+  }
+
+private:
+  // removes sent before waiting for the oldest one
+  static const size_t kMaxInflight = 32;
+
+  struct Item
+  {
+    boost::shared_ptr<RadosBackend> ctx;
+    bool striped;
+    // part of the batch being removed
+    bool taken;
+  };
+
+  // names of removed files, by directory
+  typedef std::map<RadosBackend*, std::pair<boost::shared_ptr<RadosBackend>, std::set<std::string> > > IndexKeys;
+
+  static void Run(void* arg)
+  {
+    RadosDeleteQueue* queue = static_cast<RadosDeleteQueue*>(arg);
+    boost::mutex::scoped_lock lock(queue->mutex_);
+    if (!queue->running_)
+    {
+      queue->RemoveQueued(lock);
+    }
+  }
+
+  // remove batches until the queue is empty, lock is released meanwhile
+  void RemoveQueued(boost::mutex::scoped_lock& lock)
+  {
+    running_ = true;
+    while (!queue_.empty())
+    {
+      std::vector<std::pair<std::string, Item> > batch;
+      for (std::deque<std::string>::const_iterator it = queue_.begin(); it != queue_.end(); ++it)
+      {
+        std::map<std::string, Item>::iterator item = items_.find(*it);
+        if (item != items_.end() && !item->second.taken)
+        {
+          item->second.taken = true;
+          batch.push_back(*item);
+        }
+      }
+
+      queue_.clear();
+      lock.unlock();
+      RemoveBatch(batch);
+      lock.lock();
+
+      for (size_t i = 0; i < batch.size(); ++i)
+      {
+        // queued again while it was being removed
+        std::map<std::string, Item>::iterator item = items_.find(batch[i].first);
+        if (item != items_.end() && item->second.taken)
+        {
+          items_.erase(item);
+        }
+      }
+    }
+
+    running_ = false;
+    cond_.notify_all();
+  }
+
+  void RemoveBatch(const std::vector<std::pair<std::string, Item> >& batch)
+  {
+    IndexKeys removed;
+
+    // indexes into batch with their removes, oldest first
+    std::deque<std::pair<size_t, RadosCompletion*> > inflight;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+      RadosBackend& ctx = *batch[i].second.ctx;
+      const std::string oid = ObjectName(batch[i].first);
+      if (batch[i].second.striped)
+      {
+        Removed(batch[i], remove_striped_(ctx, oid), &removed);
+        continue;
+      }
+
+      while (inflight.size() >= kMaxInflight)
+      {
+        Reap(batch, &inflight, &removed);
+      }
+
+      RadosCompletion* c = ctx.NewCompletion();
+      int err = ctx.AioRemove(oid, c);
+      if (err < 0)
+      {
+        delete c;
+        continue;
+      }
+
+      inflight.push_back(std::make_pair(i, c));
+    }
+
+    while (!inflight.empty())
+    {
+      Reap(batch, &inflight, &removed);
+    }
+
+    // drop them from their indexes, all directories in parallel
+    std::vector<RadosCompletion*> updates;
+    for (IndexKeys::const_iterator it = removed.begin(); it != removed.end(); ++it)
+    {
+      RadosWriteOp op;
+      op.OmapRmKeys(it->second.second);
+
+      RadosCompletion* c = it->first->NewCompletion();
+      if (it->first->AioOperate(kIndexObject, c, op) < 0)
+      {
+        delete c;
+        continue;
+      }
+
+      updates.push_back(c);
+    }
+
+    for (size_t i = 0; i < updates.size(); ++i)
+    {
+      updates[i]->WaitForComplete();
+      delete updates[i];
+    }
+  }
+
+  static void Reap(const std::vector<std::pair<std::string, Item> >& batch, std::deque<std::pair<size_t, RadosCompletion*> >* inflight, IndexKeys* removed)
+  {
+    const size_t i = inflight->front().first;
+    RadosCompletion* c = inflight->front().second;
+    inflight->pop_front();
+
+    c->WaitForComplete();
+    Removed(batch[i], c->ReturnValue(), removed);
+    delete c;
+  }
+
+  static void Removed(const std::pair<std::string, Item>& file, int r, IndexKeys* removed)
+  {
+    if (r < 0 && r != -ENOENT)
+    {
+      return;
+    }
+
+    std::pair<boost::shared_ptr<RadosBackend>, std::set<std::string> >& dir = (*removed)[file.second.ctx.get()];
+    dir.first = file.second.ctx;
+    dir.second.insert(ObjectName(file.first));
+  }
+
+  RadosThreadPool* const threads_;
+  int (* const remove_striped_)(RadosBackend& ctx, const std::string& oid);
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  // every file that isn't gone yet
+  std::map<std::string, Item> items_;
+  // names queued since the last batch was taken
+  std::deque<std::string> queue_;
+  bool running_;
+};
+
+// A lock on the DB held through a RADOS advisory lock on its LOCK object.
+// The writer holds kWriterLock exclusively, read-only instances hold
+// kReaderLock shared, so readers can neither keep the writer out nor be
+// kept out by it, but every one of them is listed on the object. Unless
+// the lock never expires a thread renews it every third of the lease, and
+// gives up once the lease ran out or someone else took the lock
+class RadosFileLock : public leveldb::FileLock
+{
+public:
+  // held is told whenever the lock is taken, renewed or lost
+  RadosFileLock(const boost::shared_ptr<RadosBackend>& ctx, const std::string& fname, bool exclusive, uint32_t lease, const boost::shared_ptr<RadosLease>& held)
+    : ctx_(ctx)
+    , held_(held)
+    , fname_(fname)
+    , oid_(ObjectName(fname))
+    , name_(exclusive ? kWriterLock : kReaderLock)
+    , cookie_(NewCookie())
+    , exclusive_(exclusive)
+    , lease_(lease)
+    , stopping_(false)
+  {
+  }
+
+  virtual ~RadosFileLock()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+      cond_.notify_all();
+    }
+
+    renewer_.join();
+  }
+
+  int Lock()
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    int err = ctx_->Lock(oid_, name_, cookie_, exclusive_, lease_, false);
+    if (err == 0)
+    {
+      held_->Renewed(start, lease_);
+    }
+
+    if (err == 0 && lease_ > 0)
+    {
+      renewer_ = boost::thread(&RadosFileLock::Renew, this);
+    }
+
+    return err;
+  }
+
+  const std::string& FileName() const
+  {
+    return fname_;
+  }
+
+  int Unlock()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+      cond_.notify_all();
+    }
+
+    // the lease must not be renewed after it was given up
+    renewer_.join();
+    return ctx_->Unlock(oid_, name_, cookie_);
+  }
+
+private:
+  static const char kWriterLock[];
+  static const char kReaderLock[];
+
+  // unique to this lock, so a process that opens the same DB twice
+  // conflicts with itself like any other writer would
+  static std::string NewCookie()
+  {
+    static boost::mutex mutex;
+    static uint64_t next = 0;
+
+    boost::mutex::scoped_lock lock(mutex);
+    std::ostringstream cookie;
+    cookie << "leveldb-rados." << getpid() << "." << time(NULL) << "." << next++;
+    return cookie.str();
+  }
+
+  void Renew()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    for (;;)
+    {
+      cond_.timed_wait(lock, boost::posix_time::milliseconds(lease_ * 1000 / 3));
+      if (stopping_)
+      {
+        return;
+      }
+
+      lock.unlock();
+      const uint64_t start = RadosStats::NowMicros();
+      int err = ctx_->Lock(oid_, name_, cookie_, exclusive_, lease_, true);
+      lock.lock();
+
+      if (err == 0)
+      {
+        held_->Renewed(start, lease_);
+      }
+      else if (err == -EBUSY)
+      {
+        // someone else has it already
+        held_->Lose();
+      }
+      else
+      {
+        // keep trying, the lease may not have run out yet
+        cerr << "RadosFileLock: renewing " << fname_ << " failed: " << strerror(-err) << endl;
+      }
+
+      if (!held_->Held())
+      {
+        cerr << "RadosFileLock: lost " << fname_ << ", writes to it fail from now on" << endl;
+        return;
+      }
+    }
+  }
+
+  const boost::shared_ptr<RadosBackend> ctx_;
+  const boost::shared_ptr<RadosLease> held_;
+  const std::string fname_;
+  const std::string oid_;
+  const std::string name_;
+  const std::string cookie_;
+  const bool exclusive_;
+  const uint32_t lease_;
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  bool stopping_;
+  boost::thread renewer_;
+};
+
+const char RadosFileLock::kWriterLock[] = "leveldb.writer";
+const char RadosFileLock::kReaderLock[] = "leveldb.reader";
+
+// A log written to local disk and shipped to RADOS behind it. Appends go to
+// both, but Sync only waits for the local file, the RADOS appends are sent
+// without waiting and only block once the inflight window is full, which
+// keeps the RADOS copy at most a window behind. Close waits for both
+class RadosHybridLogFile : public leveldb::WritableFile
+{
+public:
+  RadosHybridLogFile(leveldb::WritableFile* local, leveldb::WritableFile* remote)
+    : local_(local)
+    , remote_(remote)
+  {
+  }
+
+private:
+  virtual leveldb::Status Append(const leveldb::Slice& data)
+  {
+    leveldb::Status s = local_->Append(data);
+    if (s.ok())
+    {
+      s = remote_->Append(data);
+    }
+
+    return s;
+  }
+
+  virtual leveldb::Status Close()
+  {
+    leveldb::Status s = local_->Close();
+    leveldb::Status r = remote_->Close();
+
+    return s.ok() ? r : s;
+  }
+
+  virtual leveldb::Status Flush()
+  {
+    leveldb::Status s = local_->Flush();
+    if (s.ok())
+    {
+      s = remote_->Flush();
+    }
+
+    return s;
+  }
+
+  virtual leveldb::Status Sync()
+  {
+    leveldb::Status s = local_->Sync();
+    if (s.ok())
+    {
+      // ship what was buffered without waiting for it
+      s = remote_->Flush();
+    }
+
+    return s;
+  }
+
+  const boost::scoped_ptr<leveldb::WritableFile> local_;
+  const boost::scoped_ptr<leveldb::WritableFile> remote_;
+};
+
+// LevelDB's info LOG, kept in the DB's directory in the pool instead of on
+// local disk. Logv only formats the line into memory: a thread of the
+// logger's own appends whatever has built up once kBatchSize is buffered or
+// every kFlushInterval, so compactions never wait on the network. Lines
+// logged while kMaxBuffered bytes are already waiting are dropped, and how
+// many is logged with the next batch. Once the file grows past max_size it
+// is rotated to LOG.old, the name LevelDB itself rotates it to on open
+class RadosLogger : public leveldb::Logger
+{
+public:
+  RadosLogger(leveldb::Env* env, const std::string& fname, leveldb::WritableFile* file, uint64_t max_size)
+    : env_(env)
+    , fname_(fname)
+    , file_(file)
+    , max_size_(max_size)
+    , size_(0)
+    , dropped_(0)
+    , stopping_(false)
+    , writer_(&RadosLogger::Run, this)
+  {
+  }
+
+  // whatever is still buffered is written out
+  virtual ~RadosLogger()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+      cond_.notify_all();
+    }
+
+    writer_.join();
+
+    if (file_)
+    {
+      file_->Close();
+    }
+  }
+
+  virtual void Logv(const char* format, va_list ap)
+  {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct tm t;
+    localtime_r(&now.tv_sec, &t);
+
+    uint64_t thread_id = 0;
+    const pthread_t tid = pthread_self();
+    memcpy(&thread_id, &tid, std::min(sizeof(thread_id), sizeof(tid)));
+
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%04d/%02d/%02d-%02d:%02d:%02d.%06d %llx ",
+      t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+      static_cast<int>(now.tv_usec), static_cast<unsigned long long>(thread_id));
+
+    char buf[512];
+    va_list copy;
+    va_copy(copy, ap);
+    const int n = vsnprintf(buf, sizeof(buf), format, copy);
+    va_end(copy);
+
+    std::string line(prefix);
+    if (n < 0)
+    {
+      return;
+    }
+    else if (static_cast<size_t>(n) < sizeof(buf))
+    {
+      line.append(buf, n);
+    }
+    else
+    {
+      boost::scoped_array<char> large(new char[n + 1]);
+      va_copy(copy, ap);
+      vsnprintf(large.get(), n + 1, format, copy);
+      va_end(copy);
+      line.append(large.get(), n);
+    }
+
+    if (line[line.size() - 1] != '\n')
+    {
+      line.push_back('\n');
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (buffer_.size() + line.size() > kMaxBuffered)
+    {
+      ++dropped_;
+      return;
+    }
+
+    buffer_.append(line);
+    if (buffer_.size() >= kBatchSize)
+    {
+      cond_.notify_all();
+    }
+  }
+
+private:
+  static const size_t kBatchSize = 64 << 10;
+  static const size_t kMaxBuffered = 4 << 20;
+  static const long kFlushInterval = 1000;
+
+  void Run()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    for (;;)
+    {
+      if (!stopping_ && buffer_.size() < kBatchSize)
+      {
+        cond_.timed_wait(lock, boost::posix_time::milliseconds(kFlushInterval));
+      }
+
+      const bool stopping = stopping_;
+      std::string batch;
+      batch.swap(buffer_);
+      const size_t dropped = dropped_;
+      dropped_ = 0;
+
+      lock.unlock();
+      if (dropped > 0)
+      {
+        std::ostringstream note;
+        note << "RadosLogger: dropped " << dropped << " lines while writing was behind\n";
+        batch.append(note.str());
+      }
+
+      if (!batch.empty())
+      {
+        Write(batch);
+      }
+      lock.lock();
+
+      if (stopping)
+      {
+        return;
+      }
+    }
+  }
+
+  // only called on the writer thread
+  void Write(const std::string& batch)
+  {
+    if (file_ && max_size_ > 0 && size_ > 0 && size_ + batch.size() > max_size_)
+    {
+      Rotate();
+    }
+
+    if (!file_)
+    {
+      return;
+    }
+
+    leveldb::Status s = file_->Append(batch);
+    if (s.ok())
+    {
+      s = file_->Flush();
+    }
+
+    if (!s.ok())
+    {
+      cerr << "RadosLogger: writing " << fname_ << " failed: " << s.ToString() << endl;
+    }
+
+    size_ += batch.size();
+  }
+
+  void Rotate()
+  {
+    leveldb::Status s = file_->Close();
+    file_.reset();
+    if (s.ok())
+    {
+      s = env_->RenameFile(fname_, fname_ + ".old");
+    }
+
+    leveldb::WritableFile* file = NULL;
+    if (s.ok())
+    {
+      s = env_->NewWritableFile(fname_, &file);
+    }
+
+    if (!s.ok())
+    {
+      // nothing more is logged rather than the old LOG growing unbounded
+      cerr << "RadosLogger: rotating " << fname_ << " failed: " << s.ToString() << endl;
+      return;
+    }
+
+    file_.reset(file);
+    size_ = 0;
+  }
+
+  leveldb::Env* const env_;
+  const std::string fname_;
+  boost::scoped_ptr<leveldb::WritableFile> file_;
+  const uint64_t max_size_;
+  uint64_t size_;
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  std::string buffer_;
+  size_t dropped_;
+  bool stopping_;
+  boost::thread writer_;
+};
+
+const long RadosLogger::kFlushInterval;
+
+// What a follower wrote while it had the DB open, kept in memory and never
+// sent to RADOS, along with the shared files it deleted. Opening the DB
+// writes a new MANIFEST, a log and possibly a table recovered from the
+// writer's log, and may even compact, none of which the writer may see.
+// The files in it hold at most capacity bytes, appends past that fail.
+// Everything in it is dropped when the DB is closed
+class RadosOverlay
+{
+public:
+  typedef boost::shared_ptr<std::string> Contents;
+
+  explicit RadosOverlay(uint64_t capacity)
+    : capacity_(capacity)
+    , usage_(0)
+  {
+  }
+
+  // the overlay's copy of fname, NULL if it has none
+  Contents Find(const std::string& fname)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<std::string, Contents>::const_iterator it = files_.find(fname);
+    return it != files_.end() ? it->second : Contents();
+  }
+
+  // a shared file the follower deleted
+  bool IsHidden(const std::string& fname)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return hidden_.count(fname) > 0;
+  }
+
+  Contents Create(const std::string& fname)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    Forget(fname);
+    Contents& contents = files_[fname];
+    contents.reset(new std::string);
+    hidden_.erase(fname);
+    return contents;
+  }
+
+  void Delete(const std::string& fname)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    Forget(fname);
+    hidden_.insert(fname);
+  }
+
+  // src has to be in the overlay, a shared file is copied in first
+  void Rename(const std::string& src, const std::string& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    const Contents contents = files_[src];
+    files_.erase(src);
+    Forget(target);
+    files_[target] = contents;
+    hidden_.insert(src);
+    hidden_.erase(target);
+  }
+
+  // make a listing of the shared dir what the follower sees
+  void Merge(const std::string& dir, std::vector<std::string>* children)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    const std::string ns = Namespace(dir);
+
+    std::set<std::string> names;
+    for (size_t i = 0; i < children->size(); ++i)
+    {
+      if (hidden_.count((path(dir) / (*children)[i]).string()) == 0)
+      {
+        names.insert((*children)[i]);
+      }
+    }
+
+    for (std::map<std::string, Contents>::const_iterator it = files_.begin(); it != files_.end(); ++it)
+    {
+      if (Namespace(ParentDir(it->first)) == ns)
+      {
+        names.insert(ObjectName(it->first));
+      }
+    }
+
+    children->assign(names.begin(), names.end());
+  }
+
+  void Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    files_.clear();
+    hidden_.clear();
+    usage_ = 0;
+  }
+
+  // false if it would take the overlay past its capacity
+  bool Append(const Contents& contents, const leveldb::Slice& data)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (usage_ + data.size() > capacity_)
+    {
+      return false;
+    }
+
+    contents->append(data.data(), data.size());
+    usage_ += data.size();
+    return true;
+  }
+
+  // copy up to n bytes at offset into scratch, returns the number copied
+  size_t Read(const Contents& contents, uint64_t offset, size_t n, char* scratch)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (offset >= contents->size())
+    {
+      return 0;
+    }
+
+    return contents->copy(scratch, n, offset);
+  }
+
+  uint64_t Size(const Contents& contents)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return contents->size();
+  }
+
+private:
+  // drop fname from the overlay, called with mutex_ held. readers that
+  // still have it open keep its contents alive, they aren't counted
+  void Forget(const std::string& fname)
+  {
+    std::map<std::string, Contents>::iterator it = files_.find(fname);
+    if (it != files_.end())
+    {
+      usage_ -= it->second->size();
+      files_.erase(it);
+    }
+  }
+
+  const uint64_t capacity_;
+
+  boost::mutex mutex_;
+  std::map<std::string, Contents> files_;
+  std::set<std::string> hidden_;
+  uint64_t usage_;
+};
+
+class RadosOverlaySequentialFile : public leveldb::SequentialFile
+{
+public:
+  RadosOverlaySequentialFile(const boost::shared_ptr<RadosOverlay>& overlay, const RadosOverlay::Contents& contents)
+    : overlay_(overlay)
+    , contents_(contents)
+    , pos_(0)
+  {
+  }
+
+private:
+  virtual leveldb::Status Read(size_t n, leveldb::Slice* result, char* scratch)
+  {
+    const size_t r = overlay_->Read(contents_, pos_, n, scratch);
+    pos_ += r;
+    *result = leveldb::Slice(scratch, r);
+
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status Skip(uint64_t n)
+  {
+    pos_ += n;
+
+    return leveldb::Status::OK();
+  }
+
+  const boost::shared_ptr<RadosOverlay> overlay_;
+  const RadosOverlay::Contents contents_;
+  uint64_t pos_;
+};
+
+class RadosOverlayRandomAccessFile : public leveldb::RandomAccessFile
+{
+public:
+  RadosOverlayRandomAccessFile(const boost::shared_ptr<RadosOverlay>& overlay, const RadosOverlay::Contents& contents)
+    : overlay_(overlay)
+    , contents_(contents)
+  {
+  }
+
+private:
+  virtual leveldb::Status Read(uint64_t offset, size_t n, leveldb::Slice* result, char* scratch) const
+  {
+    *result = leveldb::Slice(scratch, overlay_->Read(contents_, offset, n, scratch));
+
+    return leveldb::Status::OK();
+  }
+
+  const boost::shared_ptr<RadosOverlay> overlay_;
+  const RadosOverlay::Contents contents_;
+};
+
+class RadosOverlayWritableFile : public leveldb::WritableFile
+{
+public:
+  RadosOverlayWritableFile(const boost::shared_ptr<RadosOverlay>& overlay, const std::string& fname, const RadosOverlay::Contents& contents)
+    : overlay_(overlay)
+    , fname_(fname)
+    , contents_(contents)
+  {
+  }
+
+private:
+  virtual leveldb::Status Append(const leveldb::Slice& data)
+  {
+    if (!overlay_->Append(contents_, data))
+    {
+      return IOError("RadosOverlayWritableFile: " + fname_, ENOSPC);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status Close()
+  {
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status Flush()
+  {
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status Sync()
+  {
+    return leveldb::Status::OK();
+  }
+
+  const boost::shared_ptr<RadosOverlay> overlay_;
+  const std::string fname_;
+  const RadosOverlay::Contents contents_;
+};
+
+// Counts the notifies the writer sends on CURRENT, each one means a new
+// MANIFEST and with it new tables for a follower to reopen the DB on
+class RadosGeneration : public RadosWatcher
+{
+public:
+  RadosGeneration()
+    : generation_(0)
+  {
+  }
+
+  virtual void Notified()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    ++generation_;
+  }
+
+  uint64_t Get()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return generation_;
+  }
+
+private:
+  boost::mutex mutex_;
+  uint64_t generation_;
+};
+
+// LevelDB keeps its format code private, a bulk load reads and writes the
+// few parts of it it needs itself: fixed and varint integers, the masked
+// crc32c of log records, and the VersionEdits the MANIFEST is made of
+
+static uint32_t Crc32c(uint32_t crc, const char* data, size_t n)
+{
+  crc = ~crc;
+  for (size_t i = 0; i < n; ++i)
+  {
+    crc ^= static_cast<unsigned char>(data[i]);
+    for (int k = 0; k < 8; ++k)
+    {
+      crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+    }
+  }
+
+  return ~crc;
+}
+
+static uint32_t MaskCrc(uint32_t crc)
+{
+  return ((crc >> 15) | (crc << 17)) + 0xa282ead8;
+}
+
+static uint64_t DecodeFixed(const char* p, int n)
+{
+  uint64_t result = 0;
+  for (int i = n - 1; i >= 0; --i)
+  {
+    result = (result << 8) | static_cast<unsigned char>(p[i]);
+  }
+
+  return result;
+}
+
+static void PutFixed32(std::string* dst, uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    dst->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+static void PutVarint64(std::string* dst, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    dst->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+
+  dst->push_back(static_cast<char>(value));
+}
+
+static void PutLengthPrefixed(std::string* dst, const leveldb::Slice& value)
+{
+  PutVarint64(dst, value.size());
+  dst->append(value.data(), value.size());
+}
+
+static bool GetVarint64(leveldb::Slice* input, uint64_t* value)
+{
+  uint64_t result = 0;
+  for (uint32_t shift = 0; shift <= 63 && !input->empty(); shift += 7)
+  {
+    const uint64_t byte = static_cast<unsigned char>((*input)[0]);
+    input->remove_prefix(1);
+    result |= (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+    {
+      *value = result;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool GetLengthPrefixed(leveldb::Slice* input, std::string* value)
+{
+  uint64_t len;
+  if (!GetVarint64(input, &len) || len > input->size())
+  {
+    return false;
+  }
+
+  value->assign(input->data(), len);
+  input->remove_prefix(len);
+  return true;
+}
+
+// LevelDB's order of internal keys: the user key, then an 8 byte tag of
+// sequence << 8 | type that sorts newest first
+class RadosInternalKeyComparator : public leveldb::Comparator
+{
+public:
+  explicit RadosInternalKeyComparator(const leveldb::Comparator* user)
+    : user_(user)
+  {
+  }
+
+  virtual int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const
+  {
+    int r = user_->Compare(UserKey(a), UserKey(b));
+    if (r == 0)
+    {
+      const uint64_t atag = Tag(a);
+      const uint64_t btag = Tag(b);
+      r = atag > btag ? -1 : (atag < btag ? +1 : 0);
+    }
+
+    return r;
+  }
+
+  virtual const char* Name() const
+  {
+    return "leveldb.InternalKeyComparator";
+  }
+
+  // only used to read tables, which never shortens keys
+  virtual void FindShortestSeparator(std::string* start, const leveldb::Slice& limit) const
+  {
+  }
+
+  virtual void FindShortSuccessor(std::string* key) const
+  {
+  }
+
+  static leveldb::Slice UserKey(const leveldb::Slice& key)
+  {
+    return leveldb::Slice(key.data(), key.size() < kTagSize ? key.size() : key.size() - kTagSize);
+  }
+
+  static uint64_t Tag(const leveldb::Slice& key)
+  {
+    return key.size() < kTagSize ? 0 : DecodeFixed(key.data() + key.size() - kTagSize, kTagSize);
+  }
+
+  static const size_t kTagSize = 8;
+
+private:
+  const leveldb::Comparator* const user_;
+};
+
+struct RadosTableMeta
+{
+  RadosTableMeta()
+    : number(0)
+    , size(0)
+  {
+  }
+
+  uint64_t number;
+  uint64_t size;
+  // internal keys
+  std::string smallest;
+  std::string largest;
+};
+
+// A VersionEdit, one record of a MANIFEST
+struct RadosVersionEdit
+{
+  enum Tag
+  {
+    kComparator = 1,
+    kLogNumber = 2,
+    kNextFileNumber = 3,
+    kLastSequence = 4,
+    kCompactPointer = 5,
+    kDeletedFile = 6,
+    kNewFile = 7,
+    kPrevLogNumber = 9
+  };
+
+  RadosVersionEdit()
+    : has_comparator(false)
+    , has_log_number(false)
+    , has_prev_log_number(false)
+    , has_next_file_number(false)
+    , has_last_sequence(false)
+    , log_number(0)
+    , prev_log_number(0)
+    , next_file_number(0)
+    , last_sequence(0)
+  {
+  }
+
+  bool Decode(leveldb::Slice input)
+  {
+    uint64_t tag;
+    while (GetVarint64(&input, &tag))
+    {
+      uint64_t level = 0;
+      RadosTableMeta meta;
+      std::string key;
+      bool ok;
+      switch (tag)
+      {
+        case kComparator:
+          ok = GetLengthPrefixed(&input, &comparator);
+          has_comparator = true;
+          break;
+        case kLogNumber:
+          ok = GetVarint64(&input, &log_number);
+          has_log_number = true;
+          break;
+        case kPrevLogNumber:
+          ok = GetVarint64(&input, &prev_log_number);
+          has_prev_log_number = true;
+          break;
+        case kNextFileNumber:
+          ok = GetVarint64(&input, &next_file_number);
+          has_next_file_number = true;
+          break;
+        case kLastSequence:
+          ok = GetVarint64(&input, &last_sequence);
+          has_last_sequence = true;
+          break;
+        case kCompactPointer:
+          ok = GetVarint64(&input, &level) && GetLengthPrefixed(&input, &key);
+          compact_pointers.push_back(std::make_pair(static_cast<int>(level), key));
+          break;
+        case kDeletedFile:
+          ok = GetVarint64(&input, &level) && GetVarint64(&input, &meta.number);
+          deleted_files.push_back(std::make_pair(static_cast<int>(level), meta.number));
+          break;
+        case kNewFile:
+          ok = GetVarint64(&input, &level)
+            && GetVarint64(&input, &meta.number)
+            && GetVarint64(&input, &meta.size)
+            && GetLengthPrefixed(&input, &meta.smallest)
+            && GetLengthPrefixed(&input, &meta.largest);
+          new_files.push_back(std::make_pair(static_cast<int>(level), meta));
+          break;
+        default:
+          ok = false;
+          break;
+      }
+
+      if (!ok || level >= kNumLevels)
+      {
+        return false;
+      }
+    }
+
+    return input.empty();
+  }
+
+  void Encode(std::string* dst) const
+  {
+    if (has_comparator)
+    {
+      PutVarint64(dst, kComparator);
+      PutLengthPrefixed(dst, comparator);
+    }
+
+    if (has_log_number)
+    {
+      PutVarint64(dst, kLogNumber);
+      PutVarint64(dst, log_number);
+    }
+
+    if (has_prev_log_number)
+    {
+      PutVarint64(dst, kPrevLogNumber);
+      PutVarint64(dst, prev_log_number);
+    }
+
+    if (has_next_file_number)
+    {
+      PutVarint64(dst, kNextFileNumber);
+      PutVarint64(dst, next_file_number);
+    }
+
+    if (has_last_sequence)
+    {
+      PutVarint64(dst, kLastSequence);
+      PutVarint64(dst, last_sequence);
+    }
+
+    for (std::vector<std::pair<int, std::string> >::const_iterator it = compact_pointers.begin(); it != compact_pointers.end(); ++it)
+    {
+      PutVarint64(dst, kCompactPointer);
+      PutVarint64(dst, it->first);
+      PutLengthPrefixed(dst, it->second);
+    }
+
+    for (std::vector<std::pair<int, uint64_t> >::const_iterator it = deleted_files.begin(); it != deleted_files.end(); ++it)
+    {
+      PutVarint64(dst, kDeletedFile);
+      PutVarint64(dst, it->first);
+      PutVarint64(dst, it->second);
+    }
+
+    for (std::vector<std::pair<int, RadosTableMeta> >::const_iterator it = new_files.begin(); it != new_files.end(); ++it)
+    {
+      PutVarint64(dst, kNewFile);
+      PutVarint64(dst, it->first);
+      PutVarint64(dst, it->second.number);
+      PutVarint64(dst, it->second.size);
+      PutLengthPrefixed(dst, it->second.smallest);
+      PutLengthPrefixed(dst, it->second.largest);
+    }
+  }
+
+  static const uint64_t kNumLevels = 7;
+
+  bool has_comparator;
+  bool has_log_number;
+  bool has_prev_log_number;
+  bool has_next_file_number;
+  bool has_last_sequence;
+  std::string comparator;
+  uint64_t log_number;
+  uint64_t prev_log_number;
+  uint64_t next_file_number;
+  uint64_t last_sequence;
+  std::vector<std::pair<int, std::string> > compact_pointers;
+  std::vector<std::pair<int, uint64_t> > deleted_files;
+  std::vector<std::pair<int, RadosTableMeta> > new_files;
+};
+
+// Records in LevelDB's log format, which the MANIFEST is written in: 32KB
+// blocks of fragments that each have a 7 byte header of masked crc32c,
+// length and type
+class RadosLogFormat
+{
+public:
+  static void AddRecord(std::string* dst, const leveldb::Slice& record)
+  {
+    const char* ptr = record.data();
+    size_t left = record.size();
+    bool begin = true;
+    do
+    {
+      const size_t leftover = kBlockSize - dst->size() % kBlockSize;
+      if (leftover < kHeaderSize)
+      {
+        dst->append(leftover, '\0');
+      }
+
+      const size_t avail = kBlockSize - dst->size() % kBlockSize - kHeaderSize;
+      const size_t fragment = std::min(left, avail);
+      const bool end = fragment == left;
+      const char type = begin && end ? kFullType : (begin ? kFirstType : (end ? kLastType : kMiddleType));
+
+      uint32_t crc = Crc32c(Crc32c(0, &type, 1), ptr, fragment);
+      PutFixed32(dst, MaskCrc(crc));
+      dst->push_back(static_cast<char>(fragment & 0xff));
+      dst->push_back(static_cast<char>(fragment >> 8));
+      dst->push_back(type);
+      dst->append(ptr, fragment);
+
+      ptr += fragment;
+      left -= fragment;
+      begin = false;
+    }
+    while (left > 0);
+  }
+
+  // a record cut short at the end is dropped, like LevelDB does after a
+  // crash while writing it
+  static bool ReadRecords(const std::string& src, std::vector<std::string>* records)
+  {
+    std::string record;
+    bool in_record = false;
+    size_t pos = 0;
+    while (pos < src.size())
+    {
+      const size_t block_left = kBlockSize - pos % kBlockSize;
+      if (block_left < kHeaderSize)
+      {
+        pos += block_left;
+        continue;
+      }
+
+      if (pos + kHeaderSize > src.size())
+      {
+        break;
+      }
+
+      const char* header = src.data() + pos;
+      const size_t length = static_cast<unsigned char>(header[4]) | (static_cast<unsigned char>(header[5]) << 8);
+      const char type = header[6];
+      if (type == kZeroType && length == 0)
+      {
+        // preallocated space, the block ends here
+        pos += block_left;
+        continue;
+      }
+
+      if (pos + kHeaderSize + length > src.size())
+      {
+        break;
+      }
+
+      const uint32_t expected = static_cast<uint32_t>(DecodeFixed(header, 4));
+      if (MaskCrc(Crc32c(Crc32c(0, &type, 1), header + kHeaderSize, length)) != expected)
+      {
+        return false;
+      }
+
+      const leveldb::Slice fragment(header + kHeaderSize, length);
+      pos += kHeaderSize + length;
+      switch (type)
+      {
+        case kFullType:
+          records->push_back(fragment.ToString());
+          in_record = false;
+          break;
+        case kFirstType:
+          record.assign(fragment.data(), fragment.size());
+          in_record = true;
+          break;
+        case kMiddleType:
+        case kLastType:
+          if (!in_record)
+          {
+            return false;
+          }
+
+          record.append(fragment.data(), fragment.size());
+          if (type == kLastType)
+          {
+            records->push_back(record);
+            in_record = false;
+          }
+          break;
+        default:
+          return false;
+      }
+    }
+
+    return true;
+  }
+
+private:
+  enum
+  {
+    kZeroType = 0,
+    kFullType = 1,
+    kFirstType = 2,
+    kMiddleType = 3,
+    kLastType = 4
+  };
+
+  static const size_t kBlockSize = 32768;
+  static const size_t kHeaderSize = 7;
+};
+
+// Adds tables built elsewhere to a DB that isn't open, without going
+// through its log or its compactions. The tables are uploaded in parallel
+// the same way the env writes any table, striped if tables are, which also
+// puts them in the directory index. Then a new MANIFEST holding the DB as
+// it was plus the tables is switched to through CURRENT, just like LevelDB
+// does on open, so the DB is untouched until that rename. A load that
+// fails before CURRENT names its MANIFEST deletes the tables it uploaded
+// and the MANIFEST, rather than leaving them for LevelDB to collect.
+//
+// Keys have to be internal keys with sequence 0, which makes the tables
+// older than anything already in the DB: a key that is in both keeps the
+// value the DB has. That only holds if the tables go below every table
+// they overlap, so they are all added to the last level and must not
+// overlap each other or what is already there
+class RadosBulkLoad
+{
+public:
+  RadosBulkLoad(leveldb::Env* env, leveldb::Env* local, RadosThreadPool* threads, size_t workers, const std::string& dbname, const leveldb::Comparator* user)
+    : env_(env)
+    , local_(local)
+    , threads_(threads)
+    , workers_(std::max(workers, static_cast<size_t>(1)))
+    , dbname_(dbname)
+    , user_(user)
+    , internal_(user)
+    , uploading_(false)
+    , next_(0)
+    , running_(0)
+  {
+  }
+
+  leveldb::Status Run(const std::vector<std::string>& tables)
+  {
+    leveldb::Status s = ReadManifest();
+    if (s.ok())
+    {
+      s = Inspect(tables);
+    }
+
+    if (s.ok())
+    {
+      s = Upload();
+    }
+
+    if (s.ok())
+    {
+      s = WriteManifest();
+    }
+
+    if (!s.ok() && !Committed())
+    {
+      Abandon();
+    }
+
+    return s;
+  }
+
+private:
+  struct Load
+  {
+    std::string source;
+    RadosTableMeta meta;
+  };
+
+  struct SmallestFirst
+  {
+    explicit SmallestFirst(const leveldb::Comparator* internal)
+      : internal(internal)
+    {
+    }
+
+    bool operator()(const Load& a, const Load& b) const
+    {
+      return internal->Compare(a.meta.smallest, b.meta.smallest) < 0;
+    }
+
+    const leveldb::Comparator* internal;
+  };
+
+  static const uint64_t kLastLevel = RadosVersionEdit::kNumLevels - 1;
+
+  // read in chunks this big and appended as they are, the writable file
+  // keeps its usual number of them in flight
+  static const size_t kUploadChunk = 1024 * 1024;
+
+  leveldb::Status ReadManifest()
+  {
+    std::string current;
+    leveldb::Status s = leveldb::ReadFileToString(env_, (path(dbname_) / "CURRENT").string(), &current);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    if (current.empty() || current[current.size() - 1] != '\n')
+    {
+      return leveldb::Status::Corruption("BulkLoad: CURRENT file does not end with newline", dbname_);
+    }
+
+    current.resize(current.size() - 1);
+
+    std::string contents;
+    s = leveldb::ReadFileToString(env_, (path(dbname_) / current).string(), &contents);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    std::vector<std::string> records;
+    if (!RadosLogFormat::ReadRecords(contents, &records))
+    {
+      return leveldb::Status::Corruption("BulkLoad: bad MANIFEST record", current);
+    }
+
+    for (std::vector<std::string>::const_iterator it = records.begin(); it != records.end(); ++it)
+    {
+      RadosVersionEdit edit;
+      if (!edit.Decode(*it))
+      {
+        return leveldb::Status::Corruption("BulkLoad: bad VersionEdit", current);
+      }
+
+      Apply(edit);
+    }
+
+    if (!base_.has_log_number || !base_.has_next_file_number || !base_.has_last_sequence)
+    {
+      return leveldb::Status::Corruption("BulkLoad: incomplete MANIFEST", current);
+    }
+
+    if (base_.has_comparator && base_.comparator != user_->Name())
+    {
+      return leveldb::Status::InvalidArgument("BulkLoad: DB comparator " + base_.comparator + " does not match", user_->Name());
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  void Apply(const RadosVersionEdit& edit)
+  {
+    if (edit.has_comparator)
+    {
+      base_.has_comparator = true;
+      base_.comparator = edit.comparator;
+    }
+
+    if (edit.has_log_number)
+    {
+      base_.has_log_number = true;
+      base_.log_number = edit.log_number;
+    }
+
+    if (edit.has_prev_log_number)
+    {
+      base_.has_prev_log_number = true;
+      base_.prev_log_number = edit.prev_log_number;
+    }
+
+    if (edit.has_next_file_number)
+    {
+      base_.has_next_file_number = true;
+      base_.next_file_number = edit.next_file_number;
+    }
+
+    if (edit.has_last_sequence)
+    {
+      base_.has_last_sequence = true;
+      base_.last_sequence = edit.last_sequence;
+    }
+
+    for (std::vector<std::pair<int, std::string> >::const_iterator it = edit.compact_pointers.begin(); it != edit.compact_pointers.end(); ++it)
+    {
+      compact_pointers_[it->first] = it->second;
+    }
+
+    for (std::vector<std::pair<int, uint64_t> >::const_iterator it = edit.deleted_files.begin(); it != edit.deleted_files.end(); ++it)
+    {
+      files_[it->first].erase(it->second);
+    }
+
+    for (std::vector<std::pair<int, RadosTableMeta> >::const_iterator it = edit.new_files.begin(); it != edit.new_files.end(); ++it)
+    {
+      files_[it->first][it->second.number] = it->second;
+    }
+  }
+
+  leveldb::Status Inspect(const std::vector<std::string>& tables)
+  {
+    loads_.resize(tables.size());
+    for (size_t i = 0; i < tables.size(); ++i)
+    {
+      loads_[i].source = tables[i];
+      leveldb::Status s = InspectTable(tables[i], &loads_[i].meta);
+      if (!s.ok())
+      {
+        return s;
+      }
+    }
+
+    std::sort(loads_.begin(), loads_.end(), SmallestFirst(&internal_));
+    for (size_t i = 0; i < loads_.size(); ++i)
+    {
+      if (i > 0 && Overlaps(loads_[i - 1].meta, loads_[i].meta))
+      {
+        return leveldb::Status::InvalidArgument("BulkLoad: tables overlap", loads_[i - 1].source + " " + loads_[i].source);
+      }
+
+      const std::map<uint64_t, RadosTableMeta>& last = files_[kLastLevel];
+      for (std::map<uint64_t, RadosTableMeta>::const_iterator it = last.begin(); it != last.end(); ++it)
+      {
+        if (Overlaps(it->second, loads_[i].meta))
+        {
+          return leveldb::Status::InvalidArgument("BulkLoad: table overlaps the last level of the DB", loads_[i].source);
+        }
+      }
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  // the key range of a table. every key is read to check it can be loaded,
+  // a single one with a higher sequence would shadow what the DB holds
+  leveldb::Status InspectTable(const std::string& fname, RadosTableMeta* meta)
+  {
+    leveldb::Status s = local_->GetFileSize(fname, &meta->size);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    leveldb::RandomAccessFile* file = NULL;
+    s = local_->NewRandomAccessFile(fname, &file);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    const boost::scoped_ptr<leveldb::RandomAccessFile> file_guard(file);
+
+    leveldb::Options options;
+    options.comparator = &internal_;
+    leveldb::Table* table = NULL;
+    s = leveldb::Table::Open(options, file, meta->size, &table);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    const boost::scoped_ptr<leveldb::Table> table_guard(table);
+
+    // the table is read once, it is only going to be uploaded
+    leveldb::ReadOptions read_options;
+    read_options.verify_checksums = true;
+    read_options.fill_cache = false;
+    const boost::scoped_ptr<leveldb::Iterator> it(table->NewIterator(read_options));
+
+    it->SeekToFirst();
+    if (it->Valid())
+    {
+      meta->smallest = it->key().ToString();
+    }
+
+    for (; it->Valid(); it->Next())
+    {
+      const leveldb::Slice key = it->key();
+      if (!IsLoadable(key))
+      {
+        return leveldb::Status::InvalidArgument("BulkLoad: keys are not internal keys with sequence 0", fname);
+      }
+
+      meta->largest.assign(key.data(), key.size());
+    }
+
+    if (!it->status().ok())
+    {
+      return it->status();
+    }
+    else if (meta->smallest.empty())
+    {
+      return leveldb::Status::InvalidArgument("BulkLoad: empty table", fname);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  // a value or a deletion, at sequence 0
+  static bool IsLoadable(const leveldb::Slice& key)
+  {
+    return key.size() >= RadosInternalKeyComparator::kTagSize && RadosInternalKeyComparator::Tag(key) <= 1;
+  }
+
+  bool Overlaps(const RadosTableMeta& a, const RadosTableMeta& b) const
+  {
+    return user_->Compare(RadosInternalKeyComparator::UserKey(a.smallest), RadosInternalKeyComparator::UserKey(b.largest)) <= 0
+      && user_->Compare(RadosInternalKeyComparator::UserKey(b.smallest), RadosInternalKeyComparator::UserKey(a.largest)) <= 0;
+  }
+
+  std::string FileName(uint64_t number, const char* suffix) const
+  {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%06llu.%s", static_cast<unsigned long long>(number), suffix);
+    return (path(dbname_) / buf).string();
+  }
+
+  leveldb::Status Upload()
+  {
+    for (std::vector<Load>::iterator it = loads_.begin(); it != loads_.end(); ++it)
+    {
+      it->meta.number = base_.next_file_number++;
+    }
+
+    uploading_ = true;
+
+    if (loads_.empty())
+    {
+      return leveldb::Status::OK();
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    running_ = std::min(workers_, loads_.size());
+    for (size_t i = 0; i < running_; ++i)
+    {
+      // behind the compactions of DBs that are open, which writers may be
+      // stalled on
+      threads_->Schedule(RadosThreadPool::kPriorityLow, &RadosBulkLoad::UploadWorker, this);
+    }
+
+    while (running_ > 0)
+    {
+      cond_.wait(lock);
+    }
+
+    return status_;
+  }
+
+  static void UploadWorker(void* arg)
+  {
+    RadosBulkLoad* load = static_cast<RadosBulkLoad*>(arg);
+    for (;;)
+    {
+      size_t i;
+      {
+        boost::mutex::scoped_lock lock(load->mutex_);
+        if (load->next_ >= load->loads_.size() || !load->status_.ok())
+        {
+          if (--load->running_ == 0)
+          {
+            load->cond_.notify_all();
+          }
+
+          return;
+        }
+
+        i = load->next_++;
+      }
+
+      leveldb::Status s = load->UploadOne(load->loads_[i]);
+      if (!s.ok())
+      {
+        boost::mutex::scoped_lock lock(load->mutex_);
+        if (load->status_.ok())
+        {
+          load->status_ = s;
+        }
+      }
+    }
+  }
+
+  leveldb::Status UploadOne(const Load& load)
+  {
+    leveldb::SequentialFile* src = NULL;
+    leveldb::Status s = local_->NewSequentialFile(load.source, &src);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    const boost::scoped_ptr<leveldb::SequentialFile> src_guard(src);
+
+    const std::string fname = FileName(load.meta.number, "ldb");
+    leveldb::WritableFile* dst = NULL;
+    s = env_->NewWritableFile(fname, &dst);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    const boost::scoped_ptr<leveldb::WritableFile> dst_guard(dst);
+    const boost::scoped_array<char> scratch(new char[kUploadChunk]);
+    uint64_t copied = 0;
+    for (;;)
+    {
+      leveldb::Slice chunk;
+      s = src->Read(kUploadChunk, &chunk, scratch.get());
+      if (!s.ok() || chunk.empty())
+      {
+        break;
+      }
+
+      s = dst->Append(chunk);
+      if (!s.ok())
+      {
+        break;
+      }
+
+      copied += chunk.size();
+    }
+
+    if (s.ok() && copied != load.meta.size)
+    {
+      s = leveldb::Status::IOError("BulkLoad: table changed while loading", load.source);
+    }
+
+    if (s.ok())
+    {
+      s = dst->Sync();
+    }
+
+    if (s.ok())
+    {
+      s = dst->Close();
+    }
+
+    return s;
+  }
+
+  leveldb::Status WriteManifest()
+  {
+    const uint64_t number = base_.next_file_number++;
+
+    RadosVersionEdit edit;
+    edit.has_comparator = true;
+    edit.comparator = user_->Name();
+    edit.has_log_number = true;
+    edit.log_number = base_.log_number;
+    edit.has_prev_log_number = true;
+    edit.prev_log_number = base_.prev_log_number;
+    edit.has_next_file_number = true;
+    edit.next_file_number = base_.next_file_number;
+    edit.has_last_sequence = true;
+    edit.last_sequence = base_.last_sequence;
+    edit.compact_pointers.assign(compact_pointers_.begin(), compact_pointers_.end());
+    for (uint64_t level = 0; level < RadosVersionEdit::kNumLevels; ++level)
+    {
+      for (std::map<uint64_t, RadosTableMeta>::const_iterator it = files_[level].begin(); it != files_[level].end(); ++it)
+      {
+        edit.new_files.push_back(std::make_pair(static_cast<int>(level), it->second));
+      }
+    }
+
+    for (std::vector<Load>::const_iterator it = loads_.begin(); it != loads_.end(); ++it)
+    {
+      edit.new_files.push_back(std::make_pair(static_cast<int>(kLastLevel), it->meta));
+    }
+
+    std::string record;
+    edit.Encode(&record);
+    std::string contents;
+    RadosLogFormat::AddRecord(&contents, record);
+
+    char manifest[64];
+    snprintf(manifest, sizeof(manifest), "MANIFEST-%06llu", static_cast<unsigned long long>(number));
+    manifest_ = manifest;
+    leveldb::Status s = WriteFileSync((path(dbname_) / manifest).string(), contents);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    // the rename is what makes the load visible
+    const std::string tmp = FileName(number, "dbtmp");
+    s = WriteFileSync(tmp, std::string(manifest) + "\n");
+    if (s.ok())
+    {
+      s = env_->RenameFile(tmp, (path(dbname_) / "CURRENT").string());
+    }
+
+    if (!s.ok())
+    {
+      env_->DeleteFile(tmp);
+    }
+
+    return s;
+  }
+
+  // whether CURRENT names the new MANIFEST after all. a rename that failed
+  // may still have gone through, the load then stands
+  bool Committed()
+  {
+    std::string current;
+    return !manifest_.empty()
+      && leveldb::ReadFileToString(env_, (path(dbname_) / "CURRENT").string(), &current).ok()
+      && current == manifest_ + "\n";
+  }
+
+  // delete what a failed load wrote, nothing refers to it
+  void Abandon()
+  {
+    if (uploading_)
+    {
+      for (std::vector<Load>::const_iterator it = loads_.begin(); it != loads_.end(); ++it)
+      {
+        env_->DeleteFile(FileName(it->meta.number, "ldb"));
+      }
+    }
+
+    if (!manifest_.empty())
+    {
+      env_->DeleteFile((path(dbname_) / manifest_).string());
+    }
+  }
+
+  leveldb::Status WriteFileSync(const std::string& fname, const leveldb::Slice& contents)
+  {
+    leveldb::WritableFile* file = NULL;
+    leveldb::Status s = env_->NewWritableFile(fname, &file);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    s = file->Append(contents);
+    if (s.ok())
+    {
+      s = file->Sync();
+    }
+
+    if (s.ok())
+    {
+      s = file->Close();
+    }
+
+    delete file;
+    if (!s.ok())
+    {
+      env_->DeleteFile(fname);
+    }
+
+    return s;
+  }
+
+  leveldb::Env* const env_;
+  leveldb::Env* const local_;
+  RadosThreadPool* const threads_;
+  const size_t workers_;
+  const std::string dbname_;
+  const leveldb::Comparator* const user_;
+  const RadosInternalKeyComparator internal_;
+
+  // the DB as of its current MANIFEST
+  RadosVersionEdit base_;
+  std::map<int, std::string> compact_pointers_;
+  std::map<uint64_t, RadosTableMeta> files_[RadosVersionEdit::kNumLevels];
+
+  std::vector<Load> loads_;
+
+  // what has been written to the DB so far, undone if the load fails
+  bool uploading_;
+  std::string manifest_;
+
+  // the uploads, spread over workers_ jobs
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  size_t next_;
+  size_t running_;
+  leveldb::Status status_;
+};
+
+class RadosEnv : public leveldb::EnvWrapper
+{
+public:
+  RadosEnv(const boost::shared_ptr<RadosBackend>& pool, const RadosEnvOptions& options)
+    : leveldb::EnvWrapper(Env::Default())
+    , pool_(pool)
+    , options_(options)
+    , files_(new RadosFileTable)
+    , buffers_(new RadosBufferPool(options.max_inflight_bytes * 2))
+    , stats_(new RadosStats)
+    , scan_budget_(new RadosScanBudget(options.scan_readahead_memory))
+    , watch_handle_(0)
+  {
+    if (options.block_cache_size > 0)
+    {
+      block_cache_.reset(new RadosBlockCache(options.block_cache_size, options.block_cache_page_size));
+    }
+
+    threads_.reset(new RadosThreadPool(options.background_threads));
+    deletes_.reset(new RadosDeleteQueue(threads_.get(), RemoveStriped));
+
+    if (!options.local_cache_dir.empty() && options.local_cache_size > 0)
+    {
+      local_cache_.reset(new RadosLocalCache(options.local_cache_dir, pool->Name(), options.local_cache_size, threads_.get()));
+    }
+
+    if (!options.local_log_dir.empty())
+    {
+      target()->CreateDir(options.local_log_dir);
+    }
+
+    // a reader that wrote to the shared files would corrupt the writer's
+    // DB, so the shared lock makes the env a follower too
+    if (options.follower || options.snapshot != 0 || options.lock_mode == kLockShared)
+    {
+      overlay_.reset(new RadosOverlay(options.follower_memory));
+    }
+
+    if (options.snapshot != 0)
+    {
+      pool_->SetReadSnap(options.snapshot);
+    }
+  }
+
+  virtual ~RadosEnv()
+  {
+    // nothing queued is lost, files LevelDB deleted stay deleted and
+    // followers hear of the last CURRENT written
+    deletes_->Drain();
+    while (SendNotify(this))
+    {
+    }
+  }
+
+  // snapshot of the counters, see RadosStats::Snapshot
+  std::string GetStats() const
+  {
+    return stats_->Snapshot();
+  }
+
+  // snapshot every object of the DB in dbname, open it with the
+  // snapshot option to read it as of now. nothing has to be copied or
+  // paused: whatever LevelDB syncs before a MANIFEST edit is applied
+  // before the edit is sent, so any snapshot holds a MANIFEST whose files
+  // are all complete, and writes sent after it preserve it. only writes
+  // sent through this env do, another process writing to the DB would
+  // never learn of the snapshot, so the DB has to be open here as the
+  // writer
+  leveldb::Status CreateCheckpoint(const std::string& dbname, uint64_t* snap)
+  {
+    if (overlay_)
+    {
+      return leveldb::Status::NotSupported("CreateCheckpoint: read-only env", dbname);
+    }
+
+    const boost::shared_ptr<RadosLease> lease = LeaseFor((path(dbname) / "LOCK").string());
+    if (!lease || !lease->Held())
+    {
+      return leveldb::Status::InvalidArgument("CreateCheckpoint: not open as the writer in this env", dbname);
+    }
+
+    const boost::shared_ptr<RadosBackend> ctx = NamespaceContext(dbname);
+
+    boost::mutex::scoped_lock lock(checkpoint_mutex_);
+    int err = ctx->SnapCreate(snap);
+    if (err < 0)
+    {
+      return IOError("CreateCheckpoint/snap_create: " + dbname, -err);
+    }
+
+    std::map<std::string, librados::bufferlist> entry;
+    entry[CheckpointKey(*snap)];
+    RadosWriteOp op;
+    op.OmapSet(entry);
+    err = ctx->Operate(kCheckpointObject, op);
+    if (err < 0)
+    {
+      ctx->SnapRemove(*snap);
+      return IOError("CreateCheckpoint/omap_set: " + dbname, -err);
+    }
+
+    std::vector<uint64_t>& snaps = checkpoints_[Namespace(dbname)];
+    snaps.insert(snaps.begin(), *snap);
+    err = ctx->SetWriteSnaps(snaps);
+    if (err < 0)
+    {
+      // writes don't preserve it, it mustn't be listed or kept
+      snaps.erase(snaps.begin());
+      std::set<std::string> keys;
+      keys.insert(CheckpointKey(*snap));
+      ctx->OmapRmKeys(kCheckpointObject, keys);
+      ctx->SnapRemove(*snap);
+      return IOError("CreateCheckpoint/set_write_ctx: " + dbname, -err);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status RemoveCheckpoint(const std::string& dbname, uint64_t snap)
+  {
+    if (overlay_)
+    {
+      return leveldb::Status::NotSupported("RemoveCheckpoint: read-only env", dbname);
+    }
+
+    const boost::shared_ptr<RadosBackend> ctx = NamespaceContext(dbname);
+
+    boost::mutex::scoped_lock lock(checkpoint_mutex_);
+    std::vector<uint64_t>& snaps = checkpoints_[Namespace(dbname)];
+    snaps.erase(std::remove(snaps.begin(), snaps.end(), snap), snaps.end());
+    int err = ctx->SetWriteSnaps(snaps);
+    if (err < 0)
+    {
+      return IOError("RemoveCheckpoint/set_write_ctx: " + dbname, -err);
+    }
+
+    std::set<std::string> keys;
+    keys.insert(CheckpointKey(snap));
+    err = ctx->OmapRmKeys(kCheckpointObject, keys);
+    if (err < 0 && err != -ENOENT)
+    {
+      return IOError("RemoveCheckpoint/omap_rm_keys: " + dbname, -err);
+    }
+
+    err = ctx->SnapRemove(snap);
+    if (err < 0 && err != -ENOENT)
+    {
+      return IOError("RemoveCheckpoint/snap_remove: " + dbname, -err);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  // add the local table files in tables to the DB in dbname, which must
+  // exist and not be open. the DB's writer lock is held meanwhile, an env
+  // that doesn't lock can't load
+  leveldb::Status BulkLoad(const std::string& dbname, const std::vector<std::string>& tables, const leveldb::Comparator* comparator)
+  {
+    if (overlay_)
+    {
+      return leveldb::Status::NotSupported("BulkLoad: read-only env", dbname);
+    }
+    else if (options_.lock_mode == kLockNone)
+    {
+      // nothing would keep a writer from opening the DB halfway through
+      return leveldb::Status::NotSupported("BulkLoad: env doesn't lock", dbname);
+    }
+
+    leveldb::FileLock* lock = NULL;
+    leveldb::Status s = LockFile((path(dbname) / "LOCK").string(), &lock);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    // the uploads leave at least half the threads to the env's other DBs
+    RadosBulkLoad load(this, target(), threads_.get(), options_.background_threads / 2, dbname, comparator);
+    s = load.Run(tables);
+    UnlockFile(lock);
+    return s;
+  }
+
+  // how often the writer has switched to a new MANIFEST while this
+  // follower had the DB open, a change means the open DB is out of date
+  uint64_t GetGeneration()
+  {
+    return generation_.Get();
+  }
+
+private:
+  virtual leveldb::Status NewSequentialFile(const std::string& fname, leveldb::SequentialFile** result)
+  {
+    const RadosOverlay::Contents contents = overlay_ ? overlay_->Find(fname) : RadosOverlay::Contents();
+    if (contents)
+    {
+      *result = new RadosOverlaySequentialFile(overlay_, contents);
+      return leveldb::Status::OK();
+    }
+
+    // after a crash the local log may hold commits that never made it to
+    // RADOS, but if it is missing or isn't ahead of the RADOS copy that
+    // has to do
+    if (UseLocalLog(fname) && LocalLogIsAhead(fname))
+    {
+      return target()->NewSequentialFile(LocalLogName(fname), result);
+    }
+
+    *result = new RadosSequentialFile(ContextFor(fname), fname, stats_, options_);
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status NewRandomAccessFile(const std::string& fname, leveldb::RandomAccessFile** result)
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoNewRandomAccessFile(fname, result);
+    stats_->Record(RadosStats::kOpen, start, s.ok(), 0);
+
+    return s;
+  }
+
+  virtual leveldb::Status NewWritableFile(const std::string& fname, leveldb::WritableFile** result)
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoNewWritableFile(fname, result);
+    stats_->Record(RadosStats::kCreate, start, s.ok(), 0);
+
+    return s;
+  }
+
+  virtual bool FileExists(const std::string& fname)
+  {
+    uint64_t size = 0;
+    return GetSize(fname, &size) == 0;
+  }
+
+  virtual leveldb::Status GetChildren(const std::string& dir, std::vector<std::string>* result)
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoGetChildren(dir, result);
+    stats_->Record(RadosStats::kGetChildren, start, s.ok(), 0);
+
+    if (s.ok() && overlay_)
+    {
+      overlay_->Merge(dir, result);
+    }
+
+    return s;
+  }
+
+  virtual leveldb::Status DeleteFile(const std::string& fname)
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoDeleteFile(fname);
+    stats_->Record(RadosStats::kDelete, start, s.ok(), 0);
+
+    return s;
+  }
+
+  virtual leveldb::Status CreateDir(const std::string& dirname)
+  {
+    if (overlay_)
+    {
+      // a follower's DB already exists
+      return leveldb::Status::OK();
+    }
+
+    const boost::shared_ptr<RadosBackend> ctx = NamespaceContext(dirname);
+    uint64_t size = 0;
+    int err = ctx->Stat(kIndexObject, &size);
+    if (err == 0)
+    {
+      return leveldb::Status::OK();
+    }
+    else if (err != -ENOENT)
+    {
+      return IOError("CreateDir/stat: " + dirname, -err);
+    }
+
+    // a new directory gets an empty index. one that already has files was
+    // written before directories had an index, its files are indexed now
+    // since nothing else looks for them
+    std::map<std::string, librados::bufferlist> entries;
+    leveldb::Status s = IndexExisting(dirname, *ctx, &entries);
+    if (!s.ok())
+    {
+      return s;
+    }
+
+    RadosWriteOp op;
+    op.Create(true);
+    if (!entries.empty())
+    {
+      op.OmapSet(entries);
+    }
+
+    err = ctx->Operate(kIndexObject, op);
+    if (err < 0 && err != -EEXIST)
+    {
+      return IOError("CreateDir: " + dirname, -err);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status DeleteDir(const std::string& dirname)
+  {
+    if (overlay_)
+    {
+      return leveldb::Status::OK();
+    }
+
+    int err = NamespaceContext(dirname)->Remove(kIndexObject);
+    if (err < 0 && err != -ENOENT)
+    {
+      return IOError("DeleteDir: " + dirname, -err);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status GetFileSize(const std::string& fname, uint64_t* file_size)
+  {
+    int err = GetSize(fname, file_size);
+    if (err < 0)
+    {
+      return IOError("GetFileSize/stat: " + fname, -err);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status RenameFile(const std::string& src, const std::string& target)
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    leveldb::Status s = DoRenameFile(src, target);
+    stats_->Record(RadosStats::kRename, start, s.ok(), 0);
+
+    if (s.ok() && !overlay_ && ObjectName(target) == kCurrentFile)
+    {
+      // followers watch CURRENT to learn there is a new MANIFEST, it only
+      // changes when the MANIFEST grows too big or the DB is opened
+      NotifyCurrent(target);
+    }
+
+    return s;
+  }
+
+  virtual leveldb::Status LockFile(const std::string& fname, leveldb::FileLock** lock)
+  {
+    std::auto_ptr<leveldb::FileLock> file_lock;
+    if (options_.snapshot != 0)
+    {
+      // nothing changes under a checkpoint
+      *lock = new leveldb::FileLock();
+      return leveldb::Status::OK();
+    }
+    else if (options_.lock_mode == kLockNone)
+    {
+      file_lock.reset(new leveldb::FileLock());
+    }
+    else
+    {
+      // a follower is always a reader. the writer's files check the lease
+      // before every write they send
+      const bool exclusive = options_.lock_mode == kLockExclusive && !overlay_;
+      const boost::shared_ptr<RadosLease> lease(new RadosLease);
+      std::auto_ptr<RadosFileLock> rados_lock(new RadosFileLock(ContextFor(fname), fname, exclusive, options_.lock_lease, lease));
+      int err = rados_lock->Lock();
+      if (err < 0)
+      {
+        return IOError("LockFile: " + fname, -err);
+      }
+
+      if (exclusive)
+      {
+        boost::mutex::scoped_lock guard(mutex_);
+        leases_[ParentDir(fname)] = lease;
+      }
+
+      file_lock.reset(rados_lock.release());
+    }
+
+    if (overlay_)
+    {
+      // one DB per follower env, the lock is taken once per open
+      const std::string current = (path(ParentDir(fname)) / kCurrentFile).string();
+      watch_ctx_ = ContextFor(current);
+      int err = watch_ctx_->Watch(kCurrentFile, &generation_, &watch_handle_);
+      if (err < 0)
+      {
+        UnlockFile(file_lock.release());
+        return IOError("LockFile/watch: " + current, -err);
+      }
+    }
+
+    *lock = file_lock.release();
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status UnlockFile(leveldb::FileLock* lock)
+  {
+    if (overlay_)
+    {
+      // the DB is being closed, whatever it wrote goes with it
+      if (watch_ctx_)
+      {
+        watch_ctx_->Unwatch(kCurrentFile, watch_handle_);
+        watch_ctx_.reset();
+      }
+
+      overlay_->Clear();
+    }
+
+    RadosFileLock* file_lock = dynamic_cast<RadosFileLock*>(lock);
+    int err = file_lock != NULL ? file_lock->Unlock() : 0;
+    if (file_lock != NULL)
+    {
+      boost::mutex::scoped_lock guard(mutex_);
+      leases_.erase(ParentDir(file_lock->FileName()));
+    }
+
+    delete lock;
+
+    if (err < 0 && err != -ENOENT)
+    {
+      return IOError("UnlockFile", -err);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status GetTestDirectory(std::string* path)
+  {
+    *path = "tmp/";
+
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status NewLogger(const std::string& fname, leveldb::Logger** result)
+  {
+    if (options_.info_log_size == 0)
+    {
+      return target()->NewLogger(fname, result);
+    }
+
+    leveldb::WritableFile* file = NULL;
+    leveldb::Status s = NewWritableFile(fname, &file);
+    if (!s.ok())
+    {
+      *result = NULL;
+      return s;
+    }
+
+    *result = new RadosLogger(this, fname, file, options_.info_log_size);
+    return leveldb::Status::OK();
+  }
+
+  virtual void Schedule(void (*function)(void*), void* arg)
+  {
+    threads_->Schedule(RadosThreadPool::kPriorityHigh, function, arg);
+  }
+
+  leveldb::Status DoNewRandomAccessFile(const std::string& fname, leveldb::RandomAccessFile** result)
+  {
+    const RadosOverlay::Contents contents = overlay_ ? overlay_->Find(fname) : RadosOverlay::Contents();
+    if (contents)
+    {
+      *result = new RadosOverlayRandomAccessFile(overlay_, contents);
+      return leveldb::Status::OK();
+    }
+
+    const boost::shared_ptr<RadosBackend> ctx = ContextFor(fname);
+
+    RadosFileTable::Entry entry;
+    if (MaybeStriped(fname) && !(files_->Lookup(fname, &entry) && entry.has_layout))
+    {
+      int err = StatFile(*ctx, ObjectName(fname), &entry.size, &entry.layout);
+      if (err < 0)
+      {
+        return IOError("NewRandomAccessFile: " + fname, -err);
+      }
+
+      entry.has_layout = true;
+      files_->Insert(fname, entry);
+    }
+
+    const RadosLayout layout = entry.has_layout ? entry.layout : RadosLayout();
+    const uint64_t size = entry.size;
+
+    // only table files are immutable once written, anything else bypasses the cache
+    const boost::shared_ptr<RadosBlockCache> cache = GetFileType(fname) == kTableFile ? block_cache_ : boost::shared_ptr<RadosBlockCache>();
+
+    // a table without a local copy is read from the OSDs until the copy is made
+    boost::shared_ptr<leveldb::RandomAccessFile> local;
+    if (local_cache_ && GetFileType(fname) == kTableFile)
+    {
+      local = local_cache_->Open(fname, size);
+      if (!local)
+      {
+        local_cache_->Fill(ctx, fname, layout);
+      }
+    }
+
+    *result = new RadosRandomAccessFile(ctx, fname, layout, size, cache, local, stats_, scan_budget_, options_);
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status DoNewWritableFile(const std::string& fname, leveldb::WritableFile** result)
+  {
+    if (overlay_)
+    {
+      *result = new RadosOverlayWritableFile(overlay_, fname, overlay_->Create(fname));
+      return leveldb::Status::OK();
+    }
+
+    WaitForDelete(fname);
+
+    // the object is created by the file's first write, opening it costs
+    // no round trip
+    const boost::shared_ptr<RadosBackend> ctx = ContextFor(fname);
+    const RadosLayout layout = MaybeStriped(fname) ? options_.table_layout() : RadosLayout();
+
+    RadosFileTable::Entry entry;
+    entry.has_layout = true;
+    entry.layout = layout;
+    files_->Insert(fname, entry);
+
+    *result = new RadosWritableFile(ctx, fname, layout, files_, buffers_, stats_, LeaseFor(fname), options_);
+
+    if (UseLocalLog(fname))
+    {
+      leveldb::WritableFile* local = NULL;
+      leveldb::Status s = target()->NewWritableFile(LocalLogName(fname), &local);
+      if (!s.ok())
+      {
+        delete *result;
+        *result = NULL;
+        return s;
+      }
+
+      *result = new RadosHybridLogFile(local, *result);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status DoGetChildren(const std::string& dir, std::vector<std::string>* result)
+  {
+    result->clear();
+
+    const boost::shared_ptr<RadosBackend> ctx = NamespaceContext(dir);
+    std::string start_after;
+    for (;;)
+    {
+      std::map<std::string, librados::bufferlist> entries;
+      int err = ctx->OmapGetVals(kIndexObject, start_after, kIndexBatchSize, &entries);
+      if (err == -ENOENT)
+      {
+        // created before directories had an index and not opened for
+        // writing since, CreateDir indexes it
+        return ListChildren(dir, *ctx, result);
+      }
+      else if (err < 0)
+      {
+        return IOError("GetChildren/omap_get_vals: " + dir, -err);
+      }
+
+      for (std::map<std::string, librados::bufferlist>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+      {
+        const std::string fname = (path(dir) / it->first).string();
+        if (deletes_->IsPending(fname))
+        {
+          continue;
+        }
+
+        result->push_back(it->first);
+
+        // the index holds the final size of every table that was closed,
+        // which saves a stat for each of them when the DB is opened
+        const uint64_t size = DecodeSize(it->second);
+        RadosFileTable::Entry entry;
+        if (GetFileType(fname) == kTableFile && size > 0 && !files_->Lookup(fname, &entry))
+        {
+          files_->InsertSize(fname, size);
+        }
+      }
+
+      if (entries.size() < kIndexBatchSize)
+      {
+        return leveldb::Status::OK();
+      }
+
+      start_after = entries.rbegin()->first;
+    }
+  }
+
+  leveldb::Status DoDeleteFile(const std::string& fname)
+  {
+    if (overlay_)
+    {
+      overlay_->Delete(fname);
+      return leveldb::Status::OK();
+    }
+    else if (!LeaseHeld(fname))
+    {
+      return IOError("DeleteFile/lock lost: " + fname, ENOLCK);
+    }
+
+    // only a table that is known not to be striped can go with one remove
+    RadosFileTable::Entry entry;
+    const bool striped = MaybeStriped(fname) && !(files_->Lookup(fname, &entry) && entry.has_layout && !entry.layout.striped());
+
+    InvalidateCache(fname);
+    files_->Erase(fname);
+
+    if (UseLocalLog(fname))
+    {
+      target()->DeleteFile(LocalLogName(fname));
+    }
+
+    // LevelDB deletes with its mutex held, the objects are removed and
+    // dropped from the index in the background
+    deletes_->Enqueue(ContextFor(fname), fname, striped);
+
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status DoRenameFile(const std::string& src, const std::string& target)
+  {
+    if (overlay_)
+    {
+      return RenameInOverlay(src, target);
+    }
+    else if (!LeaseHeld(target))
+    {
+      return IOError("RenameFile/lock lost: " + target, ENOLCK);
+    }
+
+    WaitForDelete(target);
+
+    InvalidateCache(src);
+    InvalidateCache(target);
+
+    // forget both until the rename is done, a failure part way through is
+    // then answered by stat
+    files_->Erase(src);
+    files_->Erase(target);
+
+    const boost::shared_ptr<RadosBackend> src_ctx = ContextFor(src);
+    const boost::shared_ptr<RadosBackend> target_ctx = ContextFor(target);
+
+    if (MaybeStriped(src))
+    {
+      // LevelDB only renames tables when RepairDB moves them out of the way
+      uint64_t size = 0;
+      RadosLayout layout;
+      int err = StatFile(*src_ctx, ObjectName(src), &size, &layout);
+      if (err < 0)
+      {
+        return IOError("RenameFile/stat: " + src, -err);
+      }
+
+      if (layout.striped())
+      {
+        err = RenameStriped(*src_ctx, ObjectName(src), *target_ctx, ObjectName(target), layout.ObjectCount(size));
+        if (err < 0)
+        {
+          return IOError("RenameFile: " + src, -err);
+        }
+
+        RadosFileTable::Entry entry;
+        entry.size = size;
+        entry.has_layout = true;
+        entry.layout = layout;
+        files_->Rename(src, target, entry);
+
+        return RenameIndexEntry(src, target, size);
+      }
+    }
+
+    // have the OSD copy the object, fetching its size for the index in parallel
+    uint64_t size = 0;
+    RadosCompletion* stat = src_ctx->NewCompletion();
+    int err = src_ctx->AioStat(ObjectName(src), stat, &size);
+    if (err < 0)
+    {
+      delete stat;
+      return IOError("RenameFile/stat: " + src, -err);
+    }
+
+    // version 0 copies whatever version of the source is current
+    RadosWriteOp copy;
+    copy.CopyFrom(ObjectName(src), *src_ctx, 0);
+    err = target_ctx->Operate(ObjectName(target), copy);
+
+    stat->WaitForComplete();
+    const int stat_err = stat->ReturnValue();
+    delete stat;
+    if (stat_err < 0)
+    {
+      return IOError("RenameFile/stat: " + src, -stat_err);
+    }
+
+    if (err == -EOPNOTSUPP)
+    {
+      // OSDs that predate copy_from
+      err = CopyThroughClient(*src_ctx, ObjectName(src), *target_ctx, ObjectName(target), size);
+    }
+
+    if (err < 0)
+    {
+      return IOError("RenameFile/copy_from: " + target, -err);
+    }
+
+    // the copy is a single unstriped object, whatever src was written as
+    RadosFileTable::Entry entry;
+    entry.size = size;
+    entry.has_layout = true;
+    files_->Rename(src, target, entry);
+
+    // the target is complete, so dropping the source and moving its index
+    // entry can go out together
+    RadosCompletion* remove = src_ctx->NewCompletion();
+    err = src_ctx->AioRemove(ObjectName(src), remove);
+    if (err < 0)
+    {
+      delete remove;
+      return IOError("RenameFile/remove: " + src, -err);
+    }
+
+    leveldb::Status s = RenameIndexEntry(src, target, size);
+
+    remove->WaitForComplete();
+    err = remove->ReturnValue();
+    delete remove;
+    if (err < 0)
+    {
+      return IOError("RenameFile/remove: " + src, -err);
+    }
+
+    return s;
+  }
+
+  // the context for the namespace of the directory fname is in
+  boost::shared_ptr<RadosBackend> ContextFor(const std::string& fname)
+  {
+    return NamespaceContext(ParentDir(fname));
+  }
+
+  boost::shared_ptr<RadosBackend> NamespaceContext(const std::string& dir)
+  {
+    const std::string ns = Namespace(dir);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    boost::shared_ptr<RadosBackend>& ctx = namespaces_[ns];
+    if (!ctx)
+    {
+      ctx = pool_->ForNamespace(ns);
+      if (!overlay_)
+      {
+        LoadCheckpoints(ns, *ctx);
+      }
+    }
+
+    return ctx;
+  }
+
+  // keys sort by id, newest last
+  static std::string CheckpointKey(uint64_t snap)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%020llu", static_cast<unsigned long long>(snap));
+    return buf;
+  }
+
+  // every write to a namespace with checkpoints has to preserve them,
+  // from the first one on
+  void LoadCheckpoints(const std::string& ns, RadosBackend& ctx)
+  {
+    std::vector<uint64_t> snaps;
+    std::string start_after;
+    for (;;)
+    {
+      std::map<std::string, librados::bufferlist> entries;
+      int err = ctx.OmapGetVals(kCheckpointObject, start_after, kIndexBatchSize, &entries);
+      if (err < 0)
+      {
+        // -ENOENT is a DB without checkpoints
+        break;
+      }
+
+      for (std::map<std::string, librados::bufferlist>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+      {
+        snaps.insert(snaps.begin(), strtoull(it->first.c_str(), NULL, 10));
+      }
+
+      if (entries.size() < kIndexBatchSize)
+      {
+        break;
+      }
+
+      start_after = entries.rbegin()->first;
+    }
+
+    if (!snaps.empty())
+    {
+      ctx.SetWriteSnaps(snaps);
+
+      boost::mutex::scoped_lock lock(checkpoint_mutex_);
+      checkpoints_[ns] = snaps;
+    }
+  }
+
+  // a follower renaming one of the shared files, such as LOG when it
+  // starts its own, renames a private copy of it
+  leveldb::Status RenameInOverlay(const std::string& src, const std::string& target)
+  {
+    if (!overlay_->Find(src))
+    {
+      RadosSequentialFile file(ContextFor(src), src, stats_, options_);
+      std::vector<char> scratch(kOverlayCopyChunk);
+      std::string data;
+      for (;;)
+      {
+        leveldb::Slice chunk;
+        leveldb::Status s = static_cast<leveldb::SequentialFile&>(file).Read(scratch.size(), &chunk, &scratch[0]);
+        if (!s.ok())
+        {
+          return s;
+        }
+        else if (chunk.empty())
+        {
+          break;
+        }
+
+        data.append(chunk.data(), chunk.size());
+      }
+
+      if (!overlay_->Append(overlay_->Create(src), data))
+      {
+        return IOError("RenameFile: " + src, ENOSPC);
+      }
+    }
+
+    overlay_->Rename(src, target);
+    return leveldb::Status::OK();
+  }
+
+  // a name that is being deleted can't be created again until it is gone.
+  // LevelDB never reuses file numbers, this only happens to fixed names
+  // such as LOG after DestroyDB
+  void WaitForDelete(const std::string& fname)
+  {
+    if (deletes_->IsPending(fname))
+    {
+      deletes_->Drain();
+    }
+  }
+
+  bool UseLocalLog(const std::string& fname) const
+  {
+    return !options_.local_log_dir.empty() && GetFileType(fname) == kLogFile;
+  }
+
+  // named after the pool as well, envs on several pools can share the
+  // directory
+  std::string LocalLogName(const std::string& fname) const
+  {
+    return options_.local_log_dir + "/" + LocalFileName(pool_->Name() + "/" + fname);
+  }
+
+  // the local log is only ahead if all of the RADOS copy is a prefix of it.
+  // one that differs was left by an earlier log of the same name, from a
+  // writer on this host that crashed before another took over elsewhere
+  bool LocalLogIsAhead(const std::string& fname)
+  {
+    uint64_t local_size = 0;
+    uint64_t remote_size = 0;
+    if (!target()->GetFileSize(LocalLogName(fname), &local_size).ok())
+    {
+      return false;
+    }
+
+    const int err = GetSize(fname, &remote_size);
+    if (err == -ENOENT)
+    {
+      return true;
+    }
+    else if (err < 0 || local_size < remote_size)
+    {
+      return false;
+    }
+
+    leveldb::SequentialFile* local = NULL;
+    if (!target()->NewSequentialFile(LocalLogName(fname), &local).ok())
+    {
+      return false;
+    }
+
+    const boost::scoped_ptr<leveldb::SequentialFile> local_file(local);
+    RadosSequentialFile remote_file(ContextFor(fname), fname, stats_, options_);
+    std::vector<char> local_scratch(kLogCompareChunk);
+    std::vector<char> remote_scratch(kLogCompareChunk);
+    for (;;)
+    {
+      leveldb::Slice remote_chunk;
+      if (!static_cast<leveldb::SequentialFile&>(remote_file).Read(remote_scratch.size(), &remote_chunk, &remote_scratch[0]).ok())
+      {
+        return false;
+      }
+      else if (remote_chunk.empty())
+      {
+        return true;
+      }
+
+      leveldb::Slice local_chunk;
+      if (!local_file->Read(remote_chunk.size(), &local_chunk, &local_scratch[0]).ok() || local_chunk != remote_chunk)
+      {
+        return false;
+      }
+    }
+  }
+
+  int GetSize(const std::string& fname, uint64_t* size)
+  {
+    const uint64_t start = RadosStats::NowMicros();
+    const int err = deletes_->IsPending(fname) ? -ENOENT : LookupSize(fname, size);
+    stats_->Record(RadosStats::kStat, start, err == 0 || err == -ENOENT, 0);
+
+    return err;
+  }
+
+  // answer from the file table, or stat and remember the result
+  int LookupSize(const std::string& fname, uint64_t* size)
+  {
+    if (overlay_)
+    {
+      const RadosOverlay::Contents contents = overlay_->Find(fname);
+      if (contents)
+      {
+        *size = overlay_->Size(contents);
+        return 0;
+      }
+      else if (overlay_->IsHidden(fname))
+      {
+        return -ENOENT;
+      }
+    }
+
+    RadosFileTable::Entry entry;
+    if (files_->Lookup(fname, &entry))
+    {
+      *size = entry.size;
+      return 0;
+    }
+
+    int err = 0;
+    if (MaybeStriped(fname))
+    {
+      err = StatFile(*ContextFor(fname), ObjectName(fname), &entry.size, &entry.layout);
+      entry.has_layout = true;
+    }
+    else
+    {
+      err = ContextFor(fname)->Stat(ObjectName(fname), &entry.size);
+    }
+
+    if (err < 0)
+    {
+      return err;
+    }
+
+    files_->Insert(fname, entry);
+    *size = entry.size;
+
+    return 0;
+  }
+
+  // whether fname may have been written with a striped layout, by this env
+  // or by one with other settings. only tables are ever striped, and the
+  // layout a table was written with is read from its first object in the
+  // same op as its stat
+  static bool MaybeStriped(const std::string& fname)
+  {
+    return GetFileType(fname) == kTableFile;
+  }
+
+  // stat the first object of a file along with its xattrs, yields the
+  // logical size and the layout it was written with
+  static int StatFile(RadosBackend& ctx, const std::string& oid, uint64_t* size, RadosLayout* layout)
+  {
+    std::map<std::string, librados::bufferlist> xattrs;
+    int stat_err = 0;
+    int xattrs_err = 0;
+
+    RadosReadOp op;
+    op.Stat(size, &stat_err);
+    op.GetXattrs(&xattrs, &xattrs_err);
+    int err = ctx.Operate(oid, op);
+    if (err < 0)
+    {
+      return err;
+    }
+
+    std::map<std::string, librados::bufferlist>::const_iterator it = xattrs.find(kLayoutXattr);
+    *layout = it != xattrs.end() ? RadosLayout::Decode(it->second) : RadosLayout();
+    if (!layout->striped())
+    {
+      return 0;
+    }
+
+    it = xattrs.find(kSizeXattr);
+    if (it != xattrs.end())
+    {
+      *size = DecodeSize(it->second);
+      return 0;
+    }
+
+    // never synced, but written sequentially so the stripes add up
+    *size = 0;
+    for (uint32_t stripe = 0; stripe < layout->stripe_count; ++stripe)
+    {
+      uint64_t stripe_size = 0;
+      err = ctx.Stat(RadosLayout::ObjectName(oid, stripe), &stripe_size);
+      if (err == -ENOENT)
+      {
+        break;
+      }
+      else if (err < 0)
+      {
+        return err;
+      }
+
+      *size += stripe_size;
+    }
+
+    return 0;
+  }
+
+  // apply op to stripes [first, first + count) of a file in parallel,
+  // missing stripes (-ENOENT) are skipped
+  static int ForEachStripe(RadosBackend& ctx, const std::string& oid, uint32_t first, uint32_t count, RadosWriteOp* (*make_op)(void* arg, uint32_t stripe), void* arg)
+  {
+    std::vector<RadosCompletion*> completions;
+    int err = 0;
+    for (uint32_t stripe = first; stripe < first + count; ++stripe)
+    {
+      std::auto_ptr<RadosWriteOp> op(make_op(arg, stripe));
+      RadosCompletion* c = ctx.NewCompletion();
+      err = ctx.AioOperate(RadosLayout::ObjectName(oid, stripe), c, *op);
+      if (err < 0)
+      {
+        delete c;
+        break;
+      }
+
+      completions.push_back(c);
+    }
+
+    for (size_t i = 0; i < completions.size(); ++i)
+    {
+      completions[i]->WaitForComplete();
+      const int r = completions[i]->ReturnValue();
+      delete completions[i];
+      if (r < 0 && r != -ENOENT && err == 0)
+      {
+        err = r;
+      }
+    }
+
+    return err;
+  }
+
+  static RadosWriteOp* MakeRemoveOp(void* arg, uint32_t stripe)
+  {
+    RadosWriteOp* op = new RadosWriteOp;
+    op->Remove();
+    return op;
+  }
+
+  struct CopySource
+  {
+    const RadosBackend* ctx;
+    const std::string* oid;
+  };
+
+  static RadosWriteOp* MakeCopyOp(void* arg, uint32_t stripe)
+  {
+    const CopySource* src = static_cast<const CopySource*>(arg);
+    RadosWriteOp* op = new RadosWriteOp;
+    op->CopyFrom(RadosLayout::ObjectName(*src->oid, stripe), *src->ctx, 0);
+    return op;
+  }
+
+  // remove every object of a file that may be striped. the first object
+  // goes last, so an interrupted delete can still find the layout
+  static int RemoveStriped(RadosBackend& ctx, const std::string& oid)
+  {
+    uint64_t size = 0;
+    RadosLayout layout;
+    int err = StatFile(ctx, oid, &size, &layout);
+    if (err < 0)
+    {
+      return err;
+    }
+
+    if (layout.striped())
+    {
+      err = ForEachStripe(ctx, oid, 1, layout.stripe_count - 1, MakeRemoveOp, NULL);
+      if (err < 0)
+      {
+        return err;
+      }
+    }
+
+    return ctx.Remove(oid);
+  }
+
+  static int RenameStriped(RadosBackend& src_ctx, const std::string& src, RadosBackend& target_ctx, const std::string& target, uint32_t objects)
+  {
+    CopySource source = { &src_ctx, &src };
+    int err = ForEachStripe(target_ctx, target, 0, objects, MakeCopyOp, &source);
+    if (err < 0)
+    {
+      return err;
+    }
+
+    err = ForEachStripe(src_ctx, src, 1, objects - 1, MakeRemoveOp, NULL);
+    if (err < 0)
+    {
+      return err;
+    }
+
+    return src_ctx.Remove(src);
+  }
+
+  static int CopyThroughClient(RadosBackend& src_ctx, const std::string& src, RadosBackend& target_ctx, const std::string& target, uint64_t size)
+  {
+    librados::bufferlist bl;
+    int err = src_ctx.Read(src, &bl, size, 0);
+    if (err < 0)
+    {
+      return err;
+    }
+
+    return target_ctx.WriteFull(target, bl);
+  }
+
+  // index entries for every file in a directory that has no index yet,
+  // from a listing of its namespace
+  leveldb::Status IndexExisting(const std::string& dir, RadosBackend& ctx, std::map<std::string, librados::bufferlist>* entries)
+  {
+    std::vector<std::string> oids;
+    int err = ctx.ListObjects(&oids);
+    if (err < 0)
+    {
+      return IOError("CreateDir/list: " + dir, -err);
+    }
+
+    for (std::vector<std::string>::const_iterator it = oids.begin(); it != oids.end(); ++it)
+    {
+      if (IsStripeObject(*it) || *it == kCheckpointObject)
+      {
+        continue;
+      }
+
+      uint64_t size = 0;
+      RadosLayout layout;
+      err = StatFile(ctx, *it, &size, &layout);
+      if (err == -ENOENT)
+      {
+        continue;
+      }
+      else if (err < 0)
+      {
+        return IOError("CreateDir/stat: " + (path(dir) / *it).string(), -err);
+      }
+
+      const std::map<std::string, librados::bufferlist> entry = IndexEntry(*it, size);
+      entries->insert(entry.begin(), entry.end());
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  // stripes past the first are named after the file plus .<stripe>, no
+  // LevelDB file name ends in a number
+  static bool IsStripeObject(const std::string& oid)
+  {
+    const std::string ext = path(oid).extension().string();
+    return ext.size() > 1 && ext.find_first_not_of("0123456789", 1) == std::string::npos;
+  }
+
+  // fallback for directories without an index, lists every object in the namespace
+  leveldb::Status ListChildren(const std::string& dir, RadosBackend& ctx, std::vector<std::string>* result)
+  {
+    std::vector<std::string> oids;
+    int err = ctx.ListObjects(&oids);
+    if (err < 0)
+    {
+      return IOError("GetChildren/list", -err);
+    }
+
+    for (size_t i = 0; i < oids.size(); ++i)
+    {
+      if (oids[i] != kIndexObject && oids[i] != kCheckpointObject && !IsStripeObject(oids[i]) && !deletes_->IsPending((path(dir) / oids[i]).string()))
+      {
+        result->push_back(oids[i]);
+      }
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status RenameIndexEntry(const std::string& src, const std::string& target, uint64_t size)
+  {
+    std::set<std::string> keys;
+    keys.insert(ObjectName(src));
+
+    const boost::shared_ptr<RadosBackend> target_ctx = ContextFor(target);
+
+    RadosWriteOp op;
+    if (Namespace(ParentDir(src)) == Namespace(ParentDir(target)))
+    {
+      // both updates in a single op
+      op.OmapRmKeys(keys);
+    }
+    else
+    {
+      int err = ContextFor(src)->OmapRmKeys(kIndexObject, keys);
+      if (err < 0 && err != -ENOENT)
+      {
+        return IOError("RenameFile/omap_rm_keys: " + src, -err);
+      }
+    }
+
+    op.OmapSet(IndexEntry(target, size));
+    int err = target_ctx->Operate(kIndexObject, op);
+    if (err < 0)
+    {
+      return IOError("RenameFile/omap_set: " + target, -err);
+    }
+
+    return leveldb::Status::OK();
+  }
+
+  // a notify waits for every watcher to ack it, so it is sent off a
+  // background thread and the rename doesn't wait on followers. one
+  // pending notify per DB is enough, they all say the same
+  void NotifyCurrent(const std::string& current)
+  {
+    const boost::shared_ptr<RadosBackend> ctx = ContextFor(current);
+
+    boost::mutex::scoped_lock lock(notify_mutex_);
+    if (notifies_.insert(std::make_pair(current, ctx)).second)
+    {
+      threads_->Schedule(RadosThreadPool::kPriorityHigh, &RadosEnv::SendNotifyJob, this);
+    }
+  }
+
+  static void SendNotifyJob(void* arg)
+  {
+    SendNotify(static_cast<RadosEnv*>(arg));
+  }
+
+  // send one pending notify, false if there was none
+  static bool SendNotify(RadosEnv* env)
+  {
+    boost::mutex::scoped_lock lock(env->notify_mutex_);
+    if (env->notifies_.empty())
+    {
+      return false;
+    }
+
+    const boost::shared_ptr<RadosBackend> ctx = env->notifies_.begin()->second;
+    env->notifies_.erase(env->notifies_.begin());
+    lock.unlock();
+
+    ctx->Notify(kCurrentFile);
+    return true;
+  }
+
+  // the writer lease on the DB fname is in, NULL unless this env has it
+  // locked for writing
+  boost::shared_ptr<RadosLease> LeaseFor(const std::string& fname)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<std::string, boost::shared_ptr<RadosLease> >::const_iterator it = leases_.find(ParentDir(fname));
+    return it != leases_.end() ? it->second : boost::shared_ptr<RadosLease>();
+  }
+
+  bool LeaseHeld(const std::string& fname)
+  {
+    const boost::shared_ptr<RadosLease> lease = LeaseFor(fname);
+    return !lease || lease->Held();
+  }
+
+  void InvalidateCache(const std::string& fname)
+  {
+    if (block_cache_)
+    {
+      block_cache_->Invalidate(fname);
+    }
+
+    if (local_cache_)
+    {
+      local_cache_->Erase(fname);
+    }
+  }
+
+private:
+  // entries fetched per omap_get_vals call when listing a directory
+  static const size_t kIndexBatchSize = 1024;
+
+  // a follower copies shared files it renames in reads of this size
+  static const size_t kOverlayCopyChunk = 1 << 20;
+
+  // and a local log is compared with the RADOS copy in reads of this size
+  static const size_t kLogCompareChunk = 1 << 20;
+
+  static const char kCurrentFile[];
+
+  const boost::shared_ptr<RadosBackend> pool_;
+  const RadosEnvOptions options_;
+  const boost::shared_ptr<RadosFileTable> files_;
+  const boost::shared_ptr<RadosBufferPool> buffers_;
+  const boost::shared_ptr<RadosStats> stats_;
+  const boost::shared_ptr<RadosScanBudget> scan_budget_;
+  boost::shared_ptr<RadosBlockCache> block_cache_;
+  boost::shared_ptr<RadosLocalCache> local_cache_;
+
+  boost::scoped_ptr<RadosDeleteQueue> deletes_;
+
+  // only set for a follower, along with the watch on CURRENT while the
+  // DB is open
+  boost::shared_ptr<RadosOverlay> overlay_;
+  RadosGeneration generation_;
+  boost::shared_ptr<RadosBackend> watch_ctx_;
+  uint64_t watch_handle_;
+
+  // notifies on CURRENT not sent yet, by the CURRENT they are for
+  boost::mutex notify_mutex_;
+  std::map<std::string, boost::shared_ptr<RadosBackend> > notifies_;
+
+  // last, its threads are stopped before anything their jobs use goes away
+  boost::scoped_ptr<RadosThreadPool> threads_;
+
+  // one context per namespace, created on first use, and the lease of
+  // every DB this env holds the writer lock on, by directory
+  boost::mutex mutex_;
+  std::map<std::string, boost::shared_ptr<RadosBackend> > namespaces_;
+  std::map<std::string, boost::shared_ptr<RadosLease> > leases_;
+
+  // the checkpoints of every namespace in use, newest first
+  boost::mutex checkpoint_mutex_;
+  std::map<std::string, std::vector<uint64_t> > checkpoints_;
+};
+
+const char RadosEnv::kCurrentFile[] = "CURRENT";
+
+// sadly this is internal to LevelDB
+struct leveldb_env_t
+{
+  leveldb::Env* rep;
+  bool is_default;
+};
+
+struct leveldb_t
+{
+  leveldb::DB* rep;
+};
+
+struct leveldb_readoptions_t
+{
+  leveldb::ReadOptions rep;
+};
+
+struct leveldb_rados_options_t
+{
+  RadosEnvOptions rep;
+};
+
+// Gets issued by a MultiGet call are spread over this many threads, so the
+// block reads of every key go out together instead of one after another
+static const size_t kMultiGetThreads = 16;
+
+// A MultiGet call shared by the caller and its helpers. It lives on the
+// heap until the last of them lets go, a helper that only gets to run
+// after the caller returned finds every key taken and just lets go
+struct RadosMultiGet
+{
+  leveldb::DB* db;
+  const leveldb::ReadOptions* options;
+  size_t count;
+  const char* const* keys;
+  const size_t* keylens;
+  char** values;
+  size_t* vallens;
+
+  boost::mutex mutex;
+  boost::condition_variable cond;
+  size_t next;
+  // keys whose Get is done, the caller waits for all of them
+  size_t done;
+  // the caller and the helpers scheduled on the pool that haven't returned yet
+  size_t refs;
+  std::string error;
+};
+
+// the threads that help callers of leveldb_rados_multi_get, shared by every
+// call and started by the first one
+static boost::mutex multi_get_mutex;
+static boost::scoped_ptr<RadosThreadPool> multi_get_pool;
+
+static RadosThreadPool* MultiGetPool()
+{
+  boost::mutex::scoped_lock lock(multi_get_mutex);
+  if (!multi_get_pool)
+  {
+    multi_get_pool.reset(new RadosThreadPool(kMultiGetThreads - 1));
+  }
+
+  return multi_get_pool.get();
+}
+
+static void MultiGetWorker(RadosMultiGet* batch);
+
+static void MultiGetRelease(RadosMultiGet* batch)
+{
+  bool last;
+  {
+    boost::mutex::scoped_lock lock(batch->mutex);
+    last = --batch->refs == 0;
+  }
+
+  if (last)
+  {
+    delete batch;
+  }
+}
+
+static void MultiGetHelper(void* arg)
+{
+  RadosMultiGet* batch = static_cast<RadosMultiGet*>(arg);
+  MultiGetWorker(batch);
+  MultiGetRelease(batch);
+}
+
+static void MultiGetWorker(RadosMultiGet* batch)
+{
+  for (;;)
+  {
+    size_t i;
+    {
+      boost::mutex::scoped_lock lock(batch->mutex);
+      if (batch->next >= batch->count)
+      {
+        return;
+      }
+
+      i = batch->next++;
+    }
+
+    batch->values[i] = NULL;
+    batch->vallens[i] = 0;
+
+    std::string value;
+    leveldb::Status s = batch->db->Get(*batch->options, leveldb::Slice(batch->keys[i], batch->keylens[i]), &value);
+    if (s.ok())
+    {
+      // never hand back NULL for an empty value, that means not found
+      batch->values[i] = static_cast<char*>(malloc(std::max(value.size(), static_cast<size_t>(1))));
+      memcpy(batch->values[i], value.data(), value.size());
+      batch->vallens[i] = value.size();
+    }
+
+    boost::mutex::scoped_lock lock(batch->mutex);
+    if (!s.ok() && !s.IsNotFound() && batch->error.empty())
+    {
+      batch->error = s.ToString();
+    }
+
+    if (++batch->done == batch->count)
+    {
+      batch->cond.notify_all();
+    }
+  }
+}
+
+leveldb_rados_options_t* leveldb_rados_options_create()
+{
+  return new leveldb_rados_options_t;
+}
+
+void leveldb_rados_options_destroy(leveldb_rados_options_t* options)
+{
+  delete options;
+}
+
+void leveldb_rados_options_set_readahead_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.readahead_size = size;
+}
+
+void leveldb_rados_options_set_block_cache_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.block_cache_size = size;
+}
+
+void leveldb_rados_options_set_block_cache_page_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.block_cache_page_size = size;
+}
+
+void leveldb_rados_options_set_block_cache_pinned_pages(leveldb_rados_options_t* options, size_t pages)
+{
+  options->rep.block_cache_pinned_pages = pages;
+}
+
+void leveldb_rados_options_set_table_write_buffer_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.table_write_buffer_size = size;
+}
+
+void leveldb_rados_options_set_log_write_buffer_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.log_write_buffer_size = size;
+}
+
+void leveldb_rados_options_set_max_inflight_ops(leveldb_rados_options_t* options, size_t ops)
+{
+  options->rep.max_inflight_ops = ops;
+}
+
+void leveldb_rados_options_set_max_inflight_bytes(leveldb_rados_options_t* options, size_t bytes)
+{
+  options->rep.max_inflight_bytes = bytes;
+}
+
+void leveldb_rados_options_set_stripe_unit(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.stripe_unit = size;
+}
+
+void leveldb_rados_options_set_stripe_count(leveldb_rados_options_t* options, size_t count)
+{
+  options->rep.stripe_count = count;
+}
+
+void leveldb_rados_options_set_table_tail_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.table_tail_size = size;
+}
+
+void leveldb_rados_options_set_scan_readahead_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.scan_readahead_size = size;
+}
+
+void leveldb_rados_options_set_scan_readahead_memory(leveldb_rados_options_t* options, size_t bytes)
+{
+  options->rep.scan_readahead_memory = bytes;
+}
+
+void leveldb_rados_options_set_local_cache_dir(leveldb_rados_options_t* options, const char* dir)
+{
+  options->rep.local_cache_dir = dir;
+}
+
+void leveldb_rados_options_set_local_cache_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.local_cache_size = size;
+}
+
+void leveldb_rados_options_set_local_log_dir(leveldb_rados_options_t* options, const char* dir)
+{
+  options->rep.local_log_dir = dir;
+}
+
+void leveldb_rados_options_set_background_threads(leveldb_rados_options_t* options, size_t threads)
+{
+  options->rep.background_threads = threads;
+}
+
+void leveldb_rados_options_set_lock_mode(leveldb_rados_options_t* options, int mode)
+{
+  options->rep.lock_mode = static_cast<RadosLockMode>(mode);
+}
+
+void leveldb_rados_options_set_lock_lease(leveldb_rados_options_t* options, size_t seconds)
+{
+  options->rep.lock_lease = static_cast<uint32_t>(seconds);
+}
+
+void leveldb_rados_options_set_info_log_size(leveldb_rados_options_t* options, size_t size)
+{
+  options->rep.info_log_size = size;
+}
+
+void leveldb_rados_options_set_follower(leveldb_rados_options_t* options, unsigned char follower)
+{
+  options->rep.follower = follower != 0;
+}
+
+void leveldb_rados_options_set_follower_memory(leveldb_rados_options_t* options, size_t bytes)
+{
+  options->rep.follower_memory = bytes;
+}
+
+void leveldb_rados_options_set_client_id(leveldb_rados_options_t* options, const char* id)
+{
+  options->rep.client_id = id;
+}
+
+// a level the env doesn't know is taken as the safest
+static RadosDurability ToDurability(int durability)
+{
+  switch (durability)
+  {
+    case leveldb_rados_durability_none:
+      return kDurabilityNone;
+    case leveldb_rados_durability_complete:
+      return kDurabilityComplete;
+    default:
+      return kDurabilitySafe;
+  }
+}
+
+void leveldb_rados_options_set_log_durability(leveldb_rados_options_t* options, int durability)
+{
+  options->rep.log_durability = ToDurability(durability);
+}
+
+void leveldb_rados_options_set_table_durability(leveldb_rados_options_t* options, int durability)
+{
+  options->rep.table_durability = ToDurability(durability);
+}
+
+void leveldb_rados_options_set_descriptor_durability(leveldb_rados_options_t* options, int durability)
+{
+  options->rep.descriptor_durability = ToDurability(durability);
+}
+
+leveldb_env_t* leveldb_create_rados_env(const char* config_file, const char* pool_name)
+{
+  leveldb_rados_options_t options;
+  return leveldb_create_rados_env_with_options(config_file, pool_name, &options);
+}
+
+// Connected cluster handles by config file and client id. Connecting
+// takes a round of monitor auth and map fetches and starts a full set of
+// messenger threads, so every env on the same cluster shares one handle.
+// Handles aren't kept alive by the registry, the last env to go shuts its
+// handle down and the next one connects again
+typedef std::pair<std::string, std::string> RadosClusterKey;
+static boost::mutex cluster_mutex;
+static std::map<RadosClusterKey, boost::weak_ptr<librados::Rados> > clusters;
+
+// a NULL config file is librados' search of the default config paths
+static boost::shared_ptr<librados::Rados> ConnectCluster(const char* config_file, const std::string& client_id)
+{
+  // held while connecting, so racing envs don't both connect
+  boost::mutex::scoped_lock lock(cluster_mutex);
+  boost::weak_ptr<librados::Rados>& cached = clusters[RadosClusterKey(config_file ? config_file : "", client_id)];
+  boost::shared_ptr<librados::Rados> rados = cached.lock();
+  if (rados)
+  {
+    return rados;
+  }
+
+  int err;
+  rados.reset(new librados::Rados());
+  err = rados->init(client_id.empty() ? NULL : client_id.c_str());
+  if (err < 0)
+  {
+    cerr << "Rados::init() failed: " << strerror(-err);
+    return boost::shared_ptr<librados::Rados>();
+  }
+
+  err = rados->conf_read_file(config_file);
+  if (err < 0)
+  {
+    cerr << "Rados::conf_read_file() failed: " << strerror(-err);
+    return boost::shared_ptr<librados::Rados>();
   }
 
   err = rados->connect();
   if (err < 0)
   {
     cerr << "Rados::connect() failed: " << strerror(-err);
+    return boost::shared_ptr<librados::Rados>();
+  }
+
+  cached = rados;
+  return rados;
+}
+
+leveldb_env_t* leveldb_create_rados_env_with_options(const char* config_file, const char* pool_name, const leveldb_rados_options_t* options)
+{
+  int err;
+  const boost::shared_ptr<librados::Rados> rados = ConnectCluster(config_file, options->rep.client_id);
+  if (!rados)
+  {
     return NULL;
   }
 
   librados::IoCtx c;
-  err = rados->ioctx_create("leveldb", c);
+  err = rados->ioctx_create(pool_name, c);
   if (err < 0)
   {
     cerr << "Rados::ioctx_create() failed: " << strerror(-err);
     return NULL;
   }
 
-  boost::shared_ptr<librados::IoCtx> ioctx(boost::make_shared<librados::IoCtx>(c));
+  leveldb_env_t* result = new leveldb_env_t;
+  result->rep = new RadosEnv(NewLibradosBackend(rados, c), options->rep);
+  result->is_default = false;
+  return result;
+}
+
+leveldb_env_t* leveldb_create_rados_snapshot_env(const char* config_file, const char* pool_name, uint64_t snap, const leveldb_rados_options_t* options)
+{
+  leveldb_rados_options_t snapshot_options = *options;
+  snapshot_options.rep.snapshot = snap;
+  return leveldb_create_rados_env_with_options(config_file, pool_name, &snapshot_options);
+}
 
-  RadosEnv env(rados, ioctx);
+leveldb_env_t* leveldb_create_rados_sim_env(size_t latency, size_t jitter, size_t bandwidth, const leveldb_rados_options_t* options)
+{
+  RadosSimOptions sim;
+  sim.latency = latency;
+  sim.jitter = jitter;
+  sim.bandwidth = bandwidth;
 
   leveldb_env_t* result = new leveldb_env_t;
-  result->rep = new RadosEnv(rados, ioctx);
+  result->rep = new RadosEnv(NewSimulatedBackend(sim), options->rep);
   result->is_default = false;
   return result;
 }
+
+void leveldb_rados_multi_get(leveldb_t* db, const leveldb_readoptions_t* options, size_t count, const char* const* keys, const size_t* keylens, char** values, size_t* vallens, char** errptr)
+{
+  const size_t helpers = std::min(count, kMultiGetThreads) - (count > 0 ? 1 : 0);
+
+  RadosMultiGet* batch = new RadosMultiGet;
+  batch->db = db->rep;
+  batch->options = &options->rep;
+  batch->count = count;
+  batch->keys = keys;
+  batch->keylens = keylens;
+  batch->values = values;
+  batch->vallens = vallens;
+  batch->next = 0;
+  batch->done = 0;
+  batch->refs = helpers + 1;
+
+  // the calling thread takes a share of the keys too. helpers that only
+  // get to run once every key is taken return right away
+  RadosThreadPool* pool = helpers > 0 ? MultiGetPool() : NULL;
+  for (size_t i = 0; i < helpers; ++i)
+  {
+    pool->Schedule(RadosThreadPool::kPriorityHigh, MultiGetHelper, batch);
+  }
+
+  MultiGetWorker(batch);
+
+  std::string error;
+  {
+    boost::mutex::scoped_lock lock(batch->mutex);
+    while (batch->done < batch->count)
+    {
+      batch->cond.wait(lock);
+    }
+
+    error.swap(batch->error);
+  }
+
+  MultiGetRelease(batch);
+
+  if (!error.empty())
+  {
+    for (size_t i = 0; i < count; ++i)
+    {
+      free(values[i]);
+      values[i] = NULL;
+      vallens[i] = 0;
+    }
+
+    // same convention as the rest of the LevelDB C API
+    free(*errptr);
+    *errptr = strdup(error.c_str());
+  }
+}
+
+char* leveldb_rados_env_get_stats(leveldb_env_t* env)
+{
+  RadosEnv* rados_env = dynamic_cast<RadosEnv*>(env->rep);
+  if (rados_env == NULL)
+  {
+    return NULL;
+  }
+
+  return strdup(rados_env->GetStats().c_str());
+}
+
+uint64_t leveldb_rados_env_create_checkpoint(leveldb_env_t* env, const char* dbname, char** errptr)
+{
+  RadosEnv* rados_env = dynamic_cast<RadosEnv*>(env->rep);
+  leveldb::Status s = leveldb::Status::NotSupported("not a RADOS env");
+  uint64_t snap = 0;
+  if (rados_env != NULL)
+  {
+    s = rados_env->CreateCheckpoint(dbname, &snap);
+  }
+
+  if (!s.ok())
+  {
+    free(*errptr);
+    *errptr = strdup(s.ToString().c_str());
+    return 0;
+  }
+
+  return snap;
+}
+
+void leveldb_rados_env_remove_checkpoint(leveldb_env_t* env, const char* dbname, uint64_t snap, char** errptr)
+{
+  RadosEnv* rados_env = dynamic_cast<RadosEnv*>(env->rep);
+  leveldb::Status s = leveldb::Status::NotSupported("not a RADOS env");
+  if (rados_env != NULL)
+  {
+    s = rados_env->RemoveCheckpoint(dbname, snap);
+  }
+
+  if (!s.ok())
+  {
+    free(*errptr);
+    *errptr = strdup(s.ToString().c_str());
+  }
+}
+
+void leveldb_rados_env_bulk_load(leveldb_env_t* env, const char* dbname, size_t count, const char* const* tables, char** errptr)
+{
+  RadosEnv* rados_env = dynamic_cast<RadosEnv*>(env->rep);
+  leveldb::Status s = leveldb::Status::NotSupported("not a RADOS env");
+  if (rados_env != NULL)
+  {
+    s = rados_env->BulkLoad(dbname, std::vector<std::string>(tables, tables + count), leveldb::BytewiseComparator());
+  }
+
+  if (!s.ok())
+  {
+    free(*errptr);
+    *errptr = strdup(s.ToString().c_str());
+  }
+}
+
+uint64_t leveldb_rados_env_get_generation(leveldb_env_t* env)
+{
+  RadosEnv* rados_env = dynamic_cast<RadosEnv*>(env->rep);
+  if (rados_env == NULL)
+  {
+    return 0;
+  }
+
+  return rados_env->GetGeneration();
+}
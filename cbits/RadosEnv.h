@@ -2,5 +2,114 @@
 
 extern "C"
 {
+typedef struct leveldb_rados_options_t leveldb_rados_options_t;
+
+extern leveldb_rados_options_t* leveldb_rados_options_create();
+extern void leveldb_rados_options_destroy(leveldb_rados_options_t* options);
+extern void leveldb_rados_options_set_readahead_size(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_block_cache_size(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_block_cache_page_size(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_block_cache_pinned_pages(leveldb_rados_options_t* options, size_t pages);
+extern void leveldb_rados_options_set_table_write_buffer_size(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_log_write_buffer_size(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_max_inflight_ops(leveldb_rados_options_t* options, size_t ops);
+extern void leveldb_rados_options_set_max_inflight_bytes(leveldb_rados_options_t* options, size_t bytes);
+extern void leveldb_rados_options_set_stripe_unit(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_stripe_count(leveldb_rados_options_t* options, size_t count);
+extern void leveldb_rados_options_set_table_tail_size(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_scan_readahead_size(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_scan_readahead_memory(leveldb_rados_options_t* options, size_t bytes);
+extern void leveldb_rados_options_set_local_cache_dir(leveldb_rados_options_t* options, const char* dir);
+extern void leveldb_rados_options_set_local_cache_size(leveldb_rados_options_t* options, size_t size);
+extern void leveldb_rados_options_set_local_log_dir(leveldb_rados_options_t* options, const char* dir);
+extern void leveldb_rados_options_set_background_threads(leveldb_rados_options_t* options, size_t threads);
+extern void leveldb_rados_options_set_client_id(leveldb_rados_options_t* options, const char* id);
+
+/* The info LOG is kept in the pool and rotated to LOG.old past this many
+   bytes, 0 writes it to local disk instead */
+extern void leveldb_rados_options_set_info_log_size(leveldb_rados_options_t* options, size_t size);
+
+/* How LockFile locks the DB: as the one writer, as one of any number of
+   read-only instances next to it, or not at all. Shared implies follower.
+   Locks are leases renewed by the env, a dead instance's lock is free once
+   its lease runs out */
+enum
+{
+  leveldb_rados_lock_exclusive = 0,
+  leveldb_rados_lock_shared = 1,
+  leveldb_rados_lock_none = 2
+};
+
+extern void leveldb_rados_options_set_lock_mode(leveldb_rados_options_t* options, int mode);
+extern void leveldb_rados_options_set_lock_lease(leveldb_rados_options_t* options, size_t seconds);
+
+/* What Sync waits for, set separately for logs, tables and the other files
+   (MANIFEST, CURRENT, ...). Close waits for complete whatever the level, and
+   any other value is taken as safe */
+enum
+{
+  leveldb_rados_durability_none = 0,
+  leveldb_rados_durability_complete = 1,
+  leveldb_rados_durability_safe = 2
+};
+
+extern void leveldb_rados_options_set_log_durability(leveldb_rados_options_t* options, int durability);
+extern void leveldb_rados_options_set_table_durability(leveldb_rados_options_t* options, int durability);
+extern void leveldb_rados_options_set_descriptor_durability(leveldb_rados_options_t* options, int durability);
+
 extern leveldb_env_t* leveldb_create_rados_env(const char* config_file, const char* pool_name);
+extern leveldb_env_t* leveldb_create_rados_env_with_options(const char* config_file, const char* pool_name, const leveldb_rados_options_t* options);
+
+/* An env on an in-memory pool instead of a cluster. Every op completes after
+   latency microseconds, give or take a random jitter of up to jitter
+   microseconds, plus the time its payload takes at bandwidth bytes per
+   second (0 is unlimited) */
+extern leveldb_env_t* leveldb_create_rados_sim_env(size_t latency, size_t jitter, size_t bandwidth, const leveldb_rados_options_t* options);
+
+/* Counters and latency histograms of everything the env has done, NULL if
+   env is not a RADOS env. One line per operation holds its name, the number
+   of ops, errors, bytes and total microseconds and then comma separated
+   counts of ops that took [2^i, 2^(i+1)) microseconds. The last line is
+   "inflight" followed by the ops and bytes currently in flight. The result
+   is malloc()ed and must be free()d */
+extern char* leveldb_rados_env_get_stats(leveldb_env_t* env);
+
+/* A follower opens the DB read-only next to its writer and sees it as of
+   when it was opened. The generation counts the writer's switches to a new
+   MANIFEST while the follower has the DB open, reopen the DB once it
+   differs from what it was at open to catch up */
+extern void leveldb_rados_options_set_follower(leveldb_rados_options_t* options, unsigned char follower);
+
+/* What a follower writes is kept in memory, up to this many bytes. Writes
+   past that fail, and with them an open that would need more */
+extern void leveldb_rados_options_set_follower_memory(leveldb_rados_options_t* options, size_t bytes);
+extern uint64_t leveldb_rados_env_get_generation(leveldb_env_t* env);
+
+/* Snapshot the DB in dbname as it is right now, without pausing or
+   copying anything, and return the id of the checkpoint. The DB has to be
+   open through env as its writer, only writes sent through env preserve
+   the checkpoint. A snapshot env opens it read-only at the checkpoint, as
+   a follower that never changes. Checkpoints are kept until removed, on
+   error *errptr is set */
+extern uint64_t leveldb_rados_env_create_checkpoint(leveldb_env_t* env, const char* dbname, char** errptr);
+extern void leveldb_rados_env_remove_checkpoint(leveldb_env_t* env, const char* dbname, uint64_t snap, char** errptr);
+extern leveldb_env_t* leveldb_create_rados_snapshot_env(const char* config_file, const char* pool_name, uint64_t snap, const leveldb_rados_options_t* options);
+
+/* Add table files built elsewhere, named by the local paths in tables, to
+   the DB in dbname without going through its log or compactions. The DB
+   has to exist, use the bytewise comparator and not be open. Keys in the
+   tables are LevelDB internal keys, the user key followed by the 8 byte
+   little endian tag (sequence << 8 | type), all with sequence 0: what the
+   DB already has wins over them. The tables end up in the last level, so
+   they must not overlap each other or the tables already there. The env
+   takes the DB's writer lock meanwhile and fails with the lock mode none.
+   The tables are uploaded in parallel over half of the env's background
+   threads at low priority, on error *errptr is set and the DB is left as
+   it was */
+extern void leveldb_rados_env_bulk_load(leveldb_env_t* env, const char* dbname, size_t count, const char* const* tables, char** errptr);
+
+/* Get every key in parallel. values[i] is a malloc()ed copy of the value or
+   NULL if the key was not found, on error *errptr is set and no values are
+   returned */
+extern void leveldb_rados_multi_get(leveldb_t* db, const leveldb_readoptions_t* options, size_t count, const char* const* keys, const size_t* keylens, char** values, size_t* vallens, char** errptr);
 }
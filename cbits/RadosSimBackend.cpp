@@ -0,0 +1,719 @@
+#include "RadosBackend.h"
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <sstream>
+#include <unistd.h>
+#include <boost/make_shared.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+// RadosBackend that keeps its objects in memory and completes every op
+// after a simulated delay, so the env can be measured at a known round
+// trip time without a cluster or its noise
+
+class SimCompletion : public RadosCompletion
+{
+public:
+  SimCompletion()
+    : complete_(false)
+    , r_(0)
+  {
+  }
+
+  virtual void WaitForComplete()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!complete_)
+    {
+      cond_.wait(lock);
+    }
+  }
+
+  virtual void WaitForSafe()
+  {
+    // nothing is more durable than memory
+    WaitForComplete();
+  }
+
+  virtual bool IsComplete()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return complete_;
+  }
+
+  virtual int ReturnValue()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return r_;
+  }
+
+  void Complete(int r)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    r_ = r;
+    complete_ = true;
+    cond_.notify_all();
+  }
+
+private:
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  bool complete_;
+  int r_;
+};
+
+// holders of an advisory lock and when their hold expires, 0 is never
+struct SimLock
+{
+  SimLock()
+    : exclusive(false)
+  {
+  }
+
+  bool exclusive;
+  std::map<std::string, uint64_t> holders;
+};
+
+struct SimObject
+{
+  librados::bufferlist data;
+  std::map<std::string, librados::bufferlist> xattrs;
+  std::map<std::string, librados::bufferlist> omap;
+  std::map<std::string, SimLock> locks;
+};
+
+// (namespace, oid)
+typedef std::pair<std::string, std::string> SimKey;
+
+// an object as it was before a write that had to preserve it for a snapshot
+struct SimClone
+{
+  bool exists;
+  SimObject object;
+};
+
+// The objects of every namespace of a simulated pool. Ops are queued with
+// the time they are due and applied by a single thread once that time has
+// come. Like RADOS, ops to the same object complete in the order they
+// were sent. The first write to an object after a snapshot was taken
+// clones it first, and reads at a snapshot read the oldest clone made
+// after it, or the object itself if it hasn't been written since
+class SimPool
+{
+public:
+  explicit SimPool(const RadosSimOptions& options)
+    : options_(options)
+    , rng_(options.seed | 1)
+    , stopping_(false)
+    , last_handle_(0)
+    , last_snap_(0)
+    , thread_(&SimPool::Run, this)
+  {
+  }
+
+  ~SimPool()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+      cond_.notify_all();
+    }
+
+    thread_.join();
+  }
+
+  // seq is the newest snapshot the write has to preserve
+  void Submit(const SimKey& key, SimCompletion* c, const RadosWriteOp& op, uint64_t seq)
+  {
+    uint64_t bytes = 0;
+    for (std::vector<RadosWriteOp::Step>::const_iterator it = op.steps.begin(); it != op.steps.end(); ++it)
+    {
+      bytes += it->bl.length();
+    }
+
+    Pending pending;
+    pending.key = key;
+    pending.c = c;
+    pending.write = op;
+    pending.is_write = true;
+    pending.snap = seq;
+    Enqueue(pending, bytes);
+  }
+
+  void Submit(const SimKey& key, SimCompletion* c, const RadosReadOp& op, uint64_t snap)
+  {
+    uint64_t bytes = 0;
+    for (std::vector<RadosReadOp::Step>::const_iterator it = op.steps.begin(); it != op.steps.end(); ++it)
+    {
+      bytes += it->len;
+    }
+
+    Pending pending;
+    pending.key = key;
+    pending.c = c;
+    pending.read = op;
+    pending.is_write = false;
+    pending.snap = snap;
+    Enqueue(pending, bytes);
+  }
+
+  // locks are taken at once rather than queued, but they take as long as
+  // any other op
+  int Lock(const SimKey& key, const std::string& name, const std::string& cookie, bool exclusive, uint32_t duration, bool renew)
+  {
+    Sleep();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    const uint64_t now = NowMicros();
+    SimLock& held = objects_[key].locks[name];
+    for (std::map<std::string, uint64_t>::iterator it = held.holders.begin(); it != held.holders.end();)
+    {
+      if (it->second != 0 && it->second <= now)
+      {
+        held.holders.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    const bool holding = held.holders.count(cookie) > 0;
+    if (holding && !renew)
+    {
+      return -EEXIST;
+    }
+    else if (!held.holders.empty() && !holding && (exclusive || held.exclusive))
+    {
+      return -EBUSY;
+    }
+
+    held.exclusive = exclusive;
+    held.holders[cookie] = duration > 0 ? now + static_cast<uint64_t>(duration) * 1000000 : 0;
+    return 0;
+  }
+
+  int Unlock(const SimKey& key, const std::string& name, const std::string& cookie)
+  {
+    Sleep();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<SimKey, SimObject>::iterator object = objects_.find(key);
+    if (object == objects_.end() || object->second.locks[name].holders.erase(cookie) == 0)
+    {
+      return -ENOENT;
+    }
+
+    return 0;
+  }
+
+  int Watch(const SimKey& key, RadosWatcher* watcher, uint64_t* handle)
+  {
+    Sleep();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (objects_.count(key) == 0)
+    {
+      return -ENOENT;
+    }
+
+    *handle = ++last_handle_;
+    watchers_[key][*handle] = watcher;
+    return 0;
+  }
+
+  int Unwatch(const SimKey& key, uint64_t handle)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (watchers_[key].erase(handle) == 0)
+    {
+      return -ENOENT;
+    }
+
+    return 0;
+  }
+
+  // watchers are told on the calling thread, outside the pool's lock
+  int Notify(const SimKey& key)
+  {
+    Sleep();
+
+    std::vector<RadosWatcher*> watchers;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      const std::map<uint64_t, RadosWatcher*>& watching = watchers_[key];
+      for (std::map<uint64_t, RadosWatcher*>::const_iterator it = watching.begin(); it != watching.end(); ++it)
+      {
+        watchers.push_back(it->second);
+      }
+    }
+
+    for (size_t i = 0; i < watchers.size(); ++i)
+    {
+      watchers[i]->Notified();
+    }
+
+    return 0;
+  }
+
+  int SnapCreate(uint64_t* snap)
+  {
+    Sleep();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    *snap = ++last_snap_;
+    return 0;
+  }
+
+  // clones aren't trimmed, reads at a removed snapshot just fail
+  int SnapRemove(uint64_t snap)
+  {
+    Sleep();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (snap == 0 || snap > last_snap_ || !removed_snaps_.insert(snap).second)
+    {
+      return -ENOENT;
+    }
+
+    return 0;
+  }
+
+  void List(const std::string& ns, std::vector<std::string>* oids)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    for (std::map<SimKey, SimObject>::const_iterator it = objects_.lower_bound(SimKey(ns, "")); it != objects_.end() && it->first.first == ns; ++it)
+    {
+      oids->push_back(it->first.second);
+    }
+  }
+
+private:
+  struct Pending
+  {
+    SimKey key;
+    SimCompletion* c;
+    bool is_write;
+    RadosWriteOp write;
+    RadosReadOp read;
+    // the snapshot a write preserves or a read reads
+    uint64_t snap;
+  };
+
+  static uint64_t NowMicros()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  // the delay of an op moving bytes of payload, called with mutex_ held
+  uint64_t Delay(uint64_t bytes)
+  {
+    uint64_t delay = options_.latency;
+    if (options_.jitter > 0)
+    {
+      rng_ ^= rng_ << 13;
+      rng_ ^= rng_ >> 7;
+      rng_ ^= rng_ << 17;
+      const uint64_t jitter = rng_ % (2 * options_.jitter + 1);
+      delay = delay + jitter > options_.jitter ? delay + jitter - options_.jitter : 0;
+    }
+
+    if (options_.bandwidth > 0)
+    {
+      delay += bytes * 1000000 / options_.bandwidth;
+    }
+
+    return delay;
+  }
+
+  void Sleep()
+  {
+    uint64_t delay = 0;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      delay = Delay(0);
+    }
+
+    boost::this_thread::sleep(boost::posix_time::microseconds(delay));
+  }
+
+  void Enqueue(const Pending& pending, uint64_t bytes)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    // never due before an earlier op to the same object
+    uint64_t due = NowMicros() + Delay(bytes);
+    uint64_t& last = last_due_[pending.key];
+    due = std::max(due, last);
+    last = due;
+
+    queue_.insert(std::make_pair(due, pending));
+    cond_.notify_all();
+  }
+
+  void Run()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    for (;;)
+    {
+      if (queue_.empty())
+      {
+        if (stopping_)
+        {
+          return;
+        }
+
+        cond_.wait(lock);
+        continue;
+      }
+
+      const uint64_t now = NowMicros();
+      std::multimap<uint64_t, Pending>::iterator it = queue_.begin();
+      if (it->first > now && !stopping_)
+      {
+        cond_.timed_wait(lock, boost::posix_time::microseconds(it->first - now));
+        continue;
+      }
+
+      Pending pending = it->second;
+      queue_.erase(it);
+
+      const int r = pending.is_write ? Apply(pending.key, pending.write, pending.snap) : Apply(pending.key, pending.read, pending.snap);
+      pending.c->Complete(r);
+    }
+  }
+
+  // apply every step to a copy of the object, so a failed op leaves no trace
+  int Apply(const SimKey& key, const RadosWriteOp& op, uint64_t seq)
+  {
+    std::map<SimKey, SimObject>::iterator existing = objects_.find(key);
+    bool exists = existing != objects_.end();
+    SimObject object = exists ? existing->second : SimObject();
+
+    SimClone before = { exists, object };
+
+    for (std::vector<RadosWriteOp::Step>::const_iterator it = op.steps.begin(); it != op.steps.end(); ++it)
+    {
+      switch (it->type)
+      {
+        case RadosWriteOp::Step::kCreate:
+          if (exists && it->exclusive)
+          {
+            return -EEXIST;
+          }
+
+          break;
+        case RadosWriteOp::Step::kSetXattr:
+          object.xattrs[it->name] = it->bl;
+          break;
+        case RadosWriteOp::Step::kAppend:
+          object.data.append(it->bl);
+          break;
+        case RadosWriteOp::Step::kWriteFull:
+          object.data = it->bl;
+          break;
+        case RadosWriteOp::Step::kRemove:
+          if (!exists)
+          {
+            return -ENOENT;
+          }
+
+          object = SimObject();
+          break;
+        case RadosWriteOp::Step::kOmapSet:
+          for (std::map<std::string, librados::bufferlist>::const_iterator val = it->vals.begin(); val != it->vals.end(); ++val)
+          {
+            object.omap[val->first] = val->second;
+          }
+
+          break;
+        case RadosWriteOp::Step::kOmapRmKeys:
+          if (!exists)
+          {
+            return -ENOENT;
+          }
+
+          for (std::set<std::string>::const_iterator k = it->keys.begin(); k != it->keys.end(); ++k)
+          {
+            object.omap.erase(*k);
+          }
+
+          break;
+        case RadosWriteOp::Step::kCopyFrom:
+        {
+          std::map<SimKey, SimObject>::const_iterator src = objects_.find(SimKey(SourceNamespace(it->src), it->name));
+          if (src == objects_.end())
+          {
+            return -ENOENT;
+          }
+
+          object = src->second;
+          break;
+        }
+      }
+
+      exists = it->type != RadosWriteOp::Step::kRemove;
+    }
+
+    // the first write since the newest snapshot keeps what it replaces
+    uint64_t& written = written_[key];
+    if (seq > written)
+    {
+      clones_[key][seq] = before;
+      written = seq;
+    }
+
+    if (exists)
+    {
+      objects_[key] = object;
+    }
+    else
+    {
+      objects_.erase(key);
+    }
+
+    return 0;
+  }
+
+  // the object as of snap, NULL if it didn't exist then
+  const SimObject* Resolve(const SimKey& key, uint64_t snap)
+  {
+    if (snap != 0)
+    {
+      if (removed_snaps_.count(snap) > 0)
+      {
+        return NULL;
+      }
+
+      const std::map<uint64_t, SimClone>& clones = clones_[key];
+      std::map<uint64_t, SimClone>::const_iterator clone = clones.lower_bound(snap);
+      if (clone != clones.end())
+      {
+        return clone->second.exists ? &clone->second.object : NULL;
+      }
+    }
+
+    std::map<SimKey, SimObject>::const_iterator existing = objects_.find(key);
+    return existing != objects_.end() ? &existing->second : NULL;
+  }
+
+  int Apply(const SimKey& key, const RadosReadOp& op, uint64_t snap)
+  {
+    const SimObject* resolved = Resolve(key, snap);
+    if (resolved == NULL)
+    {
+      return -ENOENT;
+    }
+
+    const SimObject& object = *resolved;
+    int r = 0;
+    for (std::vector<RadosReadOp::Step>::const_iterator it = op.steps.begin(); it != op.steps.end(); ++it)
+    {
+      switch (it->type)
+      {
+        case RadosReadOp::Step::kStat:
+          *it->size = object.data.length();
+          break;
+        case RadosReadOp::Step::kRead:
+        {
+          const uint64_t len = it->off < object.data.length() ? std::min(it->len, object.data.length() - it->off) : 0;
+          it->bl->clear();
+          if (len > 0)
+          {
+            it->bl->substr_of(object.data, it->off, len);
+          }
+
+          r = len;
+          break;
+        }
+        case RadosReadOp::Step::kGetXattrs:
+          *it->vals = object.xattrs;
+          break;
+        case RadosReadOp::Step::kOmapGetVals:
+        {
+          it->vals->clear();
+          std::map<std::string, librados::bufferlist>::const_iterator val = object.omap.upper_bound(it->start_after);
+          for (; val != object.omap.end() && it->vals->size() < it->len; ++val)
+          {
+            it->vals->insert(*val);
+          }
+
+          break;
+        }
+      }
+
+      if (it->rval != NULL)
+      {
+        *it->rval = 0;
+      }
+    }
+
+    return op.steps.size() == 1 && op.steps[0].type == RadosReadOp::Step::kRead ? r : 0;
+  }
+
+  static std::string SourceNamespace(const RadosBackend* src);
+
+  const RadosSimOptions options_;
+  uint64_t rng_;
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  bool stopping_;
+  std::multimap<uint64_t, Pending> queue_;
+  std::map<SimKey, uint64_t> last_due_;
+  std::map<SimKey, SimObject> objects_;
+  uint64_t last_handle_;
+  std::map<SimKey, std::map<uint64_t, RadosWatcher*> > watchers_;
+
+  uint64_t last_snap_;
+  std::set<uint64_t> removed_snaps_;
+  // by object, its clones by the snapshot they were made for
+  std::map<SimKey, std::map<uint64_t, SimClone> > clones_;
+  // the newest snapshot each object was written after
+  std::map<SimKey, uint64_t> written_;
+
+  // last, it starts running as soon as it is constructed
+  boost::thread thread_;
+};
+
+class SimBackend : public RadosBackend
+{
+public:
+  SimBackend(const boost::shared_ptr<SimPool>& pool, const std::string& ns)
+    : pool_(pool)
+    , ns_(ns)
+    , seq_(0)
+    , read_snap_(0)
+  {
+  }
+
+  virtual boost::shared_ptr<RadosBackend> ForNamespace(const std::string& ns) const
+  {
+    boost::shared_ptr<SimBackend> backend(new SimBackend(pool_, ns));
+
+    boost::mutex::scoped_lock lock(mutex_);
+    backend->seq_ = seq_;
+    backend->read_snap_ = read_snap_;
+    return backend;
+  }
+
+  // a pool only lives as long as the process, so copies left on disk by
+  // an earlier one never match
+  virtual std::string Name() const
+  {
+    std::ostringstream name;
+    name << "sim-" << getpid() << "-" << pool_.get();
+    return name.str();
+  }
+
+  virtual RadosCompletion* NewCompletion()
+  {
+    return new SimCompletion;
+  }
+
+  virtual int AioOperate(const std::string& oid, RadosCompletion* c, const RadosWriteOp& op)
+  {
+    pool_->Submit(SimKey(ns_, oid), static_cast<SimCompletion*>(c), op, Seq());
+    return 0;
+  }
+
+  virtual int AioOperate(const std::string& oid, RadosCompletion* c, const RadosReadOp& op)
+  {
+    pool_->Submit(SimKey(ns_, oid), static_cast<SimCompletion*>(c), op, ReadSnap());
+    return 0;
+  }
+
+  virtual int ListObjects(std::vector<std::string>* oids)
+  {
+    pool_->List(ns_, oids);
+    return 0;
+  }
+
+  virtual int Lock(const std::string& oid, const std::string& name, const std::string& cookie, bool exclusive, uint32_t duration, bool renew)
+  {
+    return pool_->Lock(SimKey(ns_, oid), name, cookie, exclusive, duration, renew);
+  }
+
+  virtual int Unlock(const std::string& oid, const std::string& name, const std::string& cookie)
+  {
+    return pool_->Unlock(SimKey(ns_, oid), name, cookie);
+  }
+
+  virtual int Watch(const std::string& oid, RadosWatcher* watcher, uint64_t* handle)
+  {
+    return pool_->Watch(SimKey(ns_, oid), watcher, handle);
+  }
+
+  virtual int Unwatch(const std::string& oid, uint64_t handle)
+  {
+    return pool_->Unwatch(SimKey(ns_, oid), handle);
+  }
+
+  virtual int Notify(const std::string& oid)
+  {
+    return pool_->Notify(SimKey(ns_, oid));
+  }
+
+  virtual int SnapCreate(uint64_t* snap)
+  {
+    return pool_->SnapCreate(snap);
+  }
+
+  virtual int SnapRemove(uint64_t snap)
+  {
+    return pool_->SnapRemove(snap);
+  }
+
+  // only the newest snapshot matters, every clone is kept anyway
+  virtual int SetWriteSnaps(const std::vector<uint64_t>& snaps)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    seq_ = snaps.empty() ? 0 : snaps.front();
+    return 0;
+  }
+
+  virtual void SetReadSnap(uint64_t snap)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    read_snap_ = snap;
+  }
+
+  const std::string& ns() const
+  {
+    return ns_;
+  }
+
+private:
+  uint64_t Seq() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return seq_;
+  }
+
+  uint64_t ReadSnap() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return read_snap_;
+  }
+
+  const boost::shared_ptr<SimPool> pool_;
+  const std::string ns_;
+
+  mutable boost::mutex mutex_;
+  uint64_t seq_;
+  uint64_t read_snap_;
+};
+
+std::string SimPool::SourceNamespace(const RadosBackend* src)
+{
+  return static_cast<const SimBackend*>(src)->ns();
+}
+
+boost::shared_ptr<RadosBackend> NewSimulatedBackend(const RadosSimOptions& options)
+{
+  return boost::shared_ptr<RadosBackend>(new SimBackend(boost::make_shared<SimPool>(options), ""));
+}
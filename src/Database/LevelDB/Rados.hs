@@ -1,17 +1,391 @@
 module Database.LevelDB.Rados
-  ( createRadosEnv
+  ( RadosDurability(..)
+  , RadosLockMode(..)
+  , RadosOptions(..)
+  , RadosOpStats(..)
+  , RadosSimOptions(..)
+  , RadosStats(..)
+  , bulkLoad
+  , createCheckpoint
+  , createRadosEnv
+  , createRadosEnvWithOptions
+  , createRadosSimEnv
+  , createRadosSnapshotEnv
+  , defaultRadosOptions
+  , getRadosGeneration
+  , getRadosStats
+  , multiGet
+  , removeCheckpoint
   ) where
 
+import Control.Exception (bracket)
+import Control.Monad (unless)
+import Data.ByteString (ByteString)
+import Data.ByteString.Unsafe (unsafePackMallocCStringLen, unsafeUseAsCStringLen)
 import Database.LevelDB (Env(..))
-import Database.LevelDB.C (EnvPtr)
-import Foreign.C.String (CString, withCString)
+import Database.LevelDB.C (EnvPtr, LevelDBPtr, ReadOptionsPtr)
+import Foreign.C.String (CString, peekCString, withCString)
+import Data.Word (Word64)
+import Foreign.C.Types (CInt(..), CSize(..), CUChar(..))
+import Foreign.Marshal.Alloc (alloca, free)
+import Foreign.Marshal.Array (allocaArray, peekArray, withArrayLen, withArray)
+import Foreign.Marshal.Utils (withMany)
+import Foreign.Ptr (Ptr, nullPtr)
+import Foreign.Storable (peek, poke)
 
 type PoolName = String
 
+data RadosOptions'
+type RadosOptionsPtr = Ptr RadosOptions'
+
+data RadosOptions = RadosOptions
+  { readaheadSize :: !Int
+  -- ^ size of each chunk read ahead by sequential files, 0 disables read-ahead
+  , blockCacheSize :: !Int
+  -- ^ byte budget of the table block cache shared by the environment, 0 disables it
+  , blockCachePageSize :: !Int
+  -- ^ table files are cached in aligned pages of this many bytes
+  , blockCachePinnedPages :: !Int
+  -- ^ cached pages each open table file may hand out without copying
+  , tableWriteBufferSize :: !Int
+  -- ^ appends to table files are coalesced until this many bytes are buffered
+  , logWriteBufferSize :: !Int
+  -- ^ same for logs and other files, which are also sent on every flush
+  , maxInflightOps :: !Int
+  -- ^ appends a writable file may have outstanding before new ones block
+  , maxInflightBytes :: !Int
+  -- ^ bytes a writable file may have outstanding before new appends block
+  , stripeUnit :: !Int
+  -- ^ table files are striped over several objects in units of this many bytes
+  , stripeCount :: !Int
+  -- ^ number of objects each table is striped over, 1 disables striping
+  , tableTailSize :: !Int
+  -- ^ bytes at the end of a table fetched by its first read, 0 disables it
+  , scanReadaheadSize :: !Int
+  -- ^ a table read sequentially, as compactions do, reads ahead in chunks
+  -- that double from 256KB up to this many bytes, 0 disables it
+  , scanReadaheadMemory :: !Int
+  -- ^ bytes the read-ahead of all scans holds at most, scans past that read ahead less
+  , localCacheDir :: !FilePath
+  -- ^ local directory tables are copied to and read from, empty disables it
+  , localCacheSize :: !Int
+  -- ^ bytes of tables kept in 'localCacheDir', least recently opened are evicted first
+  , localLogDir :: !FilePath
+  -- ^ local directory logs are synced to before being shipped to RADOS in the
+  -- background, trading a bounded loss on losing the host for commit latency.
+  -- empty keeps logs in RADOS only
+  , backgroundThreads :: !Int
+  -- ^ threads running compactions and the environment's background copies
+  , lockMode :: !RadosLockMode
+  -- ^ how the DB is locked while it is open
+  , lockLease :: !Int
+  -- ^ seconds a lock lasts unless renewed, the environment renews it while
+  -- the DB is open. A writer that could not renew it in time fails every
+  -- write until the DB is reopened. 0 never expires
+  , follower :: !Bool
+  -- ^ open the DB read-only next to its writer, which never sees what the
+  -- follower writes. Reopen the DB when 'getRadosGeneration' changes to
+  -- catch up with the writer
+  , followerMemory :: !Int
+  -- ^ bytes of files a follower keeps in memory, an open that writes more
+  -- fails
+  , clientId :: !String
+  -- ^ cephx user to connect as, without the @client.@ prefix, empty is the
+  -- librados default. Environments on the same config file and client id
+  -- share one connection
+  , infoLogSize :: !Int
+  -- ^ the info LOG is kept in the pool and rotated past this many bytes, 0
+  -- writes it to local disk instead
+  , logDurability :: !RadosDurability
+  -- ^ what syncing a log waits for
+  , tableDurability :: !RadosDurability
+  -- ^ what syncing a table waits for
+  , descriptorDurability :: !RadosDurability
+  -- ^ what syncing any other file, such as the MANIFEST, waits for
+  } deriving (Eq, Show)
+
+-- | How an instance locks the DB it opens
+data RadosLockMode
+  = LockExclusive
+  -- ^ as the one writer
+  | LockShared
+  -- ^ as one of any number of read-only instances running next to the
+  -- writer, which implies 'follower'
+  | LockNone
+    deriving (Eq, Show, Enum)
+
+-- | What a sync waits for. Closing a file waits for 'DurabilityComplete',
+-- whatever the level
+data RadosDurability
+  = DurabilityNone
+  -- ^ nothing, appends are only sent
+  | DurabilityComplete
+  -- ^ appends have been applied by the OSDs, possibly only in memory
+  | DurabilitySafe
+  -- ^ appends are on disk on every replica
+    deriving (Eq, Show, Enum)
+
+-- | How the simulated pool of 'createRadosSimEnv' behaves
+data RadosSimOptions = RadosSimOptions
+  { simLatency :: !Int
+  -- ^ microseconds every op takes
+  , simJitter :: !Int
+  -- ^ ops take up to this many microseconds more or less, at random
+  , simBandwidth :: !Int
+  -- ^ bytes per second payloads move at, 0 is unlimited
+  } deriving (Eq, Show)
+
+data RadosOpStats = RadosOpStats
+  { opName :: !String
+  , opCount :: !Int
+  , opErrors :: !Int
+  , opBytes :: !Int
+  , opMicros :: !Int
+  -- ^ total time spent in the operation
+  , opLatency :: ![Int]
+  -- ^ bucket @i@ counts calls that took [2^i, 2^(i+1)) microseconds, the first and last are open ended
+  } deriving (Eq, Show)
+
+data RadosStats = RadosStats
+  { radosOpStats :: ![RadosOpStats]
+  , radosInflightOps :: !Int
+  -- ^ RADOS ops sent by writable files that have not completed yet
+  , radosInflightBytes :: !Int
+  } deriving (Eq, Show)
+
+defaultRadosOptions :: RadosOptions
+defaultRadosOptions = RadosOptions
+  { readaheadSize = 4 * 1024 * 1024
+  , blockCacheSize = 32 * 1024 * 1024
+  , blockCachePageSize = 16 * 1024
+  , blockCachePinnedPages = 4
+  , tableWriteBufferSize = 1024 * 1024
+  , logWriteBufferSize = 64 * 1024
+  , maxInflightOps = 16
+  , maxInflightBytes = 16 * 1024 * 1024
+  , stripeUnit = 4 * 1024 * 1024
+  , stripeCount = 1
+  , tableTailSize = 64 * 1024
+  , scanReadaheadSize = 8 * 1024 * 1024
+  , scanReadaheadMemory = 64 * 1024 * 1024
+  , localCacheDir = ""
+  , localCacheSize = 0
+  , localLogDir = ""
+  , backgroundThreads = 4
+  , lockMode = LockExclusive
+  , lockLease = 30
+  , follower = False
+  , followerMemory = 256 * 1024 * 1024
+  , clientId = ""
+  , infoLogSize = 4 * 1024 * 1024
+  , logDurability = DurabilitySafe
+  , tableDurability = DurabilitySafe
+  , descriptorDurability = DurabilitySafe
+  }
+
 foreign import ccall safe leveldb_create_rados_env :: CString -> CString -> IO EnvPtr
+foreign import ccall safe leveldb_create_rados_env_with_options :: CString -> CString -> RadosOptionsPtr -> IO EnvPtr
+
+foreign import ccall unsafe leveldb_rados_env_get_stats :: EnvPtr -> IO CString
+foreign import ccall unsafe leveldb_rados_env_get_generation :: EnvPtr -> IO Word64
+foreign import ccall safe leveldb_rados_multi_get :: LevelDBPtr -> ReadOptionsPtr -> CSize -> Ptr CString -> Ptr CSize -> Ptr CString -> Ptr CSize -> Ptr CString -> IO ()
+
+foreign import ccall safe leveldb_create_rados_snapshot_env :: CString -> CString -> Word64 -> RadosOptionsPtr -> IO EnvPtr
+foreign import ccall safe leveldb_rados_env_create_checkpoint :: EnvPtr -> CString -> Ptr CString -> IO Word64
+foreign import ccall safe leveldb_rados_env_remove_checkpoint :: EnvPtr -> CString -> Word64 -> Ptr CString -> IO ()
+foreign import ccall safe leveldb_rados_env_bulk_load :: EnvPtr -> CString -> CSize -> Ptr CString -> Ptr CString -> IO ()
+
+foreign import ccall safe leveldb_create_rados_sim_env :: CSize -> CSize -> CSize -> RadosOptionsPtr -> IO EnvPtr
+
+foreign import ccall unsafe leveldb_rados_options_create :: IO RadosOptionsPtr
+foreign import ccall unsafe leveldb_rados_options_destroy :: RadosOptionsPtr -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_readahead_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_block_cache_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_block_cache_page_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_block_cache_pinned_pages :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_table_write_buffer_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_log_write_buffer_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_max_inflight_ops :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_max_inflight_bytes :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_stripe_unit :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_stripe_count :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_table_tail_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_scan_readahead_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_scan_readahead_memory :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_local_cache_dir :: RadosOptionsPtr -> CString -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_local_cache_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_local_log_dir :: RadosOptionsPtr -> CString -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_background_threads :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_lock_mode :: RadosOptionsPtr -> CInt -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_lock_lease :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_follower :: RadosOptionsPtr -> CUChar -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_follower_memory :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_client_id :: RadosOptionsPtr -> CString -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_info_log_size :: RadosOptionsPtr -> CSize -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_log_durability :: RadosOptionsPtr -> CInt -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_table_durability :: RadosOptionsPtr -> CInt -> IO ()
+foreign import ccall unsafe leveldb_rados_options_set_descriptor_durability :: RadosOptionsPtr -> CInt -> IO ()
 
 createRadosEnv :: FilePath -> PoolName -> IO Env
 createRadosEnv filePath poolName =
   withCString filePath $ \ filePathStr ->
   withCString poolName $ \ poolNameStr ->
     fmap Env $ leveldb_create_rados_env filePathStr poolNameStr
+
+createRadosEnvWithOptions :: FilePath -> PoolName -> RadosOptions -> IO Env
+createRadosEnvWithOptions filePath poolName options =
+  withCString filePath $ \ filePathStr ->
+  withCString poolName $ \ poolNameStr ->
+  withRadosOptions options $ \ optionsPtr ->
+    fmap Env $ leveldb_create_rados_env_with_options filePathStr poolNameStr optionsPtr
+
+-- | A read-only environment that sees the pool as of a checkpoint, a DB
+-- opened in it is a follower that never has to catch up
+createRadosSnapshotEnv :: FilePath -> PoolName -> Word64 -> RadosOptions -> IO Env
+createRadosSnapshotEnv filePath poolName snap options =
+  withCString filePath $ \ filePathStr ->
+  withCString poolName $ \ poolNameStr ->
+  withRadosOptions options $ \ optionsPtr ->
+    fmap Env $ leveldb_create_rados_snapshot_env filePathStr poolNameStr snap optionsPtr
+
+-- | An environment on an in-memory pool instead of a cluster, for measuring
+-- the environment at a known round trip time
+createRadosSimEnv :: RadosSimOptions -> RadosOptions -> IO Env
+createRadosSimEnv sim options =
+  withRadosOptions options $ \ optionsPtr ->
+    fmap Env $ leveldb_create_rados_sim_env
+      (fromIntegral (simLatency sim))
+      (fromIntegral (simJitter sim))
+      (fromIntegral (simBandwidth sim))
+      optionsPtr
+
+withRadosOptions :: RadosOptions -> (RadosOptionsPtr -> IO a) -> IO a
+withRadosOptions options action =
+  bracket leveldb_rados_options_create leveldb_rados_options_destroy $ \ ptr -> do
+    leveldb_rados_options_set_readahead_size ptr (fromIntegral (readaheadSize options))
+    leveldb_rados_options_set_block_cache_size ptr (fromIntegral (blockCacheSize options))
+    leveldb_rados_options_set_block_cache_page_size ptr (fromIntegral (blockCachePageSize options))
+    leveldb_rados_options_set_block_cache_pinned_pages ptr (fromIntegral (blockCachePinnedPages options))
+    leveldb_rados_options_set_table_write_buffer_size ptr (fromIntegral (tableWriteBufferSize options))
+    leveldb_rados_options_set_log_write_buffer_size ptr (fromIntegral (logWriteBufferSize options))
+    leveldb_rados_options_set_max_inflight_ops ptr (fromIntegral (maxInflightOps options))
+    leveldb_rados_options_set_max_inflight_bytes ptr (fromIntegral (maxInflightBytes options))
+    leveldb_rados_options_set_stripe_unit ptr (fromIntegral (stripeUnit options))
+    leveldb_rados_options_set_stripe_count ptr (fromIntegral (stripeCount options))
+    leveldb_rados_options_set_table_tail_size ptr (fromIntegral (tableTailSize options))
+    leveldb_rados_options_set_scan_readahead_size ptr (fromIntegral (scanReadaheadSize options))
+    leveldb_rados_options_set_scan_readahead_memory ptr (fromIntegral (scanReadaheadMemory options))
+    withCString (localCacheDir options) $ leveldb_rados_options_set_local_cache_dir ptr
+    leveldb_rados_options_set_local_cache_size ptr (fromIntegral (localCacheSize options))
+    withCString (localLogDir options) $ leveldb_rados_options_set_local_log_dir ptr
+    leveldb_rados_options_set_background_threads ptr (fromIntegral (backgroundThreads options))
+    leveldb_rados_options_set_lock_mode ptr (fromIntegral (fromEnum (lockMode options)))
+    leveldb_rados_options_set_lock_lease ptr (fromIntegral (lockLease options))
+    leveldb_rados_options_set_follower ptr (if follower options then 1 else 0)
+    leveldb_rados_options_set_follower_memory ptr (fromIntegral (followerMemory options))
+    withCString (clientId options) $ leveldb_rados_options_set_client_id ptr
+    leveldb_rados_options_set_info_log_size ptr (fromIntegral (infoLogSize options))
+    leveldb_rados_options_set_log_durability ptr (fromIntegral (fromEnum (logDurability options)))
+    leveldb_rados_options_set_table_durability ptr (fromIntegral (fromEnum (tableDurability options)))
+    leveldb_rados_options_set_descriptor_durability ptr (fromIntegral (fromEnum (descriptorDurability options)))
+    action ptr
+
+-- | Counters of every operation the environment has done so far, or
+-- 'Nothing' if it is not a RADOS environment
+getRadosStats :: Env -> IO (Maybe RadosStats)
+getRadosStats (Env env) = do
+  str <- leveldb_rados_env_get_stats env
+  if str == nullPtr
+    then return Nothing
+    else do
+      stats <- peekCString str
+      free str
+      return $! Just (parseRadosStats stats)
+
+-- | How often the writer has switched to a new MANIFEST while a follower
+-- had the DB open, 0 for any other environment
+getRadosGeneration :: Env -> IO Word64
+getRadosGeneration (Env env) = leveldb_rados_env_get_generation env
+
+-- | Snapshot the DB in a directory as it is right now and return the id of
+-- the checkpoint, open it with 'createRadosSnapshotEnv'. Nothing is copied
+-- and the DB stays open meanwhile. The DB has to be open through this
+-- environment as its writer, writes from anywhere else would not preserve
+-- the checkpoint
+createCheckpoint :: Env -> FilePath -> IO Word64
+createCheckpoint (Env env) dbname =
+  withCString dbname $ \ dbnameStr ->
+    checkError $ leveldb_rados_env_create_checkpoint env dbnameStr
+
+-- | Drop a checkpoint created by 'createCheckpoint'
+removeCheckpoint :: Env -> FilePath -> Word64 -> IO ()
+removeCheckpoint (Env env) dbname snap =
+  withCString dbname $ \ dbnameStr ->
+    checkError $ leveldb_rados_env_remove_checkpoint env dbnameStr snap
+
+-- | Add table files built elsewhere to a DB that exists but isn't open,
+-- without going through its log or compactions. Keys in the tables are
+-- LevelDB internal keys with sequence 0, so whatever the DB already holds
+-- wins over them, and the tables are added to the last level: they must
+-- not overlap each other or what is already there. The DB is locked as
+-- its writer meanwhile, an environment with 'LockNone' can't load
+bulkLoad :: Env -> FilePath -> [FilePath] -> IO ()
+bulkLoad (Env env) dbname tables =
+  withCString dbname $ \ dbnameStr ->
+  withMany withCString tables $ \ tableStrs ->
+  withArrayLen tableStrs $ \ count tablesPtr ->
+    checkError $ leveldb_rados_env_bulk_load env dbnameStr (fromIntegral count) tablesPtr
+
+checkError :: (Ptr CString -> IO a) -> IO a
+checkError action =
+  alloca $ \ errPtr -> do
+    poke errPtr nullPtr
+    result <- action errPtr
+    err <- peek errPtr
+    unless (err == nullPtr) $ do
+      msg <- peekCString err
+      free err
+      ioError (userError msg)
+    return result
+
+parseRadosStats :: String -> RadosStats
+parseRadosStats = foldr step (RadosStats [] 0 0) . lines
+  where
+    step line stats = case words line of
+      ["inflight", ops, bytes] ->
+        stats { radosInflightOps = read ops, radosInflightBytes = read bytes }
+      [name, ops, errors, bytes, micros, latency] ->
+        let op = RadosOpStats name (read ops) (read errors) (read bytes) (read micros) (map read (splitOn ',' latency))
+        in stats { radosOpStats = op : radosOpStats stats }
+      _ -> stats
+
+    splitOn c str = case break (== c) str of
+      (x, []) -> [x]
+      (x, _:rest) -> x : splitOn c rest
+
+-- | Look up every key at once. The lookups run in parallel so their reads
+-- are all in flight together, which makes a large batch cost roughly one
+-- round trip per level instead of one per key
+multiGet :: LevelDBPtr -> ReadOptionsPtr -> [ByteString] -> IO [Maybe ByteString]
+multiGet db readOptions keys =
+  withMany unsafeUseAsCStringLen keys $ \ keyStrs ->
+  withArrayLen (map fst keyStrs) $ \ count keysPtr ->
+  withArray (map (fromIntegral . snd) keyStrs) $ \ keyLensPtr ->
+  allocaArray count $ \ valuesPtr ->
+  allocaArray count $ \ valueLensPtr ->
+  alloca $ \ errPtr -> do
+    poke errPtr nullPtr
+    leveldb_rados_multi_get db readOptions (fromIntegral count) keysPtr keyLensPtr valuesPtr valueLensPtr errPtr
+    err <- peek errPtr
+    unless (err == nullPtr) $ do
+      msg <- peekCString err
+      free err
+      ioError (userError msg)
+    values <- peekArray count valuesPtr
+    valueLens <- peekArray count valueLensPtr
+    sequence (zipWith packValue values valueLens)
+
+  where
+    packValue value len
+      | value == nullPtr = return Nothing
+      | otherwise = fmap Just (unsafePackMallocCStringLen (value, fromIntegral len))
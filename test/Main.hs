@@ -0,0 +1,13 @@
+module Main (main) where
+
+import Foreign.C.Types (CInt(..))
+import System.Exit (ExitCode(..), exitWith)
+
+foreign import ccall safe leveldb_rados_test_main :: IO CInt
+
+-- | The tests live in test/RadosTest.cpp and run against simulated pools,
+-- this only reports how many failed
+main :: IO ()
+main = do
+  failed <- leveldb_rados_test_main
+  exitWith $ if failed == 0 then ExitSuccess else ExitFailure (fromIntegral failed)
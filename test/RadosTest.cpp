@@ -0,0 +1,346 @@
+#include <leveldb/comparator.h>
+#include <leveldb/db.h>
+#include <leveldb/env.h>
+#include <leveldb/iterator.h>
+#include <leveldb/options.h>
+#include <leveldb/table_builder.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "RadosEnv.h"
+
+using namespace std;
+
+// sadly this is internal to LevelDB
+struct leveldb_env_t
+{
+  leveldb::Env* rep;
+  bool is_default;
+};
+
+#define TEST_CHECK(cond) \
+  do \
+  { \
+    if (!(cond)) \
+    { \
+      cerr << __FILE__ << ":" << __LINE__ << ": " << #cond << endl; \
+      return false; \
+    } \
+  } while (0)
+
+#define TEST_CHECK_OK(expr) \
+  do \
+  { \
+    const leveldb::Status s_ = (expr); \
+    if (!s_.ok()) \
+    { \
+      cerr << __FILE__ << ":" << __LINE__ << ": " << s_.ToString() << endl; \
+      return false; \
+    } \
+  } while (0)
+
+// LevelDB's ordering of internal keys, user keys ascending and then tags
+// descending. tables handed to a bulk load have to be built with it.
+// keys are never shortened, so the index only holds real internal keys
+class TestInternalComparator : public leveldb::Comparator
+{
+public:
+  virtual int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const
+  {
+    const int r = UserKey(a).compare(UserKey(b));
+    if (r != 0)
+    {
+      return r;
+    }
+
+    const uint64_t ta = Tag(a);
+    const uint64_t tb = Tag(b);
+    return ta > tb ? -1 : ta < tb ? 1 : 0;
+  }
+
+  virtual const char* Name() const
+  {
+    return "leveldb.InternalKeyComparator";
+  }
+
+  virtual void FindShortestSeparator(std::string*, const leveldb::Slice&) const
+  {
+  }
+
+  virtual void FindShortSuccessor(std::string*) const
+  {
+  }
+
+private:
+  static leveldb::Slice UserKey(const leveldb::Slice& key)
+  {
+    return leveldb::Slice(key.data(), key.size() - 8);
+  }
+
+  static uint64_t Tag(const leveldb::Slice& key)
+  {
+    uint64_t tag = 0;
+    for (int i = 7; i >= 0; --i)
+    {
+      tag = tag << 8 | static_cast<unsigned char>(key[key.size() - 8 + i]);
+    }
+
+    return tag;
+  }
+};
+
+// a value for user_key at sequence
+static std::string InternalKey(const std::string& user_key, uint64_t sequence)
+{
+  const uint64_t tag = sequence << 8 | 1;
+  std::string key = user_key;
+  for (int i = 0; i < 8; ++i)
+  {
+    key.push_back(static_cast<char>(tag >> (8 * i)));
+  }
+
+  return key;
+}
+
+static std::string Key(int i)
+{
+  char buf[16];
+  snprintf(buf, sizeof(buf), "k%03d", i);
+  return buf;
+}
+
+// a table on local disk holding keys, in order, with the value "table"
+static bool BuildTable(const std::string& fname, const std::vector<std::string>& keys)
+{
+  TestInternalComparator comparator;
+  leveldb::Options options;
+  options.comparator = &comparator;
+
+  leveldb::WritableFile* file = NULL;
+  TEST_CHECK_OK(leveldb::Env::Default()->NewWritableFile(fname, &file));
+
+  leveldb::TableBuilder* builder = new leveldb::TableBuilder(options, file);
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    builder->Add(keys[i], "table");
+  }
+
+  const leveldb::Status s = builder->Finish();
+  delete builder;
+  const leveldb::Status c = file->Close();
+  delete file;
+
+  TEST_CHECK_OK(s);
+  TEST_CHECK_OK(c);
+  return true;
+}
+
+static bool Put(leveldb::Env* env, const std::string& dbname, const std::string& key, const std::string& value)
+{
+  leveldb::Options options;
+  options.env = env;
+  options.create_if_missing = true;
+  leveldb::DB* db = NULL;
+  TEST_CHECK_OK(leveldb::DB::Open(options, dbname, &db));
+
+  const leveldb::Status s = db->Put(leveldb::WriteOptions(), key, value);
+  delete db;
+
+  TEST_CHECK_OK(s);
+  return true;
+}
+
+static bool BulkLoad(leveldb_env_t* env, const std::string& dbname, const std::string& table, std::string* error)
+{
+  const char* tables[] = { table.c_str() };
+  char* err = NULL;
+  leveldb_rados_env_bulk_load(env, dbname.c_str(), 1, tables, &err);
+  if (err != NULL)
+  {
+    *error = err;
+    free(err);
+  }
+
+  return err == NULL;
+}
+
+// LevelDB opens the MANIFEST the load wrote and sees the loaded keys below
+// what the DB already had
+static bool TestBulkLoadOpens(leveldb_env_t* env, const std::string& dir)
+{
+  const std::string dbname = "bulkload";
+  TEST_CHECK(Put(env->rep, dbname, Key(50), "db"));
+  TEST_CHECK(Put(env->rep, dbname, "z", "db"));
+
+  std::vector<std::string> keys;
+  for (int i = 0; i < 100; ++i)
+  {
+    keys.push_back(InternalKey(Key(i), 0));
+  }
+
+  const std::string table = dir + "/bulkload.ldb";
+  TEST_CHECK(BuildTable(table, keys));
+
+  std::string error;
+  const bool loaded = BulkLoad(env, dbname, table, &error);
+  if (!loaded)
+  {
+    cerr << "bulk load: " << error << endl;
+  }
+
+  TEST_CHECK(loaded);
+
+  leveldb::Options options;
+  options.env = env->rep;
+  leveldb::DB* db = NULL;
+  TEST_CHECK_OK(leveldb::DB::Open(options, dbname, &db));
+
+  std::string value;
+  leveldb::Status s = db->Get(leveldb::ReadOptions(), Key(0), &value);
+  const bool first = s.ok() && value == "table";
+  s = db->Get(leveldb::ReadOptions(), Key(50), &value);
+  const bool shadowed = s.ok() && value == "db";
+  s = db->Get(leveldb::ReadOptions(), "z", &value);
+  const bool kept = s.ok() && value == "db";
+
+  int count = 0;
+  leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next())
+  {
+    ++count;
+  }
+
+  delete it;
+  delete db;
+
+  TEST_CHECK(first);
+  TEST_CHECK(shadowed);
+  TEST_CHECK(kept);
+  TEST_CHECK(count == 101);
+  return true;
+}
+
+// a single key with a sequence other than 0 fails the load, and the DB
+// is left as it was
+static bool TestBulkLoadChecksEveryKey(leveldb_env_t* env, const std::string& dir)
+{
+  const std::string dbname = "badload";
+  TEST_CHECK(Put(env->rep, dbname, "a", "db"));
+
+  std::vector<std::string> keys;
+  keys.push_back(InternalKey(Key(0), 0));
+  keys.push_back(InternalKey(Key(1), 5));
+  keys.push_back(InternalKey(Key(2), 0));
+
+  const std::string table = dir + "/badload.ldb";
+  TEST_CHECK(BuildTable(table, keys));
+
+  std::string error;
+  TEST_CHECK(!BulkLoad(env, dbname, table, &error));
+
+  leveldb::Options options;
+  options.env = env->rep;
+  leveldb::DB* db = NULL;
+  TEST_CHECK_OK(leveldb::DB::Open(options, dbname, &db));
+
+  std::string value;
+  const leveldb::Status missing = db->Get(leveldb::ReadOptions(), Key(0), &value);
+  const leveldb::Status kept = db->Get(leveldb::ReadOptions(), "a", &value);
+  delete db;
+
+  TEST_CHECK(missing.IsNotFound());
+  TEST_CHECK(kept.ok() && value == "db");
+  return true;
+}
+
+// two files scanned side by side by an env whose read-ahead budget only
+// fits a chunk or two read back what was written
+static bool TestScanWithinBudget(leveldb_env_t* env, const std::string&)
+{
+  const size_t size = 2 << 20;
+  const char* names[] = { "scan/000001.ldb", "scan/000002.ldb" };
+  for (int i = 0; i < 2; ++i)
+  {
+    std::string data(size, 0);
+    for (size_t pos = 0; pos < size; ++pos)
+    {
+      data[pos] = static_cast<char>(pos * (i + 3) >> 4);
+    }
+
+    leveldb::WritableFile* file = NULL;
+    TEST_CHECK_OK(env->rep->NewWritableFile(names[i], &file));
+    const leveldb::Status s = file->Append(data);
+    const leveldb::Status c = file->Close();
+    delete file;
+    TEST_CHECK_OK(s);
+    TEST_CHECK_OK(c);
+  }
+
+  leveldb::RandomAccessFile* files[2] = { NULL, NULL };
+  TEST_CHECK_OK(env->rep->NewRandomAccessFile(names[0], &files[0]));
+  const leveldb::Status opened = env->rep->NewRandomAccessFile(names[1], &files[1]);
+
+  bool same = opened.ok();
+  const size_t block = 4 << 10;
+  std::vector<char> scratch(block);
+  for (size_t off = 0; same && off < size; off += block)
+  {
+    for (int i = 0; same && i < 2; ++i)
+    {
+      leveldb::Slice result;
+      same = files[i]->Read(off, block, &result, &scratch[0]).ok() && result.size() == block;
+      for (size_t pos = 0; same && pos < block; ++pos)
+      {
+        same = result[pos] == static_cast<char>((off + pos) * (i + 3) >> 4);
+      }
+    }
+  }
+
+  delete files[0];
+  delete files[1];
+
+  TEST_CHECK_OK(opened);
+  TEST_CHECK(same);
+  return true;
+}
+
+// Runs every test against its own simulated pool, returns the number
+// that failed
+extern "C" int leveldb_rados_test_main()
+{
+  std::string dir;
+  leveldb::Env::Default()->GetTestDirectory(&dir);
+
+  struct Test
+  {
+    const char* name;
+    bool (*run)(leveldb_env_t* env, const std::string& dir);
+  };
+
+  const Test tests[] =
+  {
+    { "bulk_load_opens", TestBulkLoadOpens },
+    { "bulk_load_checks_every_key", TestBulkLoadChecksEveryKey },
+    { "scan_within_budget", TestScanWithinBudget }
+  };
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+  {
+    leveldb_rados_options_t* options = leveldb_rados_options_create();
+    leveldb_rados_options_set_scan_readahead_memory(options, 600 << 10);
+    leveldb_env_t* env = leveldb_create_rados_sim_env(100, 0, 0, options);
+    leveldb_rados_options_destroy(options);
+
+    const bool ok = tests[i].run(env, dir);
+    cout << (ok ? "ok   " : "FAIL ") << tests[i].name << endl;
+    failed += ok ? 0 : 1;
+
+    leveldb_env_destroy(env);
+  }
+
+  return failed;
+}